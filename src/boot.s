@@ -1,30 +1,94 @@
-.set ALIGN,    1<<0            
-.set MEMINFO,  1<<1             
-.set FLAGS,    ALIGN | MEMINFO  
+.set ALIGN,    1<<0
+.set MEMINFO,  1<<1
+.set FLAGS,    ALIGN | MEMINFO
 .set MAGIC,    0x1BADB002       /* 'magic number' lets bootloader find the header */
 .set CHECKSUM, -(MAGIC + FLAGS) /* checksum of above, to prove we are multiboot */
 
-.section .multiboot
+.set KERNEL_VIRT_BASE, 0xC0000000   /* Must match paging.h and linker.ld */
+.set PDE_LARGE_RW,     0x83         /* present | writable | 4 MB page */
+.set BOOT_PDES,        4            /* 16 MB mapped in the higher half before paging_init */
+
+.section .multiboot.data, "aw"
 .align 4
 .long MAGIC
 .long FLAGS
 .long CHECKSUM
 
-.section .bss
+.section .bss, "aw", @nobits
+.align 4096
+.global boot_page_directory
+boot_page_directory:
+.skip 4096
 .align 16
 stack_bottom:
 .skip 16384 # 16 KiB
 stack_top:
 
-.section .text
+/* Flat code and data segments. The bootloader's GDT lives in low memory that
+   stops being mapped once paging_init drops the identity mapping. */
+.section .data
+.align 8
+gdt:
+.quad 0x0000000000000000        /* null descriptor */
+.quad 0x00CF9A000000FFFF        /* 0x08: kernel code, base 0, limit 4 GB */
+.quad 0x00CF92000000FFFF        /* 0x10: kernel data, base 0, limit 4 GB */
+gdt_descriptor:
+.word gdt_descriptor - gdt - 1
+.long gdt
+
+/* Runs at the physical load address with paging off, so every kernel symbol
+   has to be translated with KERNEL_VIRT_BASE. EAX and EBX hold the multiboot
+   magic and info pointer and must survive until kernel_main. */
+.section .multiboot.text, "ax"
 .global _start
 .type _start, @function
 _start:
+	movl $(boot_page_directory - KERNEL_VIRT_BASE), %edi
+
+	/* Identity map the first 4 MB so execution continues after CR0.PG */
+	movl $PDE_LARGE_RW, (%edi)
+
+	/* Map the first 16 MB at KERNEL_VIRT_BASE */
+	leal ((KERNEL_VIRT_BASE >> 22) * 4)(%edi), %esi
+	movl $PDE_LARGE_RW, %ecx
+	movl $BOOT_PDES, %edx
+1:	movl %ecx, (%esi)
+	addl $0x400000, %ecx
+	addl $4, %esi
+	decl %edx
+	jnz 1b
+
+	/* Enable 4 MB pages, load the directory and turn on paging */
+	movl %cr4, %ecx
+	orl $0x10, %ecx                 /* CR4.PSE */
+	movl %ecx, %cr4
+	movl %edi, %cr3
+	movl %cr0, %ecx
+	orl $0x80010000, %ecx           /* CR0.PG | CR0.WP */
+	movl %ecx, %cr0
+
+	movl $higher_half, %ecx
+	jmp *%ecx
+
+.size _start, . - _start
+
+.section .text
+higher_half:
+	lgdt gdt_descriptor
+	ljmp $0x08, $2f
+2:	movw $0x10, %cx
+	movw %cx, %ds
+	movw %cx, %es
+	movw %cx, %fs
+	movw %cx, %gs
+	movw %cx, %ss
 	mov $stack_top, %esp
+
+	/* Pass the multiboot magic (EAX) and info structure (EBX, physical) to kernel_main */
+	push %ebx
+	push %eax
 	call kernel_main
 
 	cli
 1:	hlt
 	jmp 1b
-
-.size _start, . - _start
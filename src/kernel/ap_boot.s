@@ -0,0 +1,65 @@
+/* Must match AP_TRAMPOLINE_ADDR in smp.c */
+.set AP_TRAMPOLINE_ADDR, 0x8000
+
+/*
+ * Application processors start here in real mode after the startup IPI.
+ * smp_init copies this block to AP_TRAMPOLINE_ADDR and fills in ap_cr3,
+ * ap_stack and ap_entry before waking each AP; addresses inside the block are
+ * computed for where it runs, not where it is linked. The code enters
+ * protected mode with its own GDT, turns on paging with the kernel's page
+ * directory (which temporarily identity maps the first 4 MB so the next
+ * instruction is still mapped) and jumps to ap_entry in the higher half.
+ */
+.section .rodata
+.code16
+.global ap_trampoline_start
+ap_trampoline_start:
+	cli
+	cld
+	xorw %ax, %ax
+	movw %ax, %ds
+	lgdtl (ap_gdt_descriptor - ap_trampoline_start + AP_TRAMPOLINE_ADDR)
+	movl %cr0, %eax
+	orl $1, %eax                    /* CR0.PE */
+	movl %eax, %cr0
+	ljmpl $0x08, $(ap_protected_mode - ap_trampoline_start + AP_TRAMPOLINE_ADDR)
+
+.code32
+ap_protected_mode:
+	movw $0x10, %ax
+	movw %ax, %ds
+	movw %ax, %es
+	movw %ax, %fs
+	movw %ax, %gs
+	movw %ax, %ss
+
+	movl %cr4, %eax
+	orl $0x90, %eax                 /* CR4.PSE | CR4.PGE */
+	movl %eax, %cr4
+	movl (ap_cr3 - ap_trampoline_start + AP_TRAMPOLINE_ADDR), %eax
+	movl %eax, %cr3
+	movl %cr0, %eax
+	orl $0x80010000, %eax           /* CR0.PG | CR0.WP */
+	movl %eax, %cr0
+
+	movl (ap_stack - ap_trampoline_start + AP_TRAMPOLINE_ADDR), %esp
+	movl (ap_entry - ap_trampoline_start + AP_TRAMPOLINE_ADDR), %eax
+	jmp *%eax
+
+.align 8
+ap_gdt:
+.quad 0x0000000000000000
+.quad 0x00CF9A000000FFFF
+.quad 0x00CF92000000FFFF
+ap_gdt_descriptor:
+.word ap_gdt_descriptor - ap_gdt - 1
+.long (ap_gdt - ap_trampoline_start + AP_TRAMPOLINE_ADDR)
+
+.align 4
+.global ap_cr3, ap_stack, ap_entry
+ap_cr3:   .long 0
+ap_stack: .long 0
+ap_entry: .long 0
+
+.global ap_trampoline_end
+ap_trampoline_end:
@@ -0,0 +1,110 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "bench.h"
+#include "cpu.h"
+#include "stdio.h"
+#include "serial.h"
+#include "multitasking.h"
+
+// isa-debug-exit makes QEMU exit with status (value << 1) | 1; `make bench`
+// expects 33 so that a crash or a triple fault reads as a failure
+#define QEMU_EXIT_PORT   0xF4
+#define QEMU_EXIT_VALUE  0x10
+
+extern const bench_t __bench_start[];   // linker.ld
+extern const bench_t __bench_end[];
+
+static uint32_t samples[BENCH_MAX_SAMPLES];
+
+static void (*group_worker)(void);
+static uint32_t group_started;
+static uint32_t group_finished;
+static wait_queue_t group_done = WAIT_QUEUE_INIT;
+
+static void sort_samples(uint32_t* values, uint32_t count) {
+    for (uint32_t i = 1; i < count; i++) {
+        uint32_t value = values[i];
+        uint32_t j = i;
+        for (; j > 0 && values[j - 1] > value; j--) {
+            values[j] = values[j - 1];
+        }
+        values[j] = value;
+    }
+}
+
+static void bench_run(const bench_t* bench) {
+    uint32_t count = bench->samples;
+    if (count > BENCH_MAX_SAMPLES) count = BENCH_MAX_SAMPLES;
+    if (count == 0) count = 1;
+    uint32_t iterations = bench->iterations ? bench->iterations : 1;
+
+    // One untimed run to warm the caches and take any first-use slow paths
+    uint32_t flags = irq_save();
+    bench->run(iterations);
+    irq_restore(flags);
+
+    for (uint32_t i = 0; i < count; i++) {
+        flags = irq_save();
+        uint64_t start = rdtsc();
+        bench->run(iterations);
+        uint64_t end = rdtsc();
+        irq_restore(flags);
+        samples[i] = (uint32_t)(end - start) / iterations;
+    }
+
+    sort_samples(samples, count);
+    kprintf("BENCH name=%s samples=%u iterations=%u min=%u median=%u p99=%u unit=cycles\n",
+            bench->name, (unsigned int)count, (unsigned int)iterations, (unsigned int)samples[0],
+            (unsigned int)samples[count / 2], (unsigned int)samples[count * 99 / 100]);
+}
+
+// The result lines go through the serial log, which drops what does not
+// fit; `make bench` only accepts a run whose last line reports no drops
+void bench_run_all(void) {
+    uint32_t dropped = serial_dropped();
+    kprintf("Benchmark suite: %u benchmarks\n", (unsigned int)(__bench_end - __bench_start));
+    for (const bench_t* bench = __bench_start; bench < __bench_end; bench++) {
+        bench_run(bench);
+    }
+    kprintf("BENCH done dropped=%u\n", (unsigned int)(serial_dropped() - dropped));
+}
+
+// Counts the worker out once it returns, so its last access to shared state
+// is complete before bench_join lets the caller tear that state down
+static void bench_worker_entry(void) {
+    group_worker();
+    if (__atomic_add_fetch(&group_finished, 1, __ATOMIC_RELEASE) == group_started) {
+        task_wake_one(&group_done);
+    }
+}
+
+uint32_t bench_spawn(void (*worker)(void), uint32_t count) {
+    group_worker = worker;
+    group_started = count;
+    group_finished = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!create_task(bench_worker_entry)) {
+            terminal_writestring("Error: Could not create benchmark tasks.\n");
+            // The ones already running count against the new total
+            __atomic_store_n(&group_started, i, __ATOMIC_RELEASE);
+            return i;
+        }
+    }
+    return count;
+}
+
+void bench_join(void) {
+    uint32_t flags = spin_lock_irqsave(&group_done.lock);
+    while (__atomic_load_n(&group_finished, __ATOMIC_ACQUIRE) < group_started) {
+        task_block_locked(&group_done);
+        spin_lock(&group_done.lock);
+    }
+    spin_unlock_irqrestore(&group_done.lock, flags);
+}
+
+void bench_qemu_exit(void) {
+    terminal_flush();
+    serial_flush();
+    outb(QEMU_EXIT_PORT, QEMU_EXIT_VALUE);
+}
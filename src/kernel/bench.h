@@ -0,0 +1,52 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+/*
+ * Registered benchmarks. Each is a function that performs an operation
+ * `iterations` times; bench_run_all times it with the TSC `samples` times,
+ * with interrupts disabled, and reports cycles per operation.
+ *
+ *     BENCH(kmalloc_free_64, 64) {
+ *         for (uint32_t i = 0; i < iterations; i++) kfree(kmalloc(64));
+ *     }
+ *
+ * The descriptors go into the .bench section, which the linker script
+ * gathers between __bench_start and __bench_end, so a benchmark only has to
+ * be defined to be run.
+ */
+#define BENCH_SAMPLES      256
+#define BENCH_MAX_SAMPLES  256
+
+typedef struct bench {
+    const char* name;
+    void (*run)(uint32_t iterations);
+    uint32_t iterations;        // Operations per sample
+    uint32_t samples;
+} bench_t;
+
+#define BENCH_SAMPLED(id, ops, count)                                           \
+    static void bench_run_##id(uint32_t iterations);                           \
+    static const bench_t bench_##id                                             \
+        __attribute__((section(".bench"), used, aligned(4))) =                  \
+        { #id, bench_run_##id, ops, count };                                    \
+    static void bench_run_##id(uint32_t iterations)
+
+#define BENCH(id, ops) BENCH_SAMPLED(id, ops, BENCH_SAMPLES)
+
+void bench_run_all(void);       // One "BENCH name=..." line per benchmark
+void bench_qemu_exit(void);     // Leave QEMU through isa-debug-exit, if it has one
+
+/*
+ * Worker tasks for the benchmarks that run with the scheduler going. Start
+ * `count` tasks running `worker`, do the measured work alongside them, then
+ * wait in bench_join until every worker has returned; from then on nothing
+ * the workers touched is in use and the reaper frees them. One group at a
+ * time. bench_spawn returns how many tasks it started, fewer than `count`
+ * (with an error printed) if it ran out of memory; those still need joining.
+ */
+uint32_t bench_spawn(void (*worker)(void), uint32_t count);
+void bench_join(void);
+
+#endif // BENCH_H
@@ -0,0 +1,61 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cmdline.h"
+#include "paging.h"
+
+#define CMDLINE_MAX 512
+
+// A copy: the bootloader's lives in memory the page allocator may hand out
+static char cmdline[CMDLINE_MAX];
+
+void cmdline_init(multiboot_info_t* mbi) {
+    if (!(mbi->flags & MULTIBOOT_INFO_CMDLINE)) {
+        return;
+    }
+    const char* source = (const char*)phys_to_virt(mbi->cmdline);
+    size_t length = 0;
+    while (source[length] && length < CMDLINE_MAX - 1) {
+        cmdline[length] = source[length];
+        length++;
+    }
+    cmdline[length] = '\0';
+}
+
+// Find the word starting with `option`; returns what follows the option
+// name inside that word ("" or "=value"), or NULL
+static const char* cmdline_find(const char* option) {
+    const char* p = cmdline;
+    while (*p) {
+        const char* o = option;
+        while (*o && *p == *o) {
+            p++;
+            o++;
+        }
+        if (!*o && (*p == ' ' || *p == '=' || *p == '\0')) {
+            return p;
+        }
+        while (*p && *p != ' ') p++;
+        while (*p == ' ') p++;
+    }
+    return NULL;
+}
+
+bool cmdline_has(const char* option) {
+    const char* rest = cmdline_find(option);
+    return rest && *rest != '=';
+}
+
+uint32_t cmdline_uint(const char* option, uint32_t fallback) {
+    const char* rest = cmdline_find(option);
+    if (!rest || *rest != '=' || rest[1] < '0' || rest[1] > '9') {
+        return fallback;
+    }
+
+    uint32_t value = 0;
+    for (rest++; *rest >= '0' && *rest <= '9'; rest++) {
+        value = value * 10 + (*rest - '0');
+    }
+    return value;
+}
@@ -0,0 +1,14 @@
+#ifndef CMDLINE_H
+#define CMDLINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "multiboot.h"
+
+// Kernel command line options, given as space separated "word" or "name=value"
+void cmdline_init(multiboot_info_t* mbi);
+bool cmdline_has(const char* option);                           // "option" present as a bare word
+uint32_t cmdline_uint(const char* option, uint32_t fallback);   // Decimal value of "option=N"
+
+#endif // CMDLINE_H
@@ -0,0 +1,129 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+// Control register bits
+#define CR0_MP  0x00000002      // WAIT honours TS
+#define CR0_EM  0x00000004      // No FPU: x87 and SSE instructions raise #NM
+#define CR0_TS  0x00000008      // Task switched: the next FPU instruction raises #NM
+#define CR0_NE  0x00000020      // Report x87 errors as exceptions, not through the PIC
+#define CR0_WP  0x00010000      // Honour read-only pages in ring 0
+#define CR0_PG  0x80000000      // Paging enabled
+#define CR4_PSE 0x00000010      // 4 MB pages
+#define CR4_PGE 0x00000080      // Global pages survive CR3 reloads
+#define CR4_OSFXSR     0x00000200   // FXSAVE/FXRSTOR cover SSE state, SSE enabled
+#define CR4_OSXMMEXCPT 0x00000400   // Unmasked SSE exceptions raise #XM
+
+#define EFLAGS_IF 0x00000200    // Maskable interrupts enabled
+
+static inline uint32_t read_cr0(void) {
+    uint32_t value;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(uint32_t value) {
+    __asm__ volatile("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline uint32_t read_cr2(void) {
+    uint32_t value;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+static inline uint32_t read_cr3(void) {
+    uint32_t value;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr3(uint32_t value) {
+    __asm__ volatile("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+static inline uint32_t read_cr4(void) {
+    uint32_t value;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(uint32_t value) {
+    __asm__ volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+// Clear CR0.TS without a read-modify-write of CR0
+static inline void clts(void) {
+    __asm__ volatile("clts" : : : "memory");
+}
+
+// Drop the TLB entry for one page
+static inline void invlpg(uintptr_t addr) {
+    __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+static inline void outb(uint16_t port, uint8_t value) {
+    __asm__ volatile("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t value;
+    __asm__ volatile("inb %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+// A write to an unused port takes long enough for old PIC/PIT hardware to settle
+static inline void io_wait(void) {
+    outb(0x80, 0);
+}
+
+static inline void irq_enable(void) {
+    __asm__ volatile("sti" : : : "memory");
+}
+
+static inline void irq_disable(void) {
+    __asm__ volatile("cli" : : : "memory");
+}
+
+// Disable interrupts and return the previous EFLAGS for irq_restore
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ volatile("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if (flags & EFLAGS_IF) {
+        irq_enable();
+    }
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* eax, uint32_t* ebx,
+                         uint32_t* ecx, uint32_t* edx) {
+    __asm__ volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                             : "a"(leaf), "c"(subleaf));
+}
+
+// Time-stamp counter; serialising it is left to the caller
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Divide in place and return the remainder. A fast path for 32-bit divisors:
+// libgcc's __udivdi3/__umoddi3 handle any 64-bit division, but go through a
+// general 64-by-64 routine, while two divl steps here cannot overflow.
+static inline uint32_t div64_32(uint64_t* value, uint32_t divisor) {
+    uint32_t high = *value >> 32;
+    uint32_t quotient_high = high / divisor;
+    uint32_t remainder = high % divisor;
+    uint32_t quotient_low;
+    __asm__("divl %4" : "=a"(quotient_low), "=d"(remainder)
+                      : "a"((uint32_t)*value), "d"(remainder), "rm"(divisor));
+    *value = ((uint64_t)quotient_high << 32) | quotient_low;
+    return remainder;
+}
+
+#endif // CPU_H
@@ -0,0 +1,138 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fpu.h"
+#include "cpu.h"
+#include "idt.h"
+#include "multitasking.h"
+#include "slab.h"
+#include "smp.h"
+#include "stdio.h"
+#include "string.h"
+
+#define CPUID_FEATURES   1
+#define CPUID_EDX_FXSR   (1 << 24)
+#define CPUID_EDX_SSE    (1 << 25)
+
+#define VECTOR_DEVICE_NOT_AVAILABLE 7
+#define MXCSR_DEFAULT    0x1F80     // All SSE exceptions masked, round to nearest
+
+static int fpu_enabled;             // FXSAVE present; without it the FPU stays off
+static int sse;
+static kmem_cache_t* fpu_cache;
+
+// What a task's first FPU instruction sees: FNINIT state, default MXCSR
+static uint8_t fpu_initial_state[FPU_STATE_SIZE] __attribute__((aligned(16)));
+
+static inline void fxsave(void* area) {
+    __asm__ volatile("fxsave (%0)" : : "r"(area) : "memory");
+}
+
+static inline void fxrstor(const void* area) {
+    __asm__ volatile("fxrstor (%0)" : : "r"(area) : "memory");
+}
+
+/*
+ * #NM: the current task wants the FPU. Whatever task owned the registers
+ * was saved when it was switched out, so they can simply be overwritten.
+ * Interrupts are disabled.
+ */
+static void fpu_trap(interrupt_frame_t* frame) {
+    (void)frame;
+    if (!fpu_enabled) {
+        panic("FPU instruction on a CPU without FXSAVE.");
+    }
+
+    cpu_t* cpu = this_cpu();
+    task_t* task = cpu->current;
+    if (!task->fpu_state) {
+        task->fpu_state = kmem_cache_alloc(fpu_cache);
+        if (!task->fpu_state) {
+            panic("Failed to allocate FPU state.");
+        }
+        memcpy(task->fpu_state, fpu_initial_state, FPU_STATE_SIZE);
+    }
+
+    clts();
+    fxrstor(task->fpu_state);
+    cpu->fpu_owner = task;
+    task->fpu_cpu = cpu->id;
+}
+
+void fpu_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+    fpu_enabled = (edx & CPUID_EDX_FXSR) != 0;
+    sse = fpu_enabled && (edx & CPUID_EDX_SSE);
+    if (fpu_enabled) {
+        fpu_cache = kmem_cache_create("fpu_state", FPU_STATE_SIZE, 16, NULL);
+        if (!fpu_cache) {
+            panic("Failed to create the FPU state cache.");
+        }
+    }
+
+    interrupt_register(VECTOR_DEVICE_NOT_AVAILABLE, fpu_trap);
+    fpu_init_cpu();
+
+    terminal_writestring(!fpu_enabled ? "FPU: no FXSAVE, disabled\n"
+                         : sse ? "FPU: x87 and SSE, switched lazily\n"
+                               : "FPU: x87, switched lazily\n");
+}
+
+void fpu_init_cpu(void) {
+    uint32_t cr0 = read_cr0();
+    if (!fpu_enabled) {
+        write_cr0(cr0 | CR0_EM);
+        return;
+    }
+
+    write_cr0((cr0 & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+    if (sse) {
+        write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+    }
+    __asm__ volatile("fninit");
+    if (sse) {
+        uint32_t mxcsr = MXCSR_DEFAULT;
+        __asm__ volatile("ldmxcsr %0" : : "m"(mxcsr));
+    }
+    if (this_cpu()->id == 0) {
+        fxsave(fpu_initial_state);
+    }
+    this_cpu()->fpu_owner = NULL;
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+/*
+ * CR0.TS clear means the outgoing task has used the FPU since it was
+ * switched in, and the registers are its only up-to-date copy. FXSAVE
+ * leaves them intact, so if the same task comes back here before anyone
+ * else uses the FPU it gets them back without a trap or a restore.
+ */
+void fpu_switch(task_t* prev, task_t* next) {
+    if (!fpu_enabled) {
+        return;
+    }
+    cpu_t* cpu = this_cpu();
+    uint32_t cr0 = read_cr0();
+    if (!(cr0 & CR0_TS)) {
+        fxsave(prev->fpu_state);
+    }
+    if (cpu->fpu_owner == next && next->fpu_cpu == cpu->id) {
+        if (cr0 & CR0_TS) {
+            clts();
+        }
+    } else if (!(cr0 & CR0_TS)) {
+        write_cr0(cr0 | CR0_TS);
+    }
+}
+
+void fpu_free(task_t* task) {
+    if (task->fpu_state) {
+        kmem_cache_free(fpu_cache, task->fpu_state);
+        task->fpu_state = NULL;
+    }
+}
+
+int fpu_available(void) {
+    return fpu_enabled;
+}
@@ -0,0 +1,26 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+
+#include "multitasking.h"
+
+/*
+ * Lazy x87/SSE state switching. Tasks start without FPU state; the first
+ * FPU instruction a task runs traps (#NM), which allocates its FXSAVE area
+ * and loads it. Every switch leaves CR0.TS set unless the incoming task's
+ * state is still in this CPU's registers, so tasks that never touch the FPU
+ * switch without saving or restoring anything. A task that used the FPU in
+ * its slice is saved when switched out, as it may be resumed on another
+ * CPU. Interrupt handlers must not use the FPU.
+ */
+#define FPU_STATE_SIZE  512         // FXSAVE area
+#define FPU_NO_CPU      0xFF        // task_t.fpu_cpu before the state was first loaded
+
+void fpu_init(void);                // Detect FXSAVE, take #NM; on the bootstrap CPU after idt_init
+void fpu_init_cpu(void);            // Enable the FPU with CR0.TS set on the calling CPU
+void fpu_switch(task_t* prev, task_t* next); // Before switch_to, interrupts disabled
+void fpu_free(task_t* task);        // Release a task's FXSAVE area
+int fpu_available(void);            // Tasks may use the FPU
+
+#endif // FPU_H
@@ -0,0 +1,82 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "gdt.h"
+#include "cpu.h"
+#include "smp.h"
+
+// Flat kernel code and data like the boot GDT in boot.s, plus one data
+// segment per CPU whose base is that CPU's cpu_t, one TSS per CPU and one
+// double fault handler TSS per CPU
+#define GDT_ENTRIES (GDT_DOUBLE_FAULT_FIRST + MAX_CPUS)
+
+#define ACCESS_CODE 0x9A            // Present, ring 0, executable, readable
+#define ACCESS_DATA 0x92            // Present, ring 0, writable
+#define ACCESS_TSS  0x89            // Present, ring 0, available 32-bit TSS
+#define FLAGS_32BIT_4K 0xC          // 32-bit segment, limit in pages
+
+typedef struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) gdt_descriptor_t;
+
+static uint64_t gdt[GDT_ENTRIES] __attribute__((aligned(8)));
+tss_t cpu_tss[MAX_CPUS];
+tss_t double_fault_tss[MAX_CPUS];
+
+static uint64_t gdt_entry(uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
+    uint64_t entry = limit & 0xFFFF;
+    entry |= (uint64_t)(base & 0xFFFFFF) << 16;
+    entry |= (uint64_t)access << 40;
+    entry |= (uint64_t)((limit >> 16) & 0xF) << 48;
+    entry |= (uint64_t)(flags & 0xF) << 52;
+    entry |= (uint64_t)(base >> 24) << 56;
+    return entry;
+}
+
+void gdt_init(void) {
+    gdt[0] = 0;
+    gdt[GDT_KERNEL_CODE >> 3] = gdt_entry(0, 0xFFFFF, ACCESS_CODE, FLAGS_32BIT_4K);
+    gdt[GDT_KERNEL_DATA >> 3] = gdt_entry(0, 0xFFFFF, ACCESS_DATA, FLAGS_32BIT_4K);
+    for (size_t i = 0; i < MAX_CPUS; i++) {
+        gdt[GDT_PERCPU_FIRST + i] = gdt_entry((uint32_t)&cpus[i], sizeof(cpu_t) - 1, ACCESS_DATA, 0x4);
+        gdt[GDT_TSS_FIRST + i] = gdt_entry((uint32_t)&cpu_tss[i], sizeof(tss_t) - 1, ACCESS_TSS, 0);
+        gdt[GDT_DOUBLE_FAULT_FIRST + i] = gdt_entry((uint32_t)&double_fault_tss[i], sizeof(tss_t) - 1, ACCESS_TSS, 0);
+        cpu_tss[i].iomap_base = sizeof(tss_t);
+    }
+}
+
+// The handler runs with interrupts off on its own stack, so it works even
+// when the fault was the faulting CPU running out of stack. Each CPU has its
+// own handler TSS, which comes with %gs already pointing at that CPU.
+void gdt_set_double_fault(uint32_t id, void (*entry)(void), void* stack_top) {
+    tss_t* tss = &double_fault_tss[id];
+    tss->cr3 = read_cr3();
+    tss->eip = (uint32_t)entry;
+    tss->eflags = 0x2;
+    tss->esp = (uint32_t)stack_top;
+    tss->cs = GDT_KERNEL_CODE;
+    tss->ds = tss->es = tss->ss = tss->fs = GDT_KERNEL_DATA;
+    tss->gs = (GDT_PERCPU_FIRST + id) << 3;
+    tss->iomap_base = sizeof(tss_t);
+}
+
+void gdt_load(cpu_t* cpu) {
+    gdt_descriptor_t descriptor = { sizeof(gdt) - 1, (uint32_t)gdt };
+    uint16_t percpu = (GDT_PERCPU_FIRST + cpu->id) << 3;
+    uint16_t tss = (GDT_TSS_FIRST + cpu->id) << 3;
+
+    __asm__ volatile(
+        "lgdt %0\n"
+        "ljmp %1, $1f\n"
+        "1: movw %2, %%ax\n"
+        "movw %%ax, %%ds\n"
+        "movw %%ax, %%es\n"
+        "movw %%ax, %%ss\n"
+        "movw %%ax, %%fs\n"
+        "movw %3, %%gs\n"
+        "ltr %4\n"
+        :
+        : "m"(descriptor), "i"(GDT_KERNEL_CODE), "i"(GDT_KERNEL_DATA), "r"(percpu), "r"(tss)
+        : "eax", "memory");
+}
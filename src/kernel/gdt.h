@@ -0,0 +1,38 @@
+#ifndef GDT_H
+#define GDT_H
+
+#include <stdint.h>
+
+#include "smp.h"
+
+#define GDT_KERNEL_CODE  0x08
+#define GDT_KERNEL_DATA  0x10
+#define GDT_PERCPU_FIRST 3          // Descriptor index of cpus[0]'s %gs segment
+#define GDT_TSS_FIRST    (GDT_PERCPU_FIRST + MAX_CPUS)  // cpus[0]'s TSS, then the other CPUs'
+#define GDT_DOUBLE_FAULT_FIRST (GDT_TSS_FIRST + MAX_CPUS)  // cpus[0]'s double fault TSS, then the other CPUs'
+
+// 32-bit task state segment. Nothing runs in ring 3 and tasks switch in
+// software, so the TSSs only serve the double fault task gates: the switch
+// to one saves the faulting CPU's registers in that CPU's TSS.
+typedef struct tss {
+    uint16_t prev_task, reserved0;  // Selector of the interrupted task's TSS
+    uint32_t esp0;
+    uint16_t ss0, reserved1;
+    uint32_t esp1;
+    uint16_t ss1, reserved2;
+    uint32_t esp2;
+    uint16_t ss2, reserved3;
+    uint32_t cr3, eip, eflags, eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint16_t es, reserved4, cs, reserved5, ss, reserved6, ds, reserved7;
+    uint16_t fs, reserved8, gs, reserved9, ldt, reserved10;
+    uint16_t trap, iomap_base;
+} __attribute__((packed)) tss_t;
+
+extern tss_t cpu_tss[MAX_CPUS];
+extern tss_t double_fault_tss[MAX_CPUS];
+
+void gdt_init(void);                // Build the GDT with one %gs segment and two TSSs per CPU
+void gdt_load(cpu_t* cpu);          // Load it on the calling CPU, point %gs at cpu and load its TSS
+void gdt_set_double_fault(uint32_t id, void (*entry)(void), void* stack_top); // Once paging is set up
+
+#endif // GDT_H
@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "idt.h"
+#include "pic.h"
+#include "cpu.h"
+#include "stdio.h"
+#include "multitasking.h"
+#include "gdt.h"
+#include "kstack.h"
+#include "smp.h"
+#include "trace.h"
+
+#define KERNEL_CODE_SELECTOR  0x08   // Same in the boot GDT and gdt.c
+#define GATE_INTERRUPT_32     0x8E   // Present, ring 0, 32-bit interrupt gate
+#define GATE_TASK             0x85   // Present, ring 0, task gate
+#define VECTOR_DOUBLE_FAULT   8
+#define VECTOR_PAGE_FAULT     14
+
+typedef struct {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t zero;
+    uint8_t type_attr;
+    uint16_t offset_high;
+} __attribute__((packed)) idt_entry_t;
+
+typedef struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) idt_descriptor_t;
+
+extern uint8_t interrupt_stubs[]; // interrupts.s
+
+// One table per CPU; they differ only in the double fault gate
+static idt_entry_t idt[MAX_CPUS][IDT_ENTRIES] __attribute__((aligned(8)));
+static interrupt_handler_t handlers[IDT_ENTRIES];
+static uint8_t double_fault_stack[MAX_CPUS][4096] __attribute__((aligned(16)));
+
+static const char* exception_names[32] = {
+    "Divide error", "Debug", "NMI", "Breakpoint", "Overflow", "Bound range exceeded",
+    "Invalid opcode", "Device not available", "Double fault", "Coprocessor segment overrun",
+    "Invalid TSS", "Segment not present", "Stack-segment fault", "General protection fault",
+    "Page fault", "Reserved", "x87 floating-point exception", "Alignment check",
+    "Machine check", "SIMD floating-point exception", "Virtualization exception",
+    "Control protection exception",
+};
+
+static void idt_set_gate(idt_entry_t* table, uint8_t vector, uintptr_t handler) {
+    table[vector].offset_low = handler & 0xFFFF;
+    table[vector].selector = KERNEL_CODE_SELECTOR;
+    table[vector].zero = 0;
+    table[vector].type_attr = GATE_INTERRUPT_32;
+    table[vector].offset_high = handler >> 16;
+}
+
+/*
+ * A task overflowing its stack faults on the guard page below it, and then
+ * faults again pushing the page fault's frame onto the same stack. The
+ * double fault is taken through a task gate instead, which switches to a
+ * stack of its own; the faulting CPU's registers end up in its TSS. Each CPU
+ * has its own handler task and stack: a task switch to a TSS that is already
+ * busy faults, so CPUs sharing one would turn a second concurrent double
+ * fault into a reset. The CPU pushes an error code for the task to pop, so
+ * it can never return.
+ */
+static void __attribute__((noreturn)) double_fault_task(void) {
+    panic_enter();
+    uint32_t id = this_cpu()->id;
+
+    tss_t* tss = &cpu_tss[id];
+    uintptr_t cr2 = read_cr2();
+    kprintf("Exception 8: Double fault on CPU %u\nEIP: 0x%08x ESP: 0x%08x CR2: 0x%08x\n",
+            (unsigned int)id, (unsigned int)tss->eip, (unsigned int)tss->esp, (unsigned int)cr2);
+    if (kstack_is_guard(cr2) || kstack_is_guard(tss->esp)) {
+        kprintf("Stack overflow in task %u\n", (unsigned int)cpus[id].current->id);
+    }
+    panic("Double fault.");
+}
+
+void idt_init(void) {
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        idt_entry_t* table = idt[id];
+        for (size_t vector = 0; vector < IDT_ENTRIES; vector++) {
+            idt_set_gate(table, vector, (uintptr_t)interrupt_stubs + vector * INTERRUPT_STUB_SIZE);
+        }
+        gdt_set_double_fault(id, double_fault_task, double_fault_stack[id] + sizeof(double_fault_stack[id]));
+        table[VECTOR_DOUBLE_FAULT].offset_low = 0;
+        table[VECTOR_DOUBLE_FAULT].selector = (GDT_DOUBLE_FAULT_FIRST + id) << 3;
+        table[VECTOR_DOUBLE_FAULT].type_attr = GATE_TASK;
+        table[VECTOR_DOUBLE_FAULT].offset_high = 0;
+    }
+
+    idt_load();
+    pic_init(IRQ_BASE);
+    terminal_writestring("Interrupts initialized.\n");
+}
+
+// The calling CPU's table; %gs must already point at its cpu_t
+void idt_load(void) {
+    idt_descriptor_t descriptor = { sizeof(idt[0]) - 1, (uint32_t)idt[this_cpu()->id] };
+    __asm__ volatile("lidt %0" : : "m"(descriptor));
+}
+
+void interrupt_register(uint8_t vector, interrupt_handler_t handler) {
+    handlers[vector] = handler;
+}
+
+void irq_register(uint8_t irq, interrupt_handler_t handler) {
+    handlers[IRQ_BASE + irq] = handler;
+    pic_unmask(irq);
+}
+
+static void exception_panic(interrupt_frame_t* frame) {
+    panic_enter();
+    const char* name = exception_names[frame->vector] ? exception_names[frame->vector] : "Reserved";
+    if (frame->vector == VECTOR_PAGE_FAULT) {
+        kprintf("Exception %u: %s\nEIP: 0x%08x Error code: 0x%08x CR2: 0x%08x\n",
+                (unsigned int)frame->vector, name, (unsigned int)frame->eip,
+                (unsigned int)frame->error_code, (unsigned int)read_cr2());
+    } else {
+        kprintf("Exception %u: %s\nEIP: 0x%08x Error code: 0x%08x\n",
+                (unsigned int)frame->vector, name, (unsigned int)frame->eip,
+                (unsigned int)frame->error_code);
+    }
+    if (frame->vector == VECTOR_PAGE_FAULT && kstack_is_guard(read_cr2())) {
+        kprintf("Stack overflow in task %u\n", (unsigned int)current_task->id);
+    }
+    panic("Unhandled CPU exception.");
+}
+
+// Called from interrupt_common with interrupts disabled
+void interrupt_dispatch(interrupt_frame_t* frame) {
+    uint32_t vector = frame->vector;
+
+    if (vector >= IRQ_BASE && vector < IRQ_BASE + IRQ_COUNT) {
+        uint8_t irq = vector - IRQ_BASE;
+        if (pic_is_spurious(irq)) {
+            return;
+        }
+        // Acknowledge first: the handler may switch to a task that does not
+        // come back through here for a while, and the PIC would hold off
+        // every lower priority IRQ until then
+        pic_send_eoi(irq);
+    }
+
+    // A handler that switches tasks returns here only once the interrupted
+    // task runs again, so an exit can belong to an entry on another task
+    trace_event(TRACE_IRQ_ENTRY, vector, 0);
+    if (handlers[vector]) {
+        handlers[vector](frame);
+    } else if (vector < 32) {
+        exception_panic(frame);
+    }
+    trace_event(TRACE_IRQ_EXIT, vector, 0);
+}
+
+/*
+ * Round trip through a software interrupt with an empty handler: the IDT
+ * lookup, the stub, the dispatcher and IRET, which is what every IRQ pays
+ * before its handler does any work.
+ */
+#define INTERRUPT_BENCH_ROUNDS      8
+#define INTERRUPT_BENCH_ITERATIONS  10000
+
+static void bench_handler(interrupt_frame_t* frame) {
+    (void)frame;
+}
+
+void interrupt_bench(void) {
+    uint32_t flags = irq_save();
+    interrupt_register(INT_BENCH_VECTOR, bench_handler);
+
+    uint32_t best = 0xFFFFFFFF;
+    uint32_t total = 0;
+    for (int round = 0; round < INTERRUPT_BENCH_ROUNDS; round++) {
+        uint64_t start = rdtsc();
+        for (int i = 0; i < INTERRUPT_BENCH_ITERATIONS; i++) {
+            __asm__ volatile("int %0" : : "i"(INT_BENCH_VECTOR) : "memory");
+        }
+        uint32_t cycles = (uint32_t)(rdtsc() - start);
+        if (cycles < best) {
+            best = cycles;
+        }
+        total += cycles;
+    }
+
+    interrupt_register(INT_BENCH_VECTOR, NULL);
+    irq_restore(flags);
+
+    kprintf("Interrupt entry/exit: %u cycles best, %u cycles average\n",
+            (unsigned int)(best / INTERRUPT_BENCH_ITERATIONS),
+            (unsigned int)(total / (INTERRUPT_BENCH_ITERATIONS * INTERRUPT_BENCH_ROUNDS)));
+}
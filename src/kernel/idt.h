@@ -0,0 +1,33 @@
+#ifndef IDT_H
+#define IDT_H
+
+#include <stdint.h>
+
+#define IDT_ENTRIES          256
+#define INTERRUPT_STUB_SIZE  16     // Bytes per entry stub in interrupts.s
+
+// Vectors 0-31 are CPU exceptions; the PIC IRQs are remapped right above them
+#define IRQ_BASE             0x20
+#define IRQ_COUNT            16
+#define IRQ_TIMER            0
+
+#define INT_BENCH_VECTOR     0x81   // Empty software interrupt for interrupt_bench
+
+// Stack layout built by interrupts.s: PUSHA, then the stub's vector and
+// error code, then what the CPU pushed. Handlers may modify it.
+typedef struct interrupt_frame {
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;
+    uint32_t vector;
+    uint32_t error_code;        // 0 for vectors without one
+    uint32_t eip, cs, eflags;
+} interrupt_frame_t;
+
+typedef void (*interrupt_handler_t)(interrupt_frame_t* frame);
+
+void idt_init(void);                                            // Load the IDT and remap the PIC
+void idt_load(void);                                            // Load the IDT on the calling CPU
+void interrupt_register(uint8_t vector, interrupt_handler_t handler);
+void irq_register(uint8_t irq, interrupt_handler_t handler);    // Also unmasks the IRQ
+void interrupt_bench(void);                                     // Measure interrupt entry/exit cost
+
+#endif // IDT_H
@@ -0,0 +1,41 @@
+/* Must match INTERRUPT_STUB_SIZE in idt.h */
+.set STUB_SIZE, 16
+
+/*
+ * One entry stub per vector, each padded to STUB_SIZE bytes so idt_init can
+ * compute a stub's address from its vector number instead of reading a table.
+ * The CPU pushes an error code for some exceptions only; every other stub
+ * pushes a zero in its place so all frames have the same layout.
+ */
+.section .text
+.align STUB_SIZE
+.global interrupt_stubs
+interrupt_stubs:
+.set vector, 0
+.rept 256
+.align STUB_SIZE
+.if !(vector == 8 || (vector >= 10 && vector <= 14) || vector == 17 || vector == 21 || vector == 29 || vector == 30)
+	pushl $0
+.endif
+	pushl $vector
+	jmp interrupt_common
+.set vector, vector + 1
+.endr
+
+/*
+ * Save the general purpose registers, hand the frame (interrupt_frame_t in
+ * idt.h) to interrupt_dispatch and unwind it again. All code runs in ring 0
+ * with flat segments, so segment registers are left alone.
+ *
+ * The dispatcher may switch tasks; in that case this stub returns much later,
+ * when the interrupted task is switched back in.
+ */
+interrupt_common:
+	pushal
+	cld
+	pushl %esp
+	call interrupt_dispatch
+	addl $4, %esp
+	popal
+	addl $8, %esp                   /* vector and error code */
+	iret
@@ -0,0 +1,307 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ipc.h"
+#include "memory.h"
+#include "slab.h"
+#include "timer.h"
+#include "cpu.h"
+#include "stdio.h"
+#include "bench.h"
+
+/*
+ * Bounded queue with a sequence number per slot (Vyukov). A slot whose
+ * sequence equals the producer position is free to fill; once filled its
+ * sequence becomes position + 1, which is what the consumer waits for, and
+ * draining it sets it to position + capacity for the next lap. Producers and
+ * the consumer therefore only meet on the slot itself and never read each
+ * other's index.
+ *
+ * A single producer owns tail outright. Several producers claim a position
+ * with a compare-and-swap on tail and then fill their slot independently.
+ */
+channel_t* channel_create(uint32_t capacity, uint32_t type) {
+    if (capacity < 2) {
+        capacity = 2;
+    }
+    uint32_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    channel_t* channel = (channel_t*)kmalloc_aligned(sizeof(channel_t), CACHE_LINE_SIZE);
+    if (!channel) {
+        terminal_writestring("Error: Failed to allocate channel.\n");
+        return NULL;
+    }
+    channel->slots = (channel_slot_t*)kmalloc_aligned(size * sizeof(channel_slot_t), CACHE_LINE_SIZE);
+    if (!channel->slots) {
+        terminal_writestring("Error: Failed to allocate channel slots.\n");
+        kfree(channel);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < size; i++) {
+        channel->slots[i].sequence = i;
+        channel->slots[i].message = NULL;
+    }
+    channel->head = 0;
+    channel->tail = 0;
+    channel->mask = size - 1;
+    channel->type = type;
+    channel->send_waiters = 0;
+    channel->recv_waiters = 0;
+    channel->senders = (wait_queue_t)WAIT_QUEUE_INIT;
+    channel->receivers = (wait_queue_t)WAIT_QUEUE_INIT;
+    return channel;
+}
+
+void channel_destroy(channel_t* channel) {
+    kfree(channel->slots);
+    kfree(channel);
+}
+
+// Sleepers register in the waiter count before re-checking the channel, and
+// the other side publishes its slot before reading the count; the full
+// fences on both sides mean at least one of them sees the other
+static void channel_wake(volatile uint32_t* waiters, wait_queue_t* queue) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (*waiters) {
+        task_wake_one(queue);
+    }
+}
+
+int channel_try_send(channel_t* channel, void* message) {
+    uint32_t position = __atomic_load_n(&channel->tail, __ATOMIC_RELAXED);
+    channel_slot_t* slot;
+
+    while (1) {
+        slot = &channel->slots[position & channel->mask];
+        int32_t diff = (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+        if (diff < 0) {
+            return 0;   // The consumer has not drained this slot's last lap
+        }
+        if (channel->type == CHANNEL_SPSC) {
+            channel->tail = position + 1;
+            break;
+        }
+        if (diff == 0 && __atomic_compare_exchange_n(&channel->tail, &position, position + 1, 1,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (diff > 0) {
+            // Another producer claimed this position already
+            position = __atomic_load_n(&channel->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->message = message;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    channel_wake(&channel->recv_waiters, &channel->receivers);
+    return 1;
+}
+
+void* channel_try_recv(channel_t* channel) {
+    uint32_t position = channel->head;
+    channel_slot_t* slot = &channel->slots[position & channel->mask];
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 1) {
+        return NULL;
+    }
+
+    void* message = slot->message;
+    channel->head = position + 1;
+    __atomic_store_n(&slot->sequence, position + channel->mask + 1, __ATOMIC_RELEASE);
+    channel_wake(&channel->send_waiters, &channel->senders);
+    return message;
+}
+
+static int channel_full(channel_t* channel) {
+    uint32_t position = __atomic_load_n(&channel->tail, __ATOMIC_RELAXED);
+    channel_slot_t* slot = &channel->slots[position & channel->mask];
+    return (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position) < 0;
+}
+
+static int channel_empty(channel_t* channel) {
+    uint32_t position = channel->head;
+    channel_slot_t* slot = &channel->slots[position & channel->mask];
+    return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 1;
+}
+
+// Sleep in TASK_WAITING on queue for as long as still_blocked holds
+static void channel_wait(volatile uint32_t* waiters, wait_queue_t* queue,
+                         int (*still_blocked)(channel_t*), channel_t* channel) {
+    uint32_t flags = spin_lock_irqsave(&queue->lock);
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    if (still_blocked(channel)) {
+        task_block_locked(queue);
+    } else {
+        spin_unlock(&queue->lock);
+    }
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_RELAXED);
+    irq_restore(flags);
+}
+
+void channel_send(channel_t* channel, void* message) {
+    while (!channel_try_send(channel, message)) {
+        channel_wait(&channel->send_waiters, &channel->senders, channel_full, channel);
+    }
+}
+
+void* channel_recv(channel_t* channel) {
+    void* message;
+    while (!(message = channel_try_recv(channel))) {
+        channel_wait(&channel->recv_waiters, &channel->receivers, channel_empty, channel);
+    }
+    return message;
+}
+
+/*
+ * Producer/consumer benchmark. Messages are slab objects carrying a sequence
+ * number: the producers allocate them, the consumer (the calling task) frees
+ * them, and only the pointer travels through the channel. Throughput is
+ * measured with one producer on an SPSC channel and with several on an MPSC
+ * channel; latency with a message bounced off an echo task over a pair of
+ * SPSC channels, which costs two wakeups per round trip. The channels are
+ * only destroyed once the tasks have been joined: a task's last send can
+ * still be touching the channel after the message has been received.
+ */
+#define IPC_BENCH_CAPACITY   256
+#define IPC_BENCH_MESSAGES   100000
+#define IPC_BENCH_PRODUCERS  4
+#define IPC_BENCH_ROUNDS     8
+#define IPC_BENCH_ROUND_TRIPS 1000
+
+typedef struct ipc_bench_message {
+    uint32_t producer;
+    uint32_t sequence;
+} ipc_bench_message_t;
+
+static kmem_cache_t* ipc_bench_cache;
+static channel_t* ipc_bench_channel;
+static channel_t* ipc_bench_reply;
+static uint32_t ipc_bench_per_producer;
+static uint32_t ipc_bench_next_producer;
+
+static void ipc_bench_producer(void) {
+    channel_t* channel = ipc_bench_channel;
+    uint32_t producer = __atomic_fetch_add(&ipc_bench_next_producer, 1, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < ipc_bench_per_producer; i++) {
+        ipc_bench_message_t* message = (ipc_bench_message_t*)kmem_cache_alloc(ipc_bench_cache);
+        while (!message) {
+            task_yield();   // The consumer frees them as fast as it can
+            message = (ipc_bench_message_t*)kmem_cache_alloc(ipc_bench_cache);
+        }
+        message->producer = producer;
+        message->sequence = i;
+        channel_send(channel, message);
+    }
+}
+
+static void ipc_bench_echo(void) {
+    for (uint32_t i = 0; i < IPC_BENCH_ROUNDS * IPC_BENCH_ROUND_TRIPS; i++) {
+        channel_send(ipc_bench_reply, channel_recv(ipc_bench_channel));
+    }
+}
+
+static void ipc_bench_throughput(uint32_t type, uint32_t producers) {
+    ipc_bench_channel = channel_create(IPC_BENCH_CAPACITY, type);
+    if (!ipc_bench_channel) {
+        return;
+    }
+    ipc_bench_per_producer = IPC_BENCH_MESSAGES / producers;
+    ipc_bench_next_producer = 0;
+    uint32_t expected[IPC_BENCH_PRODUCERS] = { 0 };
+
+    uint32_t start_ticks = timer_ticks;
+    uint64_t start = rdtsc();
+    producers = bench_spawn(ipc_bench_producer, producers);
+    if (!producers) {
+        channel_destroy(ipc_bench_channel);
+        return;
+    }
+    uint32_t total = ipc_bench_per_producer * producers;
+
+    // Messages from one producer must arrive in order
+    uint32_t errors = 0;
+    for (uint32_t i = 0; i < total; i++) {
+        ipc_bench_message_t* message = (ipc_bench_message_t*)channel_recv(ipc_bench_channel);
+        if (message->producer >= producers || message->sequence != expected[message->producer]++) {
+            errors++;
+        }
+        kmem_cache_free(ipc_bench_cache, message);
+    }
+    uint32_t cycles = (uint32_t)(rdtsc() - start);
+    uint32_t ticks = timer_ticks - start_ticks;
+    bench_join();
+    channel_destroy(ipc_bench_channel);
+
+    char rate[24] = "";
+    char disorder[24] = "";
+    if (ticks) {
+        ksnprintf(rate, sizeof(rate), "%u messages/s, ", (unsigned int)(total * timer_frequency() / ticks));
+    }
+    if (errors) {
+        ksnprintf(disorder, sizeof(disorder), ", %u out of order", (unsigned int)errors);
+    }
+    kprintf("IPC %s, %u producer(s): %s%u cycles per message%s\n",
+            type == CHANNEL_SPSC ? "SPSC" : "MPSC", (unsigned int)producers, rate,
+            (unsigned int)(cycles / total), disorder);
+}
+
+static void ipc_bench_latency(void) {
+    ipc_bench_channel = channel_create(2, CHANNEL_SPSC);
+    ipc_bench_reply = channel_create(2, CHANNEL_SPSC);
+    ipc_bench_message_t* message = (ipc_bench_message_t*)kmem_cache_alloc(ipc_bench_cache);
+    if (!ipc_bench_channel || !ipc_bench_reply || !message) {
+        terminal_writestring("Error: Could not set up the IPC latency benchmark.\n");
+        if (message) kmem_cache_free(ipc_bench_cache, message);
+        if (ipc_bench_channel) channel_destroy(ipc_bench_channel);
+        if (ipc_bench_reply) channel_destroy(ipc_bench_reply);
+        return;
+    }
+    if (!bench_spawn(ipc_bench_echo, 1)) {
+        kmem_cache_free(ipc_bench_cache, message);
+        channel_destroy(ipc_bench_channel);
+        channel_destroy(ipc_bench_reply);
+        return;
+    }
+
+    uint32_t best = 0xFFFFFFFF;
+    uint32_t total = 0;
+    for (int round = 0; round < IPC_BENCH_ROUNDS; round++) {
+        uint64_t start = rdtsc();
+        for (int i = 0; i < IPC_BENCH_ROUND_TRIPS; i++) {
+            channel_send(ipc_bench_channel, message);
+            message = (ipc_bench_message_t*)channel_recv(ipc_bench_reply);
+        }
+        uint32_t cycles = (uint32_t)(rdtsc() - start);
+        if (cycles < best) {
+            best = cycles;
+        }
+        total += cycles;
+    }
+
+    bench_join();
+    kmem_cache_free(ipc_bench_cache, message);
+    channel_destroy(ipc_bench_channel);
+    channel_destroy(ipc_bench_reply);
+
+    kprintf("IPC round trip: %u cycles best, %u cycles average\n",
+            (unsigned int)(best / IPC_BENCH_ROUND_TRIPS),
+            (unsigned int)(total / (IPC_BENCH_ROUND_TRIPS * IPC_BENCH_ROUNDS)));
+}
+
+// Needs multitasking and interrupts enabled
+void channel_bench(void) {
+    if (!ipc_bench_cache) {
+        ipc_bench_cache = kmem_cache_create("ipc_bench", sizeof(ipc_bench_message_t), 0, NULL);
+        if (!ipc_bench_cache) {
+            terminal_writestring("Error: Could not create the IPC benchmark cache.\n");
+            return;
+        }
+    }
+
+    ipc_bench_throughput(CHANNEL_SPSC, 1);
+    ipc_bench_throughput(CHANNEL_MPSC, IPC_BENCH_PRODUCERS);
+    ipc_bench_latency();
+}
@@ -0,0 +1,51 @@
+#ifndef IPC_H
+#define IPC_H
+
+#include <stdint.h>
+
+#include "multitasking.h"
+
+#define CACHE_LINE_SIZE  64
+
+// Channel flavours: one sending task, or any number of them. Either way
+// there is a single receiving task.
+#define CHANNEL_SPSC  0
+#define CHANNEL_MPSC  1
+
+typedef struct channel_slot {
+    volatile uint32_t sequence;     // Position this slot is ready for, see ipc.c
+    void* message;
+} channel_slot_t;
+
+// Bounded lock-free ring of message pointers. The producer and consumer
+// indices sit on cache lines of their own so the two sides never write to
+// the same line, apart from the slot being handed over.
+typedef struct channel {
+    uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));   // Next slot to fill
+    uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));   // Next slot to drain
+
+    // Fixed at creation
+    channel_slot_t* slots __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint32_t mask;                  // Capacity - 1
+    uint32_t type;
+
+    // Blocking senders and receivers; the counts let the fast paths skip
+    // the wait queue locks when nobody sleeps
+    volatile uint32_t send_waiters;
+    volatile uint32_t recv_waiters;
+    wait_queue_t senders;
+    wait_queue_t receivers;
+} channel_t;
+
+// Messages are pointers to buffers the sender owns until the receiver takes
+// them (slab objects or pages); payloads are never copied. NULL is not a
+// valid message.
+channel_t* channel_create(uint32_t capacity, uint32_t type); // Capacity is rounded up to a power of two
+void channel_destroy(channel_t* channel);   // No task may be using it
+int channel_try_send(channel_t* channel, void* message);     // 0 if the channel is full
+void* channel_try_recv(channel_t* channel);                  // NULL if the channel is empty
+void channel_send(channel_t* channel, void* message);        // Blocks while full
+void* channel_recv(channel_t* channel);                      // Blocks while empty
+void channel_bench(void);                   // Throughput and round-trip latency
+
+#endif // IPC_H
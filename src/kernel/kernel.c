@@ -4,8 +4,26 @@
 
 //use memeos headers
 #include "memory.h"
+#include "pmm.h"
+#include "paging.h"
+#include "multiboot.h"
 #include "stdio.h"
 #include "multitasking.h"
+#include "kstack.h"
+#include "fpu.h"
+#include "cmdline.h"
+#include "idt.h"
+#include "timer.h"
+#include "cpu.h"
+#include "smp.h"
+#include "ipc.h"
+#include "sync.h"
+#include "ktimer.h"
+#include "serial.h"
+#include "string.h"
+#include "bench.h"
+#include "trace.h"
+#include "profile.h"
 
 
 /* Check if the compiler thinks you are targeting the wrong operating system. */
@@ -59,7 +77,7 @@ void kernel_main(void) {
 void task1(void) {
     while (1) {
         terminal_writestring("Task 1 is running...\n");
-        for (volatile int i = 0; i < 1000000; i++) {} // A delay to avoid flooding the terminal too quickly
+        ksleep(500); // A delay to avoid flooding the terminal too quickly
     }
 }
 
@@ -67,44 +85,123 @@ void task1(void) {
 void task2(void) {
     while (1) {
         terminal_writestring("Task 2 is running...\n");
-        for (volatile int i = 0; i < 1000000; i++) {} // A delay to avoid flooding the terminal too quickly
+        ksleep(500); // A delay to avoid flooding the terminal too quickly
     }
 }
 
 void task3(void) {
     while (1) {
         terminal_writestring("Task 3 is running...\n");
-        for (volatile int i = 0; i < 1000000; i++) {} // A delay to avoid flooding the terminal too quickly
+        ksleep(500); // A delay to avoid flooding the terminal too quickly
     }
 }
 
-void kernel_main(void) {
+void kernel_main(uint32_t magic, uintptr_t mbi_phys) {
     // Initialize the terminal
+    string_init();
     terminal_initialize();
+    serial_init();
+    smp_early_init();
     terminal_writestring("Kernel initialized.\n");
 
+    if (magic != MULTIBOOT_BOOTLOADER_MAGIC) {
+        panic("Not booted by a multiboot compliant bootloader.");
+    }
+
+    // Map all of RAM into the higher half, then hand it to the page allocator
+    multiboot_info_t* mbi = (multiboot_info_t*)phys_to_virt(mbi_phys);
+    cmdline_init(mbi);
+    paging_init(mbi);
+    pmm_init(mbi);
+    pmm_stats();
+
     // Initialize memory management
     memory_init(10240); // Initialize heap with 10KB
     terminal_writestring("Memory management initialized.\n");
 
-    // Initialize multitasking
+    // Initialize multitasking; stack_kb= sizes every task's stack
+    kstack_init(cmdline_uint("stack_kb", TASK_STACK_SIZE / 1024) * 1024);
     multitasking_init();
     terminal_writestring("Multitasking initialized.\n");
 
+    // All IRQs stay masked until their handler is registered, so the
+    // benchmarks below run undisturbed until the timer is started
+    idt_init();
+    fpu_init();
+    serial_enable_irq();
+    bool bench = cmdline_has("bench");
+    if (bench) {
+        interrupt_bench();
+        task_switch_bench();
+        scheduler_bench();
+    }
+
+    // hz= and timeslice= on the command line trade latency for throughput
+    timer_init(cmdline_uint("hz", TIMER_DEFAULT_HZ));
+    scheduler_set_timeslice(cmdline_uint("timeslice", TASK_DEFAULT_TIMESLICE));
+    timer_set_tickless(cmdline_uint("tickless", 1));
+    if (bench) {
+        timer_jitter_bench();
+    }
+    irq_enable();
+    terminal_defer_flush();
+
+    // Application processors pick up work from the bootstrap CPU by stealing
+    smp_init();
+    if (bench) {
+        kprintf_bench();
+        string_bench();
+        kmalloc_bench();
+        channel_bench();
+        sync_bench();
+        ktimer_bench();
+        task_spawn_bench();
+        bench_run_all();
+
+        // `make bench` boots with qemu_exit and reads the log once QEMU is gone
+        if (cmdline_has("qemu_exit")) {
+            bench_qemu_exit();
+        }
+    }
+
+    // trace=N records everything from here on for N seconds, then streams
+    // it over serial for a trace viewer; profile=N samples for N seconds
+    uint32_t trace_seconds = cmdline_uint("trace", 0);
+    if (trace_seconds) {
+        trace_start();
+    }
+    uint32_t profile_seconds = cmdline_uint("profile", 0);
+    if (profile_seconds) {
+        profile_start();
+    }
+    uint32_t exit_seconds = trace_seconds > profile_seconds ? trace_seconds : profile_seconds;
+
     // Create tasks
     create_task(task1);
     create_task(task2);
     create_task(task3);
-    create_task(idle_task);  // Add the idle task
     terminal_writestring("Tasks created.\n");
 
-    // Set the current task to the first task in the list
-    current_task = task_list;  // Ensure the scheduler starts from the first task
-    terminal_writestring("Current task set to the first task.\n");
-
-    // Simulate multitasking by invoking the scheduler manually
+    // kernel_main is the first task and is preempted like the others
+    uint32_t seconds = 0;
     while (1) {
-        scheduler_tick();  // The scheduler will now pick tasks, including the idle task
-        memory_stats();
+        memory_stats_print();
+        scheduler_stats();
+        if (serial_dropped()) {
+            kprintf("Serial log: %u bytes dropped\n", (unsigned int)serial_dropped());
+        }
+        ksleep(1000);
+
+        seconds++;
+        if (seconds == trace_seconds) {
+            trace_dump();
+        }
+        if (seconds == profile_seconds) {
+            profile_dump(PROFILE_TOP);
+        }
+        // `make trace` and `make profile` boot with qemu_exit too
+        if (seconds == exit_seconds && cmdline_has("qemu_exit")) {
+            bench_qemu_exit();
+        }
     }
 }
@@ -0,0 +1,98 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kstack.h"
+#include "memory.h"
+#include "multitasking.h"
+#include "paging.h"
+#include "pmm.h"
+#include "spinlock.h"
+#include "stdio.h"
+
+static uintptr_t region;            // Slot 0; each slot is a guard page, then the stack
+static size_t slot_pages;           // Guard page included
+static size_t stack_size;
+static uint32_t slots_mapped;       // Slots below this one have their pages
+static void* free_stacks;           // LIFO threaded through each stack's lowest word
+static spinlock_t kstack_lock = SPINLOCK_INIT;
+
+// Caller holds kstack_lock. On failure the slot is left fully unmapped, so
+// it can be tried again.
+static void* map_slot(uint32_t slot) {
+    uintptr_t stack = region + (slot * slot_pages + 1) * PAGE_SIZE;
+    for (size_t i = 0; i < stack_size / PAGE_SIZE; i++) {
+        uintptr_t frame = pmm_alloc(0);
+        if (!frame || paging_map_page(stack + i * PAGE_SIZE, frame, PTE_WRITABLE | PTE_GLOBAL) != 0) {
+            if (frame) {
+                pmm_free(frame, 0);
+            }
+            while (i-- > 0) {
+                pmm_free(paging_unmap_page(stack + i * PAGE_SIZE), 0);
+            }
+            return NULL;
+        }
+    }
+    return (void*)stack;
+}
+
+void kstack_init(size_t size) {
+    if (size > KSTACK_MAX_SIZE) {
+        size = KSTACK_MAX_SIZE;
+    }
+    stack_size = size ? (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1) : PAGE_SIZE;
+    slot_pages = stack_size / PAGE_SIZE + 1;
+    region = paging_reserve(KSTACK_SLOTS * slot_pages);
+    if (!region) {
+        panic("Could not reserve address space for task stacks.");
+    }
+
+    for (uint32_t i = 0; i < KSTACK_PRELOAD; i++) {
+        void* stack = map_slot(slots_mapped);
+        if (!stack) {
+            break;
+        }
+        slots_mapped++;
+        *(void**)stack = free_stacks;
+        free_stacks = stack;
+    }
+
+    kprintf("Task stacks: %u KB each, %u pre-mapped\n", (unsigned int)(stack_size / 1024),
+            (unsigned int)slots_mapped);
+}
+
+void* kstack_alloc(void) {
+    uint32_t flags = spin_lock_irqsave(&kstack_lock);
+    void* stack = free_stacks;
+    if (stack) {
+        free_stacks = *(void**)stack;
+    } else if (slots_mapped < KSTACK_SLOTS) {
+        stack = map_slot(slots_mapped);
+        if (stack) {
+            slots_mapped++;
+        }
+    }
+    spin_unlock_irqrestore(&kstack_lock, flags);
+    return stack;
+}
+
+void kstack_free(void* stack) {
+    uint32_t flags = spin_lock_irqsave(&kstack_lock);
+    *(void**)stack = free_stacks;
+    free_stacks = stack;
+    spin_unlock_irqrestore(&kstack_lock, flags);
+}
+
+size_t kstack_size(void) {
+    return stack_size;
+}
+
+uint32_t kstack_mapped(void) {
+    return slots_mapped;
+}
+
+int kstack_is_guard(uintptr_t addr) {
+    if (!region || addr < region || addr - region >= KSTACK_SLOTS * slot_pages * PAGE_SIZE) {
+        return 0;
+    }
+    return (addr - region) / PAGE_SIZE % slot_pages == 0;
+}
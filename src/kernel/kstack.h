@@ -0,0 +1,25 @@
+#ifndef KSTACK_H
+#define KSTACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Task stacks. Each one sits in its own slot of a VMAP range above an
+ * unmapped guard page, so running off the bottom of a stack faults instead
+ * of writing over whatever lies below. A slot keeps its pages once mapped:
+ * freed stacks go on a free list and are handed out again as they are, so
+ * creating and exiting tasks costs no page table updates or TLB flushes.
+ */
+#define KSTACK_SLOTS     512        // Most stacks in existence at once
+#define KSTACK_PRELOAD   16         // Mapped up front by kstack_init
+#define KSTACK_MAX_SIZE  16384      // No larger than the boot stack
+
+void kstack_init(size_t size);      // Stacks of `size` bytes, rounded up to whole pages
+void* kstack_alloc(void);           // Lowest address of a stack, NULL if none are left
+void kstack_free(void* stack);
+size_t kstack_size(void);
+uint32_t kstack_mapped(void);       // Stacks with pages, in use or free
+int kstack_is_guard(uintptr_t addr); // addr is inside a guard page
+
+#endif // KSTACK_H
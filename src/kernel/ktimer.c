@@ -0,0 +1,244 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ktimer.h"
+#include "timer.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "stdio.h"
+#include "multitasking.h"
+
+/*
+ * Hierarchical timing wheel. Level 0 has one slot per tick for the next
+ * WHEEL_SLOTS ticks, and each level above covers WHEEL_SLOTS times the range
+ * of the one below with one slot per lap of it. Inserting and cancelling
+ * are a list insert and unlink. Each time level 0 wraps, the next slot of
+ * level 1 is cascaded: its timers are reinserted, now landing on level 0,
+ * and level 1 wrapping cascades level 2 the same way. Timers further out
+ * than the top level covers are parked in its last slot and cascade down
+ * again when it comes round.
+ *
+ * wheel_now is the next tick to process. ktimer_run is called from the
+ * bootstrap CPU's timer interrupt and catches up one tick at a time, which
+ * after a tickless idle period means up to a few dozen ticks.
+ */
+#define WHEEL_LEVELS  4
+#define WHEEL_BITS    6
+#define WHEEL_SLOTS   (1 << WHEEL_BITS)
+#define WHEEL_MASK    (WHEEL_SLOTS - 1)
+#define WHEEL_RANGE   (1u << (WHEEL_LEVELS * WHEEL_BITS))   // Ticks the wheel covers
+
+static ktimer_t* wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint32_t wheel_now;
+static int wheel_started;
+static spinlock_t wheel_lock = SPINLOCK_INIT;
+static ktimer_t* volatile running_timer;    // Callback in progress, for ktimer_cancel
+
+void ktimer_init(ktimer_t* timer, void (*callback)(ktimer_t*), void* data) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+// The wheel lock is held for all of the list helpers
+static void wheel_insert(ktimer_t* timer) {
+    uint32_t delta = timer->expires - wheel_now;
+    ktimer_t** slot;
+
+    if ((int32_t)delta < 0) {
+        // Already due: fire on the next tick processed
+        slot = &wheel[0][wheel_now & WHEEL_MASK];
+    } else if (delta >= WHEEL_RANGE) {
+        uint32_t parked = wheel_now + WHEEL_RANGE - 1;
+        slot = &wheel[WHEEL_LEVELS - 1][(parked >> ((WHEEL_LEVELS - 1) * WHEEL_BITS)) & WHEEL_MASK];
+    } else {
+        int level = 0;
+        while (delta >= (1u << ((level + 1) * WHEEL_BITS))) {
+            level++;
+        }
+        slot = &wheel[level][(timer->expires >> (level * WHEEL_BITS)) & WHEEL_MASK];
+    }
+
+    timer->next = *slot;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static void wheel_remove(ktimer_t* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// Reinsert everything in one slot of `level`; returns the slot index so the
+// caller knows whether this level wrapped too
+static uint32_t wheel_cascade(int level) {
+    uint32_t index = (wheel_now >> (level * WHEEL_BITS)) & WHEEL_MASK;
+    ktimer_t* timer = wheel[level][index];
+    wheel[level][index] = NULL;
+    while (timer) {
+        ktimer_t* next = timer->next;
+        wheel_insert(timer);
+        timer = next;
+    }
+    return index;
+}
+
+void ktimer_add(ktimer_t* timer, uint32_t ticks) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    if (!wheel_started) {
+        wheel_now = timer_now();
+        wheel_started = 1;
+    }
+    if (timer->pprev) {
+        wheel_remove(timer);
+    }
+    timer->expires = timer_now() + ticks;
+    wheel_insert(timer);
+    uint32_t expires = timer->expires;
+    spin_unlock_irqrestore(&wheel_lock, flags);
+
+    // A tickless bootstrap CPU may be asleep past this deadline
+    timer_deadline_changed(expires);
+}
+
+int ktimer_cancel(ktimer_t* timer) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    int pending = timer->pprev != NULL;
+    if (pending) {
+        wheel_remove(timer);
+    }
+    while (running_timer == timer) {
+        spin_unlock(&wheel_lock);
+        __asm__ volatile("pause");
+        spin_lock(&wheel_lock);
+    }
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return pending;
+}
+
+void ktimer_run(uint32_t now) {
+    spin_lock(&wheel_lock);
+    if (!wheel_started) {
+        wheel_now = now;
+        wheel_started = 1;
+    }
+
+    while ((int32_t)(now - wheel_now) >= 0) {
+        uint32_t index = wheel_now & WHEEL_MASK;
+        for (int level = 1; index == 0 && level < WHEEL_LEVELS; level++) {
+            index = wheel_cascade(level);
+        }
+
+        // Callbacks may add and cancel timers, so the lock is dropped around
+        // each one and the slot is re-read every time
+        ktimer_t** slot = &wheel[0][wheel_now & WHEEL_MASK];
+        while (*slot) {
+            ktimer_t* timer = *slot;
+            wheel_remove(timer);
+            running_timer = timer;
+            spin_unlock(&wheel_lock);
+            timer->callback(timer);
+            spin_lock(&wheel_lock);
+            running_timer = NULL;
+        }
+        wheel_now++;
+    }
+    spin_unlock(&wheel_lock);
+}
+
+// The first non-empty level 0 slot ahead, or the next level 0 wrap since a
+// cascade may bring timers down then. Timers are never due before it.
+uint32_t ktimer_next_expiry(void) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    uint32_t next = (wheel_now | WHEEL_MASK) + 1;
+    for (uint32_t tick = wheel_now; tick != next; tick++) {
+        if (wheel[0][tick & WHEEL_MASK]) {
+            next = tick;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return next;
+}
+
+void ksleep(uint32_t ms) {
+    wait_queue_t queue = WAIT_QUEUE_INIT;
+    uint32_t flags = spin_lock_irqsave(&queue.lock);
+    // The current tick is partly over already
+    task_block_locked_timeout(&queue, timer_ms_to_ticks(ms) + 1);
+    irq_restore(flags);
+}
+
+/*
+ * Arm KTIMER_BENCH_TIMERS timers 1 to KTIMER_BENCH_TIMERS ticks out and
+ * compare each callback's TSC with the tick boundary it was due on. With
+ * tickless idle the timer interrupt is programmed for each deadline, so
+ * lateness shows how well that tracks the periodic tick. Then sleep for a
+ * second and count how often the CPUs left idle meanwhile.
+ */
+#define KTIMER_BENCH_TIMERS  32
+
+static ktimer_t bench_timers[KTIMER_BENCH_TIMERS];
+static uint64_t bench_fired[KTIMER_BENCH_TIMERS];
+
+static void ktimer_bench_callback(ktimer_t* timer) {
+    bench_fired[(ktimer_t*)timer - bench_timers] = rdtsc();
+}
+
+void ktimer_bench(void) {
+    uint32_t tick_cycles = timer_tsc_per_tick();
+    if (!tick_cycles) {
+        terminal_writestring("Timer wheel: TSC not calibrated yet\n");
+        return;
+    }
+
+    // Start on a tick boundary so every deadline is a whole number of ticks away
+    uint32_t start_tick = timer_ticks;
+    while (timer_ticks == start_tick) {
+        __asm__ volatile("pause");
+    }
+    uint32_t flags = irq_save();
+    uint64_t start = timer_tick_tsc();
+    for (int i = 0; i < KTIMER_BENCH_TIMERS; i++) {
+        bench_fired[i] = 0;
+        ktimer_init(&bench_timers[i], ktimer_bench_callback, NULL);
+        ktimer_add(&bench_timers[i], i + 1);
+    }
+    irq_restore(flags);
+    ksleep((KTIMER_BENCH_TIMERS + 2) * 1000 / timer_frequency() + 1);
+
+    uint32_t max = 0, total = 0, missed = 0;
+    for (int i = 0; i < KTIMER_BENCH_TIMERS; i++) {
+        ktimer_cancel(&bench_timers[i]);
+        if (!bench_fired[i]) {
+            missed++;
+            continue;
+        }
+        int32_t late = (int32_t)(bench_fired[i] - start) - (int32_t)((i + 1) * tick_cycles);
+        uint32_t lateness = late > 0 ? (uint32_t)late : 0;
+        if (lateness > max) max = lateness;
+        total += lateness / KTIMER_BENCH_TIMERS;
+    }
+
+    if (missed) {
+        kprintf("Timer wheel: fired %u cycles late on average, %u max (tick is %u cycles), %u missed\n",
+                (unsigned int)total, (unsigned int)max, (unsigned int)tick_cycles, (unsigned int)missed);
+    } else {
+        kprintf("Timer wheel: fired %u cycles late on average, %u max (tick is %u cycles)\n",
+                (unsigned int)total, (unsigned int)max, (unsigned int)tick_cycles);
+    }
+
+    uint32_t wakeups = timer_idle_wakeups();
+    ksleep(1000);
+    kprintf("Idle wakeups: %u per second, %s\n", (unsigned int)(timer_idle_wakeups() - wakeups),
+            timer_tickless() ? "tickless" : "periodic tick");
+}
@@ -0,0 +1,24 @@
+#ifndef KTIMER_H
+#define KTIMER_H
+
+#include <stdint.h>
+
+// One-shot kernel timer. Callbacks run in the timer interrupt on the
+// bootstrap CPU with interrupts disabled, so they must not sleep.
+typedef struct ktimer {
+    struct ktimer* next;            // Wheel slot list
+    struct ktimer** pprev;          // Link pointing at this timer, NULL while not pending
+    uint32_t expires;               // Tick the timer fires on
+    void (*callback)(struct ktimer* timer);
+    void* data;
+} ktimer_t;
+
+void ktimer_init(ktimer_t* timer, void (*callback)(ktimer_t*), void* data);
+void ktimer_add(ktimer_t* timer, uint32_t ticks);   // Fire `ticks` ticks from now; re-arms a pending timer
+int ktimer_cancel(ktimer_t* timer);     // 1 if it was pending; waits for a running callback
+void ktimer_run(uint32_t now);          // Fire everything due up to tick `now`; timer interrupt only
+uint32_t ktimer_next_expiry(void);      // Tick by which the wheel next needs to run
+void ksleep(uint32_t ms);               // Sleep for at least ms; task context only
+void ktimer_bench(void);                // Timer firing accuracy and idle wakeups
+
+#endif // KTIMER_H
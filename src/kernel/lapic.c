@@ -0,0 +1,143 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "lapic.h"
+#include "paging.h"
+#include "memory.h"
+#include "idt.h"
+#include "timer.h"
+#include "cpu.h"
+#include "stdio.h"
+#include "multitasking.h"
+#include "profile.h"
+
+// Register offsets
+#define LAPIC_ID          0x020
+#define LAPIC_TPR         0x080
+#define LAPIC_EOI         0x0B0
+#define LAPIC_SVR         0x0F0
+#define LAPIC_ICR_LOW     0x300
+#define LAPIC_ICR_HIGH    0x310
+#define LAPIC_LVT_TIMER   0x320
+#define LAPIC_TIMER_INIT  0x380
+#define LAPIC_TIMER_COUNT 0x390
+#define LAPIC_TIMER_DIV   0x3E0
+
+#define SVR_ENABLE        0x100
+#define ICR_INIT          0x00000500
+#define ICR_STARTUP       0x00000600
+#define ICR_NMI           0x00000400
+#define ICR_ASSERT        0x00004000
+#define ICR_PENDING       0x00001000
+#define ICR_FIXED         0x00000000
+#define LVT_MASKED        0x00010000
+#define LVT_PERIODIC      0x00020000
+#define TIMER_DIV_16      0x3
+
+#define CALIBRATE_TICKS   10
+
+static volatile uint32_t* lapic;
+static uint32_t lapic_ticks_per_tick;  // APIC timer counts per PIT tick
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+    (void)lapic_read(LAPIC_ID); // Wait for the write to complete
+}
+
+// The PIT only interrupts the bootstrap CPU; the others tick on their APIC timer
+static void lapic_timer_handler(interrupt_frame_t* frame) {
+    lapic_eoi();
+    profile_tick(frame);
+    scheduler_tick();
+}
+
+// Sent to an idle CPU that has work to pick up; its tick may be stopped
+static void lapic_reschedule_handler(interrupt_frame_t* frame) {
+    (void)frame;
+    lapic_eoi();
+    timer_idle_exit();
+    scheduler_reschedule();
+}
+
+void lapic_init(uintptr_t phys) {
+    lapic = (volatile uint32_t*)paging_map_phys(phys, PAGE_SIZE, PTE_WRITABLE | PTE_NOCACHE);
+    if (!lapic) {
+        panic("Could not map the local APIC.");
+    }
+    interrupt_register(LAPIC_TIMER_VECTOR, lapic_timer_handler);
+    interrupt_register(LAPIC_RESCHEDULE_VECTOR, lapic_reschedule_handler);
+}
+
+void lapic_enable(void) {
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+uint32_t lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+static void lapic_send_ipi(uint32_t apic_id, uint32_t command) {
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+}
+
+void lapic_send_init(uint32_t apic_id) {
+    lapic_send_ipi(apic_id, ICR_INIT | ICR_ASSERT);
+}
+
+void lapic_send_startup(uint32_t apic_id, uintptr_t entry) {
+    lapic_send_ipi(apic_id, ICR_STARTUP | ICR_ASSERT | (entry >> 12));
+}
+
+void lapic_send_nmi(uint32_t apic_id) {
+    lapic_send_ipi(apic_id, ICR_NMI | ICR_ASSERT);
+}
+
+void lapic_send_reschedule(uint32_t apic_id) {
+    uint32_t flags = irq_save();
+    lapic_send_ipi(apic_id, ICR_FIXED | ICR_ASSERT | LAPIC_RESCHEDULE_VECTOR);
+    irq_restore(flags);
+}
+
+// Count APIC timer decrements over a few PIT ticks. Needs interrupts enabled.
+void lapic_timer_calibrate(void) {
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+
+    uint32_t start = timer_ticks;
+    while (timer_ticks == start) {
+        __asm__ volatile("hlt");
+    }
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    start = timer_ticks;
+    while (timer_ticks - start < CALIBRATE_TICKS) {
+        __asm__ volatile("hlt");
+    }
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_COUNT);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+
+    lapic_ticks_per_tick = elapsed / CALIBRATE_TICKS;
+}
+
+void lapic_timer_start(void) {
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, lapic_ticks_per_tick);
+}
+
+void lapic_timer_stop(void) {
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+}
@@ -0,0 +1,22 @@
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <stdint.h>
+
+#define LAPIC_TIMER_VECTOR     0x40
+#define LAPIC_RESCHEDULE_VECTOR 0x41
+#define LAPIC_SPURIOUS_VECTOR  0xFF
+
+void lapic_init(uintptr_t phys);            // Map the registers; once, on the bootstrap CPU
+void lapic_enable(void);                    // Software-enable the calling CPU's APIC
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+void lapic_send_init(uint32_t apic_id);
+void lapic_send_startup(uint32_t apic_id, uintptr_t entry);  // entry: 4 KB aligned, below 1 MB
+void lapic_send_reschedule(uint32_t apic_id);   // Make an idle CPU look for work
+void lapic_send_nmi(uint32_t apic_id);          // Gets through with interrupts disabled
+void lapic_timer_calibrate(void);           // Measure the APIC timer against the PIT tick
+void lapic_timer_start(void);               // Periodic interrupt at the PIT's rate on this CPU
+void lapic_timer_stop(void);
+
+#endif // LAPIC_H
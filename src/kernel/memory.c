@@ -2,130 +2,639 @@
 #include <stddef.h>
 
 #include "memory.h"
+#include "pmm.h"
+#include "paging.h"
 #include "stdio.h"
+#include "spinlock.h"
+#include "smp.h"
+#include "cpu.h"
+#include "multitasking.h"
+#include "bench.h"
+#include "trace.h"
 
-#define PAGE_SIZE 4096
-#define BITMAP_SIZE 32768 // Example: Tracks up to 128 MB (128 * 1024 * 1024 / PAGE_SIZE)
-#define ALIGNMENT 8  // Ensure 8-byte alignment
-#define MIN_BLOCK_SIZE sizeof(block_header_t)
-
-static uint8_t bitmap[BITMAP_SIZE];
-static uintptr_t heap_top = 0xC0000000; // Example kernel heap start
-
-static uint8_t static_heap[0x100000]; // Maximum heap size, adjust as needed
-uint8_t* heap = NULL;
-uint8_t* heap_ptr = NULL;
 size_t HEAP_SIZE = 0;
 
+/*
+ * The kernel heap is a two-level segregated fit (TLSF) allocator.
+ *
+ * Free blocks are binned by size: the first level splits sizes into powers of
+ * two, the second level splits each power of two into SL_COUNT equal ranges.
+ * A bitmap per level records which bins are non-empty, so finding a block that
+ * fits is two find-first-set instructions instead of a list walk.
+ *
+ * Every block starts with a boundary tag holding the size of the physically
+ * previous block (valid only while that block is free), followed by its own
+ * size. kfree can therefore reach both neighbours directly and coalesce in
+ * constant time.
+ */
+#define ALIGNMENT       8   // Ensure 8-byte alignment
+#define ALIGN_LOG2      3
+#define SL_LOG2         4   // 16 second-level bins per power of two
+#define SL_COUNT        (1 << SL_LOG2)
+#define FL_SHIFT        (SL_LOG2 + ALIGN_LOG2)
+#define FL_MAX          30  // Largest block class: 1 GB
+#define FL_COUNT        (FL_MAX - FL_SHIFT + 2)
+#define SMALL_BLOCK     (1 << FL_SHIFT)
+
+// Flags kept in the low bits of block_header_t.size
+#define BLOCK_FREE      0x1
+#define BLOCK_PREV_FREE 0x2
+#define BLOCK_FLAGS     (BLOCK_FREE | BLOCK_PREV_FREE)
 
 typedef struct block_header {
-    size_t size;             // Size of the allocated block
-    struct block_header* next; // Pointer to the next free block
-    int free;                // 1 if free, 0 if allocated
+    size_t prev_size;                // Boundary tag: size of the previous block if it is free
+    size_t size;                     // Size of this block including the header, plus flags
+    struct block_header* next_free;  // Free-list links, only valid while the block is free
+    struct block_header* prev_free;
 } block_header_t;
 
-block_header_t* free_list = NULL; // Points to the first free block
+#define BLOCK_OVERHEAD  offsetof(block_header_t, next_free)
+#define MIN_BLOCK_SIZE  sizeof(block_header_t)
+
+static uint32_t fl_bitmap;                        // Bit f set: sl_bitmap[f] is non-zero
+static uint32_t sl_bitmap[FL_COUNT];              // Bit s set: free_lists[f][s] is non-empty
+static block_header_t* free_lists[FL_COUNT][SL_COUNT];
+
+/*
+ * The heap grows on demand. Its memory comes in pools of HEAP_POOL_SIZE bytes
+ * taken from the buddy allocator, so every pool is naturally aligned to its
+ * size and the pool holding a block is found by masking the block address.
+ * A pool starts with a small header and ends with a zero-sized sentinel
+ * block. When kfree coalesces a block that spans a whole pool, the pool is
+ * given back to the page allocator (the first heap_min_pools pools are kept).
+ *
+ * Requests of a page or more never reach the block allocator: they get their
+ * own run of pages, tagged PAGE_LARGE in the head page descriptor.
+ */
+#define HEAP_POOL_ORDER 4                          // 64 KB pools
+#define HEAP_POOL_PAGES (1 << HEAP_POOL_ORDER)
+#define HEAP_POOL_SIZE  (HEAP_POOL_PAGES * PAGE_SIZE)
+#define LARGE_ALLOC     PAGE_SIZE                  // Requests this big bypass the pools
+
+typedef struct heap_pool {
+    struct heap_pool* next;
+    struct heap_pool* prev;
+} heap_pool_t;
+
+#define POOL_HEADER     ((sizeof(heap_pool_t) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+static heap_pool_t* heap_pools;                   // All pools currently backing the heap
+static size_t heap_pool_count;
+static size_t heap_min_pools;                     // Pools that are never released
+static size_t large_bytes;                        // Bytes in page-sized allocations
+static int heap_ready;
+static spinlock_t heap_lock = SPINLOCK_INIT;       // Free lists, pools and counters
+
+/*
+ * Accounting is kept up to date by the allocator itself, so memory_stats
+ * reads it in constant time. Byte counts change only under heap_lock: the
+ * free lists add and subtract block sizes as blocks come and go, and bytes
+ * in use are the pools' capacity less that. Request counts are per CPU and
+ * updated with interrupts disabled on paths that disable them anyway.
+ */
+#define POOL_CAPACITY   (HEAP_POOL_SIZE - POOL_HEADER - BLOCK_OVERHEAD)
+
+typedef struct heap_counters {
+    uint32_t allocations;
+    uint32_t frees;
+    uint32_t failures;
+    uint32_t size_histogram[MEMORY_HISTOGRAM_BUCKETS];
+} heap_counters_t;
+
+static size_t free_bytes;                         // In blocks on the free lists
+static size_t peak_bytes;                         // High-water mark of used plus large bytes
+static heap_counters_t heap_counters[MAX_CPUS];
+
+static inline size_t block_size(const block_header_t* block) {
+    return block->size & ~(size_t)BLOCK_FLAGS;
+}
 
-void memory_init(size_t size) {
-    if (heap != NULL) {
-        terminal_writestring("Error: memory_init() called more than once.\n");
-        return;
-    }
+static inline int block_is_free(const block_header_t* block) {
+    return (block->size & BLOCK_FREE) != 0;
+}
 
-    if (size == 0 || size > 0x100000) {
-        terminal_writestring("Error: Invalid heap size specified.\n");
-        return;
+static inline block_header_t* block_next(const block_header_t* block) {
+    return (block_header_t*)((uint8_t*)block + block_size(block));
+}
+
+static inline block_header_t* block_prev(const block_header_t* block) {
+    return (block_header_t*)((uint8_t*)block - block->prev_size);
+}
+
+static inline void* block_to_ptr(const block_header_t* block) {
+    return (uint8_t*)block + BLOCK_OVERHEAD;
+}
+
+static inline block_header_t* ptr_to_block(const void* ptr) {
+    return (block_header_t*)((uint8_t*)ptr - BLOCK_OVERHEAD);
+}
+
+// Index of the most significant set bit
+static inline int fls_size(size_t size) {
+    return (int)(sizeof(unsigned long) * 8 - 1) - __builtin_clzl((unsigned long)size);
+}
+
+// Bin holding free blocks of this exact size
+static inline void mapping_insert(size_t size, int* fl, int* sl) {
+    if (size < SMALL_BLOCK) {
+        *fl = 0;
+        *sl = (int)(size / (SMALL_BLOCK / SL_COUNT));
+    } else {
+        int f = fls_size(size);
+        *sl = (int)(size >> (f - SL_LOG2)) ^ SL_COUNT;
+        *fl = f - (FL_SHIFT - 1);
     }
+}
 
-    heap = (uint8_t*)static_heap; // Example static memory block
-    HEAP_SIZE = size;
-    heap_ptr = heap;
+// First bin in which every block is large enough for the request
+static inline void mapping_search(size_t size, int* fl, int* sl) {
+    if (size >= SMALL_BLOCK) {
+        size += ((size_t)1 << (fls_size(size) - SL_LOG2)) - 1;
+    }
+    mapping_insert(size, fl, sl);
+}
 
-    // Initialize the free list
-    free_list = (block_header_t*)heap;
-    free_list->size = HEAP_SIZE;
-    free_list->next = NULL;
-    free_list->free = 1;
+static block_header_t* find_suitable_block(int* fl, int* sl) {
+    if (*fl >= FL_COUNT) {
+        return NULL;
+    }
 
-    terminal_writestring("Heap initialized successfully.\n");
+    uint32_t sl_map = sl_bitmap[*fl] & (~0U << *sl);
+    if (!sl_map) {
+        uint32_t fl_map = fl_bitmap & (~0U << (*fl + 1));
+        if (!fl_map) {
+            return NULL;
+        }
+        *fl = __builtin_ctz(fl_map);
+        sl_map = sl_bitmap[*fl];
+    }
+    *sl = __builtin_ctz(sl_map);
+    return free_lists[*fl][*sl];
 }
-// Allocate a physical page
-void* alloc_page() {
-    for (size_t i = 0; i < BITMAP_SIZE * 8; i++) {
-        if (!(bitmap[i / 8] & (1 << (i % 8)))) {
-            bitmap[i / 8] |= (1 << (i % 8));
-            return (void*)(i * PAGE_SIZE);
+
+static void remove_free_block(block_header_t* block) {
+    int fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+    free_bytes -= block_size(block);
+
+    block_header_t* prev = block->prev_free;
+    block_header_t* next = block->next_free;
+    if (next) {
+        next->prev_free = prev;
+    }
+    if (prev) {
+        prev->next_free = next;
+    } else {
+        free_lists[fl][sl] = next;
+        if (!next) {
+            sl_bitmap[fl] &= ~(1U << sl);
+            if (!sl_bitmap[fl]) {
+                fl_bitmap &= ~(1U << fl);
+            }
         }
     }
-    return NULL; // Out of memory
 }
 
-// Free a physical page
-void free_page(void* addr) {
-    size_t index = (uintptr_t)addr / PAGE_SIZE;
-    bitmap[index / 8] &= ~(1 << (index % 8));
+static void insert_free_block(block_header_t* block) {
+    int fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+    free_bytes += block_size(block);
+
+    block_header_t* head = free_lists[fl][sl];
+    block->next_free = head;
+    block->prev_free = NULL;
+    if (head) {
+        head->prev_free = block;
+    }
+    free_lists[fl][sl] = block;
+    fl_bitmap |= 1U << fl;
+    sl_bitmap[fl] |= 1U << sl;
+}
+
+// Mark a block free, publish its boundary tag to the next block and bin it
+static void release_block(block_header_t* block) {
+    block_header_t* next = block_next(block);
+    block->size |= BLOCK_FREE;
+    next->prev_size = block_size(block);
+    next->size |= BLOCK_PREV_FREE;
+    insert_free_block(block);
+}
+
+// Mark a block (already removed from its bin) as allocated
+static void claim_block(block_header_t* block) {
+    block->size &= ~(size_t)BLOCK_FREE;
+    block_next(block)->size &= ~(size_t)BLOCK_PREV_FREE;
+}
+
+// Shrink an allocated block to `size` bytes, freeing the tail if it is big enough
+static void trim_block(block_header_t* block, size_t size) {
+    size_t total = block_size(block);
+    if (total - size < MIN_BLOCK_SIZE) {
+        return;
+    }
+
+    block_header_t* rest = (block_header_t*)((uint8_t*)block + size);
+    rest->size = total - size;
+    block->size = size | (block->size & BLOCK_FLAGS);
+
+    block_header_t* next = block_next(rest);
+    if (block_is_free(next)) {
+        remove_free_block(next);
+        rest->size += block_size(next);
+    }
+    release_block(rest);
 }
 
 size_t align_up(size_t size) {
-    return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
-}   
+    return (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+}
 
-void* kmalloc(size_t size) {
-    if (heap == NULL || heap_ptr == NULL) {
-        terminal_writestring("Error: kmalloc() called before memory_init().\n");
+// Total block size needed to serve a request of `size` bytes
+static size_t adjust_request(size_t size) {
+    size_t total = align_up(size) + BLOCK_OVERHEAD;
+    return total < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : total;
+}
+
+static inline block_header_t* pool_first_block(const heap_pool_t* pool) {
+    return (block_header_t*)((uint8_t*)pool + POOL_HEADER);
+}
+
+static inline heap_pool_t* block_pool(const block_header_t* block) {
+    return (heap_pool_t*)((uintptr_t)block & ~(uintptr_t)(HEAP_POOL_SIZE - 1));
+}
+
+// Take a pool from the page allocator and make it one big free block
+static heap_pool_t* heap_add_pool(void) {
+    uintptr_t base = pmm_alloc(HEAP_POOL_ORDER);
+    if (!base) {
         return NULL;
     }
+    for (size_t i = 0; i < HEAP_POOL_PAGES; i++) {
+        pmm_page(base + i * PAGE_SIZE)->flags |= PAGE_HEAP;
+    }
 
-    // Ensure the requested size is aligned
-    size_t total_size = align_up(size) + sizeof(block_header_t);  // Align size and add header size
-    block_header_t* current = free_list;
-    block_header_t* previous = NULL;
+    heap_pool_t* pool = (heap_pool_t*)phys_to_virt(base);
+    pool->prev = NULL;
+    pool->next = heap_pools;
+    if (heap_pools) heap_pools->prev = pool;
+    heap_pools = pool;
+    heap_pool_count++;
+    HEAP_SIZE += HEAP_POOL_SIZE;
+
+    // One free block spanning the pool, followed by an allocated zero-sized
+    // sentinel so the last real block always has a valid next neighbour
+    block_header_t* first = pool_first_block(pool);
+    block_header_t* last = (block_header_t*)((uint8_t*)pool + HEAP_POOL_SIZE - BLOCK_OVERHEAD);
+    first->prev_size = 0;
+    first->size = HEAP_POOL_SIZE - POOL_HEADER - BLOCK_OVERHEAD;
+    last->size = 0;
+    release_block(first);
+    return pool;
+}
+
+// Give a completely free pool (not on the free lists) back to the page allocator
+static void heap_release_pool(heap_pool_t* pool) {
+    if (pool->prev) {
+        pool->prev->next = pool->next;
+    } else {
+        heap_pools = pool->next;
+    }
+    if (pool->next) pool->next->prev = pool->prev;
+    heap_pool_count--;
+    HEAP_SIZE -= HEAP_POOL_SIZE;
 
-    // First-fit search
-    while (current) {
-        if (current->free && current->size >= total_size) {
-            size_t remaining_size = current->size - total_size;
+    uintptr_t base = virt_to_phys(pool);
+    for (size_t i = 0; i < HEAP_POOL_PAGES; i++) {
+        pmm_page(base + i * PAGE_SIZE)->flags &= ~PAGE_HEAP;
+    }
+    pmm_free(base, HEAP_POOL_ORDER);
+}
 
-            // Split the block if there's enough space left
-            if (remaining_size >= sizeof(block_header_t) + MIN_BLOCK_SIZE) {
-                block_header_t* new_block = (block_header_t*)((uint8_t*)current + total_size);
-                new_block->size = remaining_size;
-                new_block->free = 1;
-                new_block->next = current->next;
+static void magazine_init(void);
 
-                current->size = total_size;
-                current->next = new_block;
-            }
+// `size` is the amount of heap to have ready up front; it is never released
+void memory_init(size_t size) {
+    if (heap_ready) {
+        terminal_writestring("Error: memory_init() called more than once.\n");
+        return;
+    }
+
+    heap_min_pools = (size + HEAP_POOL_SIZE - 1) / HEAP_POOL_SIZE;
+    if (heap_min_pools == 0) {
+        heap_min_pools = 1;
+    }
+    for (size_t i = 0; i < heap_min_pools; i++) {
+        if (!heap_add_pool()) {
+            terminal_writestring("Error: Not enough memory for the initial heap.\n");
+            return;
+        }
+    }
+
+    magazine_init();
+    heap_ready = 1;
+    terminal_writestring("Heap initialized successfully.\n");
+}
+// Page allocation is served by the buddy allocator in pmm.c; the pages are
+// returned at their direct-mapped virtual address
+void* alloc_page(void) {
+    uintptr_t frame = pmm_alloc(0);
+    return frame ? phys_to_virt(frame) : NULL;
+}
+
+void free_page(void* addr) {
+    pmm_free(virt_to_phys(addr), 0);
+}
+
+// Allocate `count` physically contiguous pages whose first frame number is a
+// multiple of `align` (a power of two, in pages; 0 or 1 means no alignment)
+void* alloc_pages(size_t count, size_t align) {
+    uintptr_t frame = pmm_alloc_range(count, align);
+    return frame ? phys_to_virt(frame) : NULL;
+}
 
-            current->free = 0;
-            return (void*)((uint8_t*)current + sizeof(block_header_t));
+void free_pages(void* addr, size_t count) {
+    pmm_free_range(virt_to_phys(addr), count);
+}
+
+// With heap_lock held, after anything that can raise the bytes in use
+static void note_peak(void) {
+    size_t used = heap_pool_count * POOL_CAPACITY - free_bytes + large_bytes;
+    if (used > peak_bytes) {
+        peak_bytes = used;
+    }
+}
+
+// Interrupts are disabled, so the counters are this CPU's until we are done
+static void count_request(size_t size, const void* ptr) {
+    heap_counters_t* counters = &heap_counters[this_cpu()->id];
+    int bucket = fls_size(size);
+    if (bucket >= MEMORY_HISTOGRAM_BUCKETS) {
+        bucket = MEMORY_HISTOGRAM_BUCKETS - 1;
+    }
+    counters->size_histogram[bucket]++;
+    if (ptr) {
+        counters->allocations++;
+    } else {
+        counters->failures++;
+    }
+}
+
+static void count_free(void) {
+    heap_counters[this_cpu()->id].frees++;
+}
+
+// Serve a request from the pools, growing the heap if nothing fits
+static block_header_t* heap_alloc(size_t size) {
+    size_t total_size = adjust_request(size);
+    int fl, sl;
+    mapping_search(total_size, &fl, &sl);
+
+    block_header_t* block = find_suitable_block(&fl, &sl);
+    if (!block) {
+        if (!heap_add_pool()) {
+            terminal_writestring("Error: Not enough memory for kmalloc().\n");
+            return NULL;
         }
-        previous = current;
-        current = current->next;
+        mapping_search(total_size, &fl, &sl);
+        block = find_suitable_block(&fl, &sl);
     }
 
-    // No suitable block found; allocate from heap
-    if (size > (HEAP_SIZE - (size_t)(heap_ptr - heap))) {
+    remove_free_block(block);
+    claim_block(block);
+    trim_block(block, total_size);
+    note_peak();
+    return block;
+}
+
+static void shared_lock(spinlock_t* lock);
+
+// Page-granular allocation for large requests, `align` in pages
+static void* large_alloc(size_t size, size_t align) {
+    size_t count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uintptr_t addr = pmm_alloc_range(count, align);
+    uint32_t flags = irq_save();
+    if (!addr) {
+        count_request(size, NULL);
+        irq_restore(flags);
         terminal_writestring("Error: Not enough memory for kmalloc().\n");
         return NULL;
     }
 
-    // Create a new block at the heap pointer
-    block_header_t* new_block = (block_header_t*)heap_ptr;
-    new_block->size = total_size;
-    new_block->free = 0;
-    new_block->next = NULL;
+    page_t* page = pmm_page(addr);
+    page->flags |= PAGE_LARGE;
+    page->count = count;
+    void* ptr = phys_to_virt(addr);
+    count_request(size, ptr);
+    shared_lock(&heap_lock);
+    large_bytes += count * PAGE_SIZE;
+    note_peak();
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return ptr;
+}
 
-    heap_ptr += total_size;  // Move heap pointer forward
+/*
+ * Per-CPU magazines in front of the block allocator. Requests up to
+ * MAG_MAX_SIZE are rounded up to one of MAG_CLASSES sizes and served from a
+ * per-CPU stack of free blocks of that size with only interrupts disabled.
+ * An empty stack is refilled with a batch of MAG_BATCH blocks from the shared
+ * depot, or straight from the heap when the depot has none, and a full one
+ * hands its coldest batch back; either way a CPU takes a shared lock at most
+ * once every MAG_BATCH operations.
+ *
+ * Blocks in magazines and in the depot are still allocated as far as the
+ * heap is concerned. kfree recovers the class from the block size: heap_alloc
+ * leaves less than MIN_BLOCK_SIZE bytes of slack and the classes are
+ * MIN_BLOCK_SIZE apart or more.
+ */
+#define MAG_CLASSES     10
+#define MAG_MAX_SIZE    512
+#define MAG_BATCH       16      // Blocks moved between a CPU and the depot at once
+#define MAG_CAPACITY    (2 * MAG_BATCH)
+#define MAG_DEPOT_MAX   8       // Batches kept per class, the rest go back to the heap
+
+static const size_t mag_sizes[MAG_CLASSES] = { 16, 32, 48, 64, 96, 128, 192, 256, 384, 512 };
+static uint8_t mag_class_index[MAG_MAX_SIZE / 16 + 1];   // Smallest class for (size + 15) / 16
+
+typedef struct magazine {
+    uint32_t count;
+    void* rounds[MAG_CAPACITY];
+} magazine_t;
+
+typedef struct mag_cpu {
+    magazine_t classes[MAG_CLASSES];
+    // Statistics
+    uint32_t lock_acquisitions;     // Heap and depot locks taken by this CPU
+    uint32_t lock_contended;        // ...of which had to wait for another CPU
+} mag_cpu_t;
+
+// Depot batches are chains of free blocks linked through their payload; the
+// first block of a batch also links the next batch
+typedef struct mag_link {
+    struct mag_link* next;
+    struct mag_link* next_batch;
+} mag_link_t;
+
+typedef struct mag_depot {
+    spinlock_t lock;
+    mag_link_t* batches;
+    uint32_t count;
+} mag_depot_t;
+
+static mag_cpu_t mag_cpus[MAX_CPUS];
+static mag_depot_t mag_depots[MAG_CLASSES];
+static int magazines_enabled;
+
+static void magazine_init(void) {
+    int class = 0;
+    for (size_t i = 0; i < sizeof(mag_class_index); i++) {
+        while (mag_sizes[class] < i * 16) {
+            class++;
+        }
+        mag_class_index[i] = class;
+    }
+    for (int c = 0; c < MAG_CLASSES; c++) {
+        mag_depots[c].lock = (spinlock_t)SPINLOCK_INIT;
+    }
+    magazines_enabled = 1;
+}
 
-    // No need to split if there's no leftover space
-    if (previous) {
-        previous->next = new_block;
-    } else {
-        free_list = new_block;  // Set as the first free block if it's the first allocation
+// Take the heap or a depot lock with interrupts already disabled, counting
+// the acquisitions that had to wait
+static void shared_lock(spinlock_t* lock) {
+    mag_cpu_t* mc = &mag_cpus[this_cpu()->id];
+    mc->lock_acquisitions++;
+    if (!spin_trylock(lock)) {
+        mc->lock_contended++;
+        spin_lock(lock);
+    }
+}
+
+// Class a block can be cached in, -1 if its size matches none
+static int mag_class_of_block(const block_header_t* block) {
+    size_t usable = block_size(block) - BLOCK_OVERHEAD;
+    size_t rounded = usable & ~(size_t)15;
+    if (rounded == 0 || rounded > MAG_MAX_SIZE) {
+        return -1;
+    }
+    int class = mag_class_index[rounded / 16];
+    return mag_sizes[class] == rounded ? class : -1;
+}
+
+// Fill an empty magazine from the depot, or from the heap under one lock
+static int mag_refill(int class, magazine_t* mag) {
+    mag_depot_t* depot = &mag_depots[class];
+    shared_lock(&depot->lock);
+    mag_link_t* batch = depot->batches;
+    if (batch) {
+        depot->batches = batch->next_batch;
+        depot->count--;
     }
+    spin_unlock(&depot->lock);
 
-    return (void*)((uint8_t*)new_block + sizeof(block_header_t));
+    if (batch) {
+        for (mag_link_t* link = batch; link; link = link->next) {
+            mag->rounds[mag->count++] = link;
+        }
+        return 1;
+    }
+
+    shared_lock(&heap_lock);
+    for (int i = 0; i < MAG_BATCH; i++) {
+        block_header_t* block = heap_alloc(mag_sizes[class]);
+        if (!block) {
+            break;
+        }
+        mag->rounds[mag->count++] = block_to_ptr(block);
+    }
+    spin_unlock(&heap_lock);
+    return mag->count != 0;
+}
+
+static void heap_free_block(block_header_t* block);
+
+// Pass the oldest MAG_BATCH blocks of a full magazine to the depot, or back
+// to the heap if the depot already holds enough of this class
+static void mag_flush(int class, magazine_t* mag) {
+    mag_link_t* batch = NULL;
+    for (int i = MAG_BATCH - 1; i >= 0; i--) {
+        mag_link_t* link = (mag_link_t*)mag->rounds[i];
+        link->next = batch;
+        batch = link;
+    }
+    for (int i = MAG_BATCH; i < MAG_CAPACITY; i++) {
+        mag->rounds[i - MAG_BATCH] = mag->rounds[i];
+    }
+    mag->count -= MAG_BATCH;
+
+    mag_depot_t* depot = &mag_depots[class];
+    shared_lock(&depot->lock);
+    if (depot->count < MAG_DEPOT_MAX) {
+        batch->next_batch = depot->batches;
+        depot->batches = batch;
+        depot->count++;
+        spin_unlock(&depot->lock);
+        return;
+    }
+    spin_unlock(&depot->lock);
+
+    shared_lock(&heap_lock);
+    while (batch) {
+        mag_link_t* next = batch->next;
+        heap_free_block(ptr_to_block(batch));
+        batch = next;
+    }
+    spin_unlock(&heap_lock);
+}
+
+static void* mag_alloc(int class, size_t size) {
+    uint32_t flags = irq_save();
+    magazine_t* mag = &mag_cpus[this_cpu()->id].classes[class];
+    void* ptr = NULL;
+    if (mag->count || mag_refill(class, mag)) {
+        ptr = mag->rounds[--mag->count];
+    }
+    count_request(size, ptr);
+    irq_restore(flags);
+    return ptr;
+}
+
+static void mag_free(int class, void* ptr) {
+    uint32_t flags = irq_save();
+    magazine_t* mag = &mag_cpus[this_cpu()->id].classes[class];
+    if (mag->count == MAG_CAPACITY) {
+        mag_flush(class, mag);
+    }
+    mag->rounds[mag->count++] = ptr;
+    count_free();
+    irq_restore(flags);
+}
+
+void* kmalloc(size_t size) {
+    if (!heap_ready) {
+        terminal_writestring("Error: kmalloc() called before memory_init().\n");
+        return NULL;
+    }
+
+    if (size == 0) {
+        return NULL;
+    }
+
+    void* ptr;
+    if (size >= LARGE_ALLOC) {
+        ptr = large_alloc(size, 1);
+    } else if (size <= MAG_MAX_SIZE && magazines_enabled) {
+        ptr = mag_alloc(mag_class_index[(size + 15) / 16], size);
+    } else {
+        uint32_t flags = irq_save();
+        shared_lock(&heap_lock);
+        block_header_t* block = heap_alloc(size);
+        spin_unlock(&heap_lock);
+        ptr = block ? block_to_ptr(block) : NULL;
+        count_request(size, ptr);
+        irq_restore(flags);
+    }
+    trace_event(TRACE_KMALLOC, (uintptr_t)ptr, size);
+    return ptr;
 }
 
 void* kmalloc_aligned(size_t size, size_t alignment) {
@@ -134,116 +643,371 @@ void* kmalloc_aligned(size_t size, size_t alignment) {
         return NULL;
     }
 
-    size_t total_size = size + alignment - 1 + sizeof(block_header_t);
-    void* raw = kmalloc(total_size);
-    if (!raw) return NULL;
+    if (alignment <= ALIGNMENT) {
+        return kmalloc(size);
+    }
+    if (size >= LARGE_ALLOC || alignment >= PAGE_SIZE) {
+        void* ptr = heap_ready && size ? large_alloc(size, alignment / PAGE_SIZE) : NULL;
+        trace_event(TRACE_KMALLOC, (uintptr_t)ptr, size);
+        return ptr;
+    }
+
+    // Over-allocate so that a leading gap big enough to be a free block of its
+    // own can always be split off in front of the aligned payload
+    if (!heap_ready || size == 0) {
+        return NULL;
+    }
+    uint32_t flags = irq_save();
+    shared_lock(&heap_lock);
+    block_header_t* block = heap_alloc(size + alignment + MIN_BLOCK_SIZE);
+    if (!block) {
+        spin_unlock(&heap_lock);
+        count_request(size, NULL);
+        irq_restore(flags);
+        return NULL;
+    }
 
-    uintptr_t aligned_address = ((uintptr_t)raw + sizeof(block_header_t) + alignment - 1) & ~(alignment - 1);
-    return (void*)aligned_address;
+    uintptr_t raw = (uintptr_t)block_to_ptr(block);
+    uintptr_t aligned = (raw + MIN_BLOCK_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (raw % alignment == 0) {
+        aligned = raw;
+    }
+
+    if (aligned != raw) {
+        size_t gap = aligned - raw;
+        block_header_t* aligned_block = ptr_to_block((void*)aligned);
+        aligned_block->size = block_size(block) - gap;
+        block->size = gap | (block->size & BLOCK_FLAGS);
+
+        // The gap becomes a free block; its next neighbour is the aligned block.
+        // A free block never borders another free block, so no merge is needed.
+        block->size |= BLOCK_FREE;
+        aligned_block->prev_size = gap;
+        aligned_block->size |= BLOCK_PREV_FREE;
+        insert_free_block(block);
+        block = aligned_block;
+    }
+
+    trim_block(block, adjust_request(size));
+    spin_unlock(&heap_lock);
+    count_request(size, block_to_ptr(block));
+    irq_restore(flags);
+    trace_event(TRACE_KMALLOC, (uintptr_t)block_to_ptr(block), size);
+    return block_to_ptr(block);
 }
 
 // Free function to release memory
 void kfree(void* ptr) {
-    if (ptr == NULL || ptr < (void*)heap || ptr >= (void*)(heap + HEAP_SIZE)) {
+    trace_event(TRACE_KFREE, (uintptr_t)ptr, 0);
+    page_t* page = ptr ? pmm_page(virt_to_phys(ptr)) : NULL;
+
+    // Page-sized allocations go straight back to the page allocator
+    if (page && (page->flags & PAGE_LARGE) && (uintptr_t)ptr % PAGE_SIZE == 0) {
+        page->flags &= ~PAGE_LARGE;
+        size_t count = page->count;
+        uint32_t flags = irq_save();
+        shared_lock(&heap_lock);
+        large_bytes -= count * PAGE_SIZE;
+        spin_unlock(&heap_lock);
+        count_free();
+        irq_restore(flags);
+        pmm_free_range(virt_to_phys(ptr), count);
+        return;
+    }
+
+    if (!page || !(page->flags & PAGE_HEAP) ||
+        (uintptr_t)ptr - (uintptr_t)block_pool(ptr) < POOL_HEADER + BLOCK_OVERHEAD) {
         terminal_writestring("Error: Invalid pointer passed to kfree.\n");
         return;
     }
 
-    // Get the block header
-    block_header_t* block = (block_header_t*)((uint8_t*)ptr - sizeof(block_header_t));
-    if (block->free) {
+    // Small blocks go to this CPU's magazine; a double free of one of those
+    // is only caught if the block has since been given back to the heap
+    block_header_t* block = ptr_to_block(ptr);
+    int class = magazines_enabled && !block_is_free(block) ? mag_class_of_block(block) : -1;
+    if (class >= 0) {
+        mag_free(class, ptr);
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    shared_lock(&heap_lock);
+    if (block_is_free(block)) {
+        spin_unlock_irqrestore(&heap_lock, flags);
         terminal_writestring("Error: Double free detected.\n");
         return;
     }
+    heap_free_block(block);
+    spin_unlock(&heap_lock);
+    count_free();
+    irq_restore(flags);
+}
 
-    // Mark the block as free
-    block->free = 1;
+// Return an allocated block to the free lists, with heap_lock held
+static void heap_free_block(block_header_t* block) {
+    // Coalesce with the previous block using its boundary tag
+    if (block->size & BLOCK_PREV_FREE) {
+        block_header_t* prev = block_prev(block);
+        remove_free_block(prev);
+        prev->size += block_size(block);
+        block = prev;
+    }
 
-    // Coalesce with next block if possible
-    if (block->next && block->next->free) {
-        block->size += block->next->size + sizeof(block_header_t);
-        block->next = block->next->next;
+    // Coalesce with the next block
+    block_header_t* next = block_next(block);
+    if (block_is_free(next)) {
+        remove_free_block(next);
+        block->size += block_size(next);
     }
 
-    // Traverse the free list to coalesce with the previous block
-    block_header_t* current = free_list;
-    while (current) {
-        if (current->next == block && current->free) {
-            current->size += block->size + sizeof(block_header_t);
-            current->next = block->next;
-            break;
-        }
-        current = current->next;
+    // A block spanning its whole pool means the pool is empty
+    heap_pool_t* pool = block_pool(block);
+    if (block == pool_first_block(pool) && block_size(block_next(block)) == 0 &&
+        heap_pool_count > heap_min_pools) {
+        heap_release_pool(pool);
+    } else {
+        release_block(block);
     }
 }
 
-void memory_stats() {
-    size_t total_free = 0;
-    size_t total_allocated = 0;
-    size_t max_free_block = 0;
-    size_t block_count = 0;
+void memory_stats(memory_stats_t* stats) {
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    stats->pools = heap_pool_count;
+    stats->heap_bytes = heap_pool_count * POOL_CAPACITY;
+    stats->free_bytes = free_bytes;
+    stats->used_bytes = stats->heap_bytes - free_bytes;
+    stats->large_bytes = large_bytes;
+    stats->peak_bytes = peak_bytes;
+
+    // The head of the highest non-empty bin; its bin mates are at most one
+    // second-level step larger
+    stats->largest_free = 0;
+    if (fl_bitmap) {
+        int fl = 31 - __builtin_clz(fl_bitmap);
+        int sl = 31 - __builtin_clz(sl_bitmap[fl]);
+        stats->largest_free = block_size(free_lists[fl][sl]);
+    }
+    spin_unlock_irqrestore(&heap_lock, flags);
 
-    block_header_t* current = free_list;
-    while (current) {
-        block_count++;
-        if (current->free) {
-            total_free += current->size;
-            if (current->size > max_free_block) {
-                max_free_block = current->size;
-            }
-        } else {
-            total_allocated += current->size;
-        }
-        current = current->next;
+    size_t scattered = stats->free_bytes - stats->largest_free;
+    if (!stats->free_bytes) {
+        stats->fragmentation = 0;
+    } else if (stats->free_bytes < 4 * 1024 * 1024) {
+        stats->fragmentation = scattered * 1000 / stats->free_bytes;
+    } else {
+        stats->fragmentation = scattered / (stats->free_bytes / 1000);
     }
 
-    terminal_writestring("Heap Statistics:\n");
-    terminal_writestring("Total Allocated: ");
-    terminal_write_int(total_allocated);
-    terminal_writestring(" bytes\n");
+    // Per-CPU counters are read racily; they are only statistics
+    stats->cached_bytes = 0;
+    stats->allocations = stats->frees = stats->failures = 0;
+    stats->lock_acquisitions = stats->lock_contended = 0;
+    for (int b = 0; b < MEMORY_HISTOGRAM_BUCKETS; b++) {
+        stats->size_histogram[b] = 0;
+    }
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        for (int c = 0; c < MAG_CLASSES; c++) {
+            stats->cached_bytes += mag_cpus[i].classes[c].count * (mag_sizes[c] + BLOCK_OVERHEAD);
+        }
+        stats->allocations += heap_counters[i].allocations;
+        stats->frees += heap_counters[i].frees;
+        stats->failures += heap_counters[i].failures;
+        for (int b = 0; b < MEMORY_HISTOGRAM_BUCKETS; b++) {
+            stats->size_histogram[b] += heap_counters[i].size_histogram[b];
+        }
+        stats->lock_acquisitions += mag_cpus[i].lock_acquisitions;
+        stats->lock_contended += mag_cpus[i].lock_contended;
+    }
+    for (int c = 0; c < MAG_CLASSES; c++) {
+        stats->cached_bytes += mag_depots[c].count * MAG_BATCH * (mag_sizes[c] + BLOCK_OVERHEAD);
+    }
+}
 
-    terminal_writestring("Total Free: ");
-    
-    terminal_write_int(total_free);
-    terminal_writestring(" bytes\n");
+void memory_stats_print(void) {
+    memory_stats_t stats;
+    memory_stats(&stats);
+
+    kprintf("Heap Statistics:\n"
+            "Used: %zu bytes (%zu cached in magazines), Free: %zu bytes, Peak: %zu bytes\n"
+            "Largest Free Block: %zu bytes, Fragmentation: %u.%u%%\n"
+            "Heap Pools: %u, Large Allocations: %zu bytes\n"
+            "Requests: %u allocations, %u frees, %u failed; %u of %u shared lock acquisitions contended\n",
+            stats.used_bytes, stats.cached_bytes, stats.free_bytes, stats.peak_bytes,
+            stats.largest_free, (unsigned int)(stats.fragmentation / 10), (unsigned int)(stats.fragmentation % 10),
+            (unsigned int)stats.pools, stats.large_bytes,
+            (unsigned int)stats.allocations, (unsigned int)stats.frees, (unsigned int)stats.failures,
+            (unsigned int)stats.lock_contended, (unsigned int)stats.lock_acquisitions);
+
+    terminal_writestring("Request sizes:");
+    for (int b = 0; b < MEMORY_HISTOGRAM_BUCKETS; b++) {
+        if (stats.size_histogram[b]) {
+            kprintf(" %u+:%u", 1u << b, (unsigned int)stats.size_histogram[b]);
+        }
+    }
+    terminal_writestring("\n");
+}
 
-    terminal_writestring("Max Free Block: ");
-    terminal_write_int(max_free_block);
-    terminal_writestring(" bytes\n");
+// Debug check: recount everything the hard way under the lock
+int memory_check(void) {
+    size_t walked_free = 0, walked_used = 0, pools = 0;
+    int errors = 0;
+
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    for (heap_pool_t* pool = heap_pools; pool; pool = pool->next) {
+        pools++;
+        int prev_free = 0;
+        for (block_header_t* current = pool_first_block(pool); block_size(current); current = block_next(current)) {
+            if (block_is_free(current)) {
+                if (prev_free) {
+                    errors++;
+                }
+                walked_free += block_size(current);
+            } else {
+                walked_used += block_size(current);
+            }
+            prev_free = block_is_free(current);
+        }
+    }
+    if (pools != heap_pool_count) {
+        errors++;
+    }
+    if (walked_free != free_bytes || walked_used != heap_pool_count * POOL_CAPACITY - free_bytes) {
+        errors++;
+    }
+    spin_unlock_irqrestore(&heap_lock, flags);
 
-    terminal_writestring("Number of Blocks: ");
-    terminal_write_int(block_count);
-    terminal_writestring("\n");
+    if (errors) {
+        kprintf("Error: Heap check failed: %zu pools, %zu free and %zu used bytes walked, "
+                "counters say %zu free\n", pools, walked_free, walked_used, free_bytes);
+    }
+    return errors;
 }
 
 
 
 void memory_debug() {
-    block_header_t* current = free_list;
     size_t total_free_space = 0;
     size_t total_used_space = 0;
 
+    // Printing under the lock keeps the walk consistent; it is a debug aid
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
     terminal_writestring("Free blocks:\n");
-    while (current) {
-        if (current->free) {
-            terminal_write_hex((uintptr_t)current);
-            terminal_writestring(" - Free block, Size: ");
-            terminal_write_int(current->size);
-            terminal_writestring("\n");
-            total_free_space += current->size;
+    for (heap_pool_t* pool = heap_pools; pool; pool = pool->next)
+    for (block_header_t* current = pool_first_block(pool); block_size(current); current = block_next(current)) {
+        int is_free = block_is_free(current);
+        kprintf("%p - %s block, Size: %zu\n", (void*)current, is_free ? "Free" : "Used", block_size(current));
+        if (is_free) {
+            total_free_space += block_size(current);
         } else {
-            terminal_write_hex((uintptr_t)current);
-            terminal_writestring(" - Used block, Size: ");
-            terminal_write_int(current->size);
-            terminal_writestring("\n");
-            total_used_space += current->size;
+            total_used_space += block_size(current);
+        }
+    }
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    kprintf("\nTotal Free Space: %zu\nTotal Used Space: %zu\n\n", total_free_space, total_used_space);
+}
+
+/*
+ * Allocation stress test: 1, 2, 4 and 8 tasks each run a loop of small
+ * kmalloc/kfree pairs, first with every request going to the shared heap and
+ * then through the magazines. Tasks spread over the CPUs by work stealing,
+ * so the wall clock cost per pair shows how allocation throughput scales and
+ * the contended lock count shows how much of that the shared locks eat.
+ * Each run starts its own workers and holds them at a gate until they all
+ * exist, so task creation stays out of the timing.
+ */
+#define KMALLOC_BENCH_TASKS       8
+#define KMALLOC_BENCH_ITERATIONS  20000
+#define KMALLOC_BENCH_LIVE        8       // Allocations each worker keeps outstanding
+
+static wait_queue_t bench_gate = WAIT_QUEUE_INIT;
+static uint32_t bench_open;             // Set under bench_gate.lock to start the workers
+static uint32_t bench_waiting;          // Workers at the gate, protected by bench_gate.lock
+
+static void kmalloc_bench_worker(void) {
+    void* live[KMALLOC_BENCH_LIVE] = { NULL };
+
+    uint32_t flags = spin_lock_irqsave(&bench_gate.lock);
+    bench_waiting++;
+    while (!bench_open) {
+        task_block_locked(&bench_gate);
+        spin_lock(&bench_gate.lock);
+    }
+    spin_unlock_irqrestore(&bench_gate.lock, flags);
+
+    for (uint32_t i = 0; i < KMALLOC_BENCH_ITERATIONS; i++) {
+        uint32_t slot = i % KMALLOC_BENCH_LIVE;
+        if (live[slot]) {
+            kfree(live[slot]);
+        }
+        live[slot] = kmalloc(16 << (i % 6));
+        if (live[slot]) {
+            *(uint32_t*)live[slot] = i;
         }
-        current = current->next;
+    }
+    for (uint32_t slot = 0; slot < KMALLOC_BENCH_LIVE; slot++) {
+        if (live[slot]) {
+            kfree(live[slot]);
+        }
+    }
+}
+
+static void kmalloc_bench_run(uint32_t tasks, int magazines) {
+    bench_open = 0;
+    bench_waiting = 0;
+    uint32_t started = bench_spawn(kmalloc_bench_worker, tasks);
+    while (__atomic_load_n(&bench_waiting, __ATOMIC_ACQUIRE) < started) {
+        task_yield();
+    }
+
+    uint32_t acquisitions = 0, contended = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        acquisitions -= mag_cpus[i].lock_acquisitions;
+        contended -= mag_cpus[i].lock_contended;
     }
 
-    terminal_writestring("\nTotal Free Space: ");
-    terminal_write_int(total_free_space);
-    terminal_writestring("\nTotal Used Space: ");
-    terminal_write_int(total_used_space);
-    terminal_writestring("\n\n");
-}
\ No newline at end of file
+    magazines_enabled = magazines;
+    uint64_t start = rdtsc();
+
+    uint32_t flags = spin_lock_irqsave(&bench_gate.lock);
+    bench_open = 1;
+    spin_unlock_irqrestore(&bench_gate.lock, flags);
+    task_wake_all(&bench_gate);
+    bench_join();
+
+    uint32_t cycles = (uint32_t)(rdtsc() - start);
+    magazines_enabled = 1;
+    if (started < tasks) {
+        return;
+    }
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        acquisitions += mag_cpus[i].lock_acquisitions;
+        contended += mag_cpus[i].lock_contended;
+    }
+
+    kprintf("kmalloc stress, %u tasks, %s: %u cycles per pair, %u of %u locks contended\n",
+            (unsigned int)tasks, magazines ? "magazines" : "heap only",
+            (unsigned int)(cycles / (tasks * KMALLOC_BENCH_ITERATIONS)),
+            (unsigned int)contended, (unsigned int)acquisitions);
+}
+
+// Needs multitasking and interrupts enabled
+void kmalloc_bench(void) {
+    for (uint32_t tasks = 1; tasks <= KMALLOC_BENCH_TASKS; tasks *= 2) {
+        kmalloc_bench_run(tasks, 0);
+        kmalloc_bench_run(tasks, 1);
+    }
+}
+
+// Small sizes come from the magazines, 2 KB from the shared heap
+BENCH(kmalloc_free_64, 64) {
+    for (uint32_t i = 0; i < iterations; i++) {
+        kfree(kmalloc(64));
+    }
+}
+
+BENCH(kmalloc_free_2k, 64) {
+    for (uint32_t i = 0; i < iterations; i++) {
+        kfree(kmalloc(2048));
+    }
+}
@@ -4,16 +4,47 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define PAGE_SIZE 4096
+#define MEMORY_HISTOGRAM_BUCKETS 32
+
+// Heap counters, kept as the allocator runs. Bytes are whole blocks with
+// their headers; blocks cached in the per-CPU magazines count as used.
+typedef struct memory_stats {
+    size_t heap_bytes;          // Capacity of the pools backing the heap
+    size_t used_bytes;          // In allocated blocks, magazine caches included
+    size_t free_bytes;          // On the free lists
+    size_t cached_bytes;        // Of used_bytes, waiting in magazines and depots
+    size_t large_bytes;         // Page-sized allocations outside the pools
+    size_t peak_bytes;          // High-water mark of used plus large bytes
+    size_t largest_free;        // Biggest free block, to within its size class
+    uint32_t fragmentation;     // Per mille of free bytes outside the largest free block
+    uint32_t pools;
+    uint32_t allocations;
+    uint32_t frees;
+    uint32_t failures;          // Requests that returned NULL
+    uint32_t size_histogram[MEMORY_HISTOGRAM_BUCKETS];  // Requests of [2^n, 2^(n+1)) bytes
+    uint32_t lock_acquisitions; // Heap and depot locks
+    uint32_t lock_contended;
+} memory_stats_t;
+
 // Memory management functions
 void memory_init(size_t size);
 void* kmalloc(size_t size);
+void* kmalloc_aligned(size_t size, size_t alignment);
 void kfree(void* ptr);
 void memory_debug(void);
-void memory_stats();
+void memory_stats(memory_stats_t* stats);   // Constant time, no walk
+void memory_stats_print(void);
+int memory_check(void);       // Walk every pool and check it against the counters; 0 if consistent
+void kmalloc_bench(void);     // Multi-task allocation throughput and lock contention
+
+// Physical page allocation
+void* alloc_page(void);
+void free_page(void* addr);
+void* alloc_pages(size_t count, size_t align);   // Contiguous run, align in pages
+void free_pages(void* addr, size_t count);
 
 // External variables for heap management
-extern uint8_t* heap;        // Base address of the heap
-extern uint8_t* heap_ptr;    // Current position in the heap
-extern size_t HEAP_SIZE;     // Total heap size
+extern size_t HEAP_SIZE;     // Bytes of page-backed pools currently in the heap
 
 #endif // MEMORY_H
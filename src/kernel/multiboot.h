@@ -0,0 +1,50 @@
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include <stdint.h>
+
+// Value left in EAX by a multiboot (v1) compliant bootloader
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+
+// multiboot_info_t.flags
+#define MULTIBOOT_INFO_MEMORY   0x001   // mem_lower/mem_upper are valid
+#define MULTIBOOT_INFO_CMDLINE  0x004   // cmdline is valid
+#define MULTIBOOT_INFO_MODS     0x008   // mods_count/mods_addr are valid
+#define MULTIBOOT_INFO_MEM_MAP  0x040   // mmap_addr/mmap_length are valid
+
+// multiboot_mmap_entry_t.type
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
+typedef struct multiboot_info {
+    uint32_t flags;
+    uint32_t mem_lower;         // KB of memory below 1 MB
+    uint32_t mem_upper;         // KB of memory above 1 MB
+    uint32_t boot_device;
+    uint32_t cmdline;           // Physical address of the kernel command line
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;       // Size of the memory map buffer in bytes
+    uint32_t mmap_addr;         // Physical address of the memory map buffer
+    uint32_t drives_length;
+    uint32_t drives_addr;
+    uint32_t config_table;
+    uint32_t boot_loader_name;
+    uint32_t apm_table;
+} __attribute__((packed)) multiboot_info_t;
+
+typedef struct multiboot_module {
+    uint32_t mod_start;         // Physical address range of the module
+    uint32_t mod_end;
+    uint32_t string;            // Physical address of its command line
+    uint32_t reserved;
+} __attribute__((packed)) multiboot_module_t;
+
+typedef struct multiboot_mmap_entry {
+    uint32_t size;              // Size of the rest of the entry, excluding this field
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+} __attribute__((packed)) multiboot_mmap_entry_t;
+
+#endif // MULTIBOOT_H
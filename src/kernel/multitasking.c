@@ -1,162 +1,980 @@
+#include <stddef.h>
+
 #include "multitasking.h"
+#include "cpu.h"
 #include "memory.h"
+#include "kstack.h"
+#include "fpu.h"
+#include "slab.h"
+#include "smp.h"
+#include "spinlock.h"
 #include "stdio.h"
+#include "serial.h"
+#include "timer.h"
+#include "ktimer.h"
+#include "lapic.h"
+#include "bench.h"
+#include "trace.h"
 
 // Incremental task ID for uniquely identifying tasks
 static uint32_t next_task_id = 1;
 
-// Pointers to manage tasks
-task_t* current_task = NULL;
+// Every task except the idle tasks; new tasks are pushed at the head
 task_t* task_list = NULL;
+static spinlock_t task_list_lock = SPINLOCK_INIT;
 
-// Idle task structure
+// The boot context becomes the first task on CPU 0. Every CPU has an idle
+// task that only runs when it has nothing else to do and is never queued;
+// CPU 0's is static, the others turn their startup context into one.
+static task_t boot_task;
 static task_t idle_task_struct;
 
+// Task structures; their stacks come from the guarded pool in kstack.c
+static kmem_cache_t* task_cache;
+
+// Exited tasks waiting to be freed, linked through queue_next. A task cannot
+// free the stack it is still running on, so the reaper task does it once
+// the task has been switched out for good. The reaper starts out blocked
+// and first runs when the first task exits.
+static task_t* zombies;
+static wait_queue_t reaper_queue = WAIT_QUEUE_INIT;
+static volatile uint32_t tasks_reaped;
+static void reaper_task(void);
+
+_Static_assert(offsetof(task_t, stack_pointer) == 4, "switch.s expects stack_pointer at offset 4");
+
+extern void task_trampoline(void); // switch.s
+
+/*
+ * Multilevel feedback queue. Level 0 is the highest priority. A task that
+ * uses up its slice drops a level and gets a longer slice there; a task that
+ * blocks keeps its level and moves up one when woken, so interactive tasks
+ * float to the top. Every SCHED_BOOST_TICKS all tasks go back to level 0 so
+ * CPU-bound tasks are not starved by a stream of interactive ones.
+ *
+ * Ready tasks sit in one FIFO per level and a bitmap marks the non-empty
+ * levels, so picking the next task is a bit scan and a list pop however many
+ * tasks exist. Blocked tasks are only on their wait queue.
+ *
+ * Each CPU has its own set of queues under its own lock, so CPUs only touch
+ * each other's queues when one runs out of work and steals a ready task from
+ * another. A task goes back to the queues of the CPU it last ran on.
+ */
+typedef struct runqueue {
+    spinlock_t lock;
+    task_queue_t levels[SCHED_LEVELS];
+    uint32_t bitmap;            // Bit n set while levels[n] is non-empty
+    volatile uint32_t nr_ready; // Read without the lock by CPUs looking for work
+    uint32_t boost_epoch;       // Last boost spliced into these queues
+    // Statistics
+    uint32_t ticks;
+    uint32_t idle_ticks;
+    uint32_t switches;
+    uint32_t steals;
+} runqueue_t;
+
+static runqueue_t runqueues[MAX_CPUS];
+static volatile uint32_t boost_epoch;                   // Bumped by every boost
+static uint32_t boost_countdown = SCHED_BOOST_TICKS;    // Counted down by CPU 0
+static uint32_t timeslice_ticks = TASK_DEFAULT_TIMESLICE;
+
 // Idle task implementation
 void idle_task(void) {
     while (1) {
-        // Halt the CPU to save power and avoid unnecessary execution
-        __asm__ volatile("hlt");
+        // Halt the CPU to save power and avoid unnecessary execution. With
+        // tickless idle the tick is stopped first; sti only takes effect
+        // after the next instruction, so no wakeup can slip in before hlt.
+        irq_disable();
+        timer_idle_enter();
+        __asm__ volatile("sti; hlt");
+        irq_disable();
+        timer_idle_exit();
+        irq_enable();
     }
 }
 
+#define PANIC_NO_CPU 0xFFFFFFFF
+
+static uint32_t panic_cpu = PANIC_NO_CPU;
+
+/*
+ * Reporting a failure must not wait on anything: a lock held by another CPU
+ * or by the code that failed, such as an overflow inside kprintf, would hang
+ * it. The first CPU to get here halts the others and breaks the console
+ * lock; a second one panicking at the same time just stops.
+ */
+void panic_enter(void) {
+    irq_disable();
+    uint32_t id = this_cpu()->id;
+    uint32_t owner = PANIC_NO_CPU;
+    if (!__atomic_compare_exchange_n(&panic_cpu, &owner, id, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+        owner != id) {
+        while (1) {
+            __asm__ volatile("cli; hlt");
+        }
+    }
+    smp_halt_others();
+    terminal_panic();
+}
+
 void panic(const char* msg) {
+    panic_enter();
     terminal_writestring("Kernel Panic: ");
     terminal_writestring(msg);
+    terminal_flush();
+    serial_flush();
     while (1) { __asm__ volatile("hlt"); } // Halt the CPU
 }
 
+static void queue_push(task_queue_t* queue, task_t* task) {
+    task->queue_next = NULL;
+    if (queue->tail) {
+        queue->tail->queue_next = task;
+    } else {
+        queue->head = task;
+    }
+    queue->tail = task;
+}
+
+static task_t* queue_pop(task_queue_t* queue) {
+    task_t* task = queue->head;
+    if (task) {
+        queue->head = task->queue_next;
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+        task->queue_next = NULL;
+    }
+    return task;
+}
+
+// Lower levels get proportionally longer slices
+static uint32_t level_timeslice(uint8_t level) {
+    return timeslice_ticks * (level + 1);
+}
+
+// A boost splices whole queues into level 0 without visiting the tasks on
+// them; each task picks up its new level the next time it is touched
+static void task_sync_boost(task_t* task) {
+    if (task->boost_epoch != boost_epoch) {
+        task->boost_epoch = boost_epoch;
+        task->priority = 0;
+    }
+}
+
+// The run queue functions below expect rq->lock held and interrupts disabled
+static void rq_add(runqueue_t* rq, task_t* task) {
+    task_sync_boost(task);
+    task->state = TASK_READY;
+    task->cpu = rq - runqueues;
+    queue_push(&rq->levels[task->priority], task);
+    rq->bitmap |= 1u << task->priority;
+    rq->nr_ready++;
+}
+
+static task_t* rq_pick(runqueue_t* rq) {
+    if (!rq->bitmap) {
+        return NULL;
+    }
+
+    uint32_t level = __builtin_ctz(rq->bitmap);
+    task_t* task = queue_pop(&rq->levels[level]);
+    if (!rq->levels[level].head) {
+        rq->bitmap &= ~(1u << level);
+    }
+    rq->nr_ready--;
+    task_sync_boost(task);
+    return task;
+}
+
+static void rq_apply_boost(runqueue_t* rq) {
+    if (rq->boost_epoch == boost_epoch) {
+        return;
+    }
+    rq->boost_epoch = boost_epoch;
+
+    task_queue_t* top = &rq->levels[0];
+    for (int level = 1; level < SCHED_LEVELS; level++) {
+        task_queue_t* queue = &rq->levels[level];
+        if (!queue->head) {
+            continue;
+        }
+        if (top->tail) {
+            top->tail->queue_next = queue->head;
+        } else {
+            top->head = queue->head;
+        }
+        top->tail = queue->tail;
+        queue->head = queue->tail = NULL;
+    }
+    if (rq->bitmap) {
+        rq->bitmap = 1;
+    }
+}
+
+// Take a ready task from another CPU; only used when this one has nothing
+// left to run. Trylock keeps two CPUs stealing from each other from
+// deadlocking, and a CPU whose lock is busy is scheduling anyway.
+static task_t* rq_steal(runqueue_t* rq) {
+    uint32_t self = rq - runqueues;
+    for (uint32_t i = 1; i < cpu_count; i++) {
+        uint32_t id = (self + i) % cpu_count;
+        runqueue_t* victim = &runqueues[id];
+        if (!cpus[id].online || !victim->nr_ready || !spin_trylock(&victim->lock)) {
+            continue;
+        }
+
+        task_t* task = rq_pick(victim);
+        if (task && task->on_cpu) {
+            // Preempted or woken but still on its way out of that CPU
+            rq_add(victim, task);
+            task = NULL;
+        }
+        spin_unlock(&victim->lock);
+
+        if (task) {
+            rq->steals++;
+            return task;
+        }
+    }
+    return NULL;
+}
+
+// An idle CPU may have its tick stopped and would not notice new work on
+// its own queue, or work it could steal, until something wakes it. Called
+// without run queue locks held.
+static void kick_cpu(uint32_t id) {
+    cpu_t* cpu = &cpus[id];
+    if (id != this_cpu()->id && cpu->online && cpu->current == cpu->idle_task) {
+        lapic_send_reschedule(cpu->apic_id);
+    }
+}
+
+static void kick_idle_cpu(void) {
+    for (uint32_t id = 0; id < cpu_count; id++) {
+        cpu_t* cpu = &cpus[id];
+        if (id != this_cpu()->id && cpu->online && cpu->current == cpu->idle_task) {
+            lapic_send_reschedule(cpu->apic_id);
+            return;
+        }
+    }
+}
+
+// Build the frame switch_to pops when the task first runs: EDI, ESI, EBX
+// (the entry point), EBP, then task_trampoline as the return address
+static void task_init_stack(task_t* task, void (*entry_point)(void)) {
+    uint32_t* stack_top = task->stack_base + kstack_size() / sizeof(uint32_t);
+    *(--stack_top) = (uint32_t)task_trampoline;
+    *(--stack_top) = 0;                     // EBP
+    *(--stack_top) = (uint32_t)entry_point; // EBX
+    *(--stack_top) = 0;                     // ESI
+    *(--stack_top) = 0;                     // EDI
+    task->stack_pointer = stack_top;
+}
+
+// Allocate a task and its stack without making it schedulable
+static task_t* task_alloc(void (*entry_point)(void)) {
+    task_t* new_task = (task_t*)kmem_cache_alloc(task_cache);
+    if (!new_task) {
+        terminal_writestring("Error: Failed to allocate memory for new task.\n");
+        return NULL;
+    }
+
+    // Initialize the task structure
+    new_task->id = __atomic_fetch_add(&next_task_id, 1, __ATOMIC_RELAXED);
+    new_task->stack_base = (uint32_t*)kstack_alloc();
+    new_task->state = TASK_READY;
+    new_task->priority = 0;
+    new_task->cpu = 0;
+    new_task->on_cpu = 0;
+    new_task->fpu_cpu = FPU_NO_CPU;
+    new_task->fpu_state = NULL;
+    new_task->slice_remaining = 0;
+    new_task->boost_epoch = boost_epoch;
+    new_task->next = NULL;
+    new_task->prev = NULL;
+    new_task->queue_next = NULL;
+
+    if (!new_task->stack_base) {
+        terminal_writestring("Error: Failed to allocate stack for new task.\n");
+        kmem_cache_free(task_cache, new_task);
+        return NULL;
+    }
+
+    task_init_stack(new_task, entry_point);
+    return new_task;
+}
+
+static void task_free(task_t* task) {
+    fpu_free(task);
+    kstack_free(task->stack_base);
+    kmem_cache_free(task_cache, task);
+}
 
 // Initialize multitasking
 void multitasking_init(void) {
     terminal_writestring("Initializing multitasking...\n");
 
+    task_cache = kmem_cache_create("task", sizeof(task_t), 0, NULL);
+    if (!task_cache) {
+        panic("Failed to create the task cache.");
+    }
+
+    // The code calling us keeps running on the boot stack as the first task;
+    // its stack_pointer is filled in the first time it is switched out
+    boot_task.id = next_task_id++;
+    boot_task.stack_base = NULL;
+    boot_task.state = TASK_RUNNING;
+    boot_task.priority = 0;
+    boot_task.cpu = 0;
+    boot_task.on_cpu = 1;
+    boot_task.fpu_cpu = FPU_NO_CPU;
+    boot_task.slice_remaining = level_timeslice(0);
+    boot_task.next = NULL;
+    boot_task.prev = NULL;
+    task_list = &boot_task;
+    current_task = &boot_task;
+
     // Create the idle task
     idle_task_struct.id = next_task_id++;
-    idle_task_struct.stack_pointer = (uint32_t*)kmalloc(1024); // Allocate 1 KB stack
+    idle_task_struct.stack_base = (uint32_t*)kstack_alloc();
     idle_task_struct.state = TASK_READY;
+    idle_task_struct.priority = SCHED_LEVELS - 1;
+    idle_task_struct.cpu = 0;
+    idle_task_struct.on_cpu = 0;
+    idle_task_struct.fpu_cpu = FPU_NO_CPU;
     idle_task_struct.next = NULL;
+    idle_task_struct.prev = NULL;
 
-    if (!idle_task_struct.stack_pointer) {
+    if (!idle_task_struct.stack_base) {
         panic("Failed to allocate stack for idle task.");
     }
+    task_init_stack(&idle_task_struct, idle_task);
+    this_cpu()->idle_task = &idle_task_struct;
 
-    // Set up the initial stack for the idle task
-    uint32_t* stack_top = idle_task_struct.stack_pointer + 1024 / sizeof(uint32_t);
-    *(--stack_top) = (uint32_t)idle_task;   // Entry point address
-    *(--stack_top) = 0x10;                  // Initial EFLAGS
-    *(--stack_top) = 0;                     // Dummy return address
-    idle_task_struct.stack_pointer = stack_top;
+    terminal_writestring("Idle task created.\n");
 
-    // Add the idle task to the task list
-    task_list = &idle_task_struct;
+    // Not in the task list, and never on a run queue until woken
+    task_t* reaper = task_alloc(reaper_task);
+    if (!reaper) {
+        panic("Failed to create the reaper task.");
+    }
+    reaper->state = TASK_WAITING;
+    queue_push(&reaper_queue.tasks, reaper);
+}
 
-    // Set the current task to the idle task
-    current_task = &idle_task_struct;
+// Called by each application processor; the code calling us becomes the
+// CPU's idle task once it enables interrupts and halts
+void multitasking_init_cpu(void) {
+    cpu_t* cpu = this_cpu();
+    task_t* idle = (task_t*)kmem_cache_alloc(task_cache);
+    if (!idle) {
+        panic("Failed to allocate an idle task.");
+    }
 
-    terminal_writestring("Idle task created.\n");
+    idle->id = __atomic_fetch_add(&next_task_id, 1, __ATOMIC_RELAXED);
+    idle->stack_pointer = NULL;
+    idle->stack_base = NULL;   // Runs on the stack smp.c started the CPU with
+    idle->state = TASK_RUNNING;
+    idle->priority = SCHED_LEVELS - 1;
+    idle->cpu = cpu->id;
+    idle->on_cpu = 1;
+    idle->fpu_cpu = FPU_NO_CPU;
+    idle->fpu_state = NULL;
+    idle->slice_remaining = 0;
+    idle->boost_epoch = boost_epoch;
+    idle->next = NULL;
+    idle->prev = NULL;
+    idle->queue_next = NULL;
+
+    cpu->idle_task = idle;
+    cpu->current = idle;
+    runqueues[cpu->id].boost_epoch = boost_epoch;
 }
 
-// Create a new task
-task_t* create_task(void (*entry_point)(void)) {
-    task_t* new_task = (task_t*)kmalloc(sizeof(task_t));
+// create_task without the console message
+static task_t* task_spawn(void (*entry_point)(void)) {
+    task_t* new_task = task_alloc(entry_point);
     if (!new_task) {
-        terminal_writestring("Error: Failed to allocate memory for new task.\n");
         return NULL;
     }
 
-    // Initialize the task structure
-    new_task->id = next_task_id++;
-    new_task->stack_pointer = (uint32_t*)kmalloc(1024); // Allocate 1 KB stack
-    new_task->state = TASK_READY;
-    new_task->next = NULL;
+    // Add the task to the task list and make it runnable on this CPU; idle
+    // CPUs will steal it if this one is busy
+    uint32_t flags = spin_lock_irqsave(&task_list_lock);
+    new_task->next = task_list;
+    if (task_list) {
+        task_list->prev = new_task;
+    }
+    task_list = new_task;
+    spin_unlock(&task_list_lock);
 
-    if (!new_task->stack_pointer) {
-        terminal_writestring("Error: Failed to allocate stack for new task.\n");
-        kfree(new_task);
-        return NULL;
+    runqueue_t* rq = &runqueues[this_cpu()->id];
+    spin_lock(&rq->lock);
+    rq_add(rq, new_task);
+    spin_unlock(&rq->lock);
+    kick_idle_cpu();
+    irq_restore(flags);
+
+    trace_event(TRACE_TASK_CREATE, (uintptr_t)entry_point, new_task->id);
+    return new_task;
+}
+
+// Create a new task
+task_t* create_task(void (*entry_point)(void)) {
+    task_t* new_task = task_spawn(entry_point);
+    if (new_task) {
+        terminal_writestring("New task created.\n");
     }
+    return new_task;
+}
 
-    // Set up the initial stack
-    uint32_t* stack_top = new_task->stack_pointer + 1024 / sizeof(uint32_t);
-    *(--stack_top) = (uint32_t)entry_point; // Entry point address
-    *(--stack_top) = 0x10;                  // Initial EFLAGS
-    *(--stack_top) = 0;                     // Dummy return address
-    new_task->stack_pointer = stack_top;
+// Switch to the best ready task, stealing one if this CPU has none. The
+// caller holds rq->lock with interrupts disabled and has already put
+// current_task back on a run queue or a wait queue. The lock is released once
+// the switch is complete, by whichever task runs next (see schedule_tail).
+static void schedule(runqueue_t* rq) {
+    cpu_t* cpu = this_cpu();
+    task_t* prev = cpu->current;
+    task_t* next = rq_pick(rq);
+    if (!next) {
+        next = rq_steal(rq);
+    }
+    if (!next) {
+        next = cpu->idle_task;
+    }
 
-    // Add the task to the task list
-    if (!task_list) {
-        task_list = new_task;
-    } else {
-        task_t* temp = task_list;
-        while (temp->next) temp = temp->next;
-        temp->next = new_task;
+    next->state = TASK_RUNNING;
+    if (!next->slice_remaining) {
+        next->slice_remaining = level_timeslice(next->priority);
+    }
+    if (next == prev) {
+        spin_unlock(&rq->lock);
+        return;
     }
 
-    terminal_writestring("New task created.\n");
-    return new_task;
+    // prev stays marked on_cpu until its registers are saved, so no other
+    // CPU can pick it up and run on the same stack in the meantime
+    while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE)) {
+        __asm__ volatile("pause");
+    }
+    next->on_cpu = 1;
+    next->cpu = cpu->id;
+    cpu->current = next;
+    cpu->prev_task = prev;
+    rq->switches++;
+    trace_event(TRACE_SWITCH, prev->id, next->id | (next == cpu->idle_task ? TRACE_SWITCH_IDLE : 0));
+
+    fpu_switch(prev, next);
+    switch_to(prev, next);
+    schedule_tail();
+}
+
+// First thing a task does after being switched to, either on return from
+// switch_to or from task_trampoline
+void schedule_tail(void) {
+    cpu_t* cpu = this_cpu();
+    task_t* prev = cpu->prev_task;
+    if (!prev) {
+        return; // Raw switch_to from task_switch_bench
+    }
+
+    cpu->prev_task = NULL;
+    __atomic_store_n(&prev->on_cpu, 0, __ATOMIC_RELEASE);
+    spin_unlock(&runqueues[cpu->id].lock);
 }
 
-// Task scheduler
+// Timer tick, called from the timer interrupt after the EOI
 void scheduler_tick(void) {
-    if (!current_task || !task_list) {
-        terminal_writestring("No tasks to schedule.\n");
+    cpu_t* cpu = this_cpu();
+    runqueue_t* rq = &runqueues[cpu->id];
+    task_t* task = cpu->current;
+
+    if (cpu->id == 0 && --boost_countdown == 0) {
+        boost_countdown = SCHED_BOOST_TICKS;
+        __atomic_add_fetch(&boost_epoch, 1, __ATOMIC_RELAXED);
+    }
+
+    spin_lock(&rq->lock);
+    rq->ticks++;
+    rq_apply_boost(rq);
+
+    if (task == cpu->idle_task) {
+        // Look for local or stealable work every tick while idle
+        rq->idle_ticks++;
+        schedule(rq);
+        return;
+    }
+
+    task_sync_boost(task);
+    if (task->slice_remaining > 1) {
+        task->slice_remaining--;
+        // A task woken at a higher level does not wait for the slice to end
+        if (rq->bitmap & ((1u << task->priority) - 1)) {
+            rq_add(rq, task);
+            schedule(rq);
+            return;
+        }
+        spin_unlock(&rq->lock);
+        return;
+    }
+
+    // Used its whole slice: treat it as CPU bound
+    if (task->priority < SCHED_LEVELS - 1) {
+        task->priority++;
+    }
+    task->slice_remaining = 0;
+    if (!rq->bitmap) {
+        task->slice_remaining = level_timeslice(task->priority);
+        spin_unlock(&rq->lock);
         return;
     }
+    rq_add(rq, task);
+    schedule(rq);
+}
+
+// Reschedule IPI: an idle CPU has work on its queue or could steal some
+void scheduler_reschedule(void) {
+    cpu_t* cpu = this_cpu();
+    if (cpu->current != cpu->idle_task) {
+        return;
+    }
+    runqueue_t* rq = &runqueues[cpu->id];
+    spin_lock(&rq->lock);
+    schedule(rq);
+}
+
+// Ticks this CPU spent idle with its tick stopped, which scheduler_tick
+// never saw. Interrupts are disabled.
+void scheduler_account_idle(uint32_t ticks) {
+    runqueue_t* rq = &runqueues[this_cpu()->id];
+    rq->ticks += ticks;
+    rq->idle_ticks += ticks;
+}
+
+void scheduler_set_timeslice(uint32_t ticks) {
+    timeslice_ticks = ticks ? ticks : 1;
+    current_task->slice_remaining = level_timeslice(current_task->priority);
+}
+
+void task_yield(void) {
+    uint32_t flags = irq_save();
+    cpu_t* cpu = this_cpu();
+    runqueue_t* rq = &runqueues[cpu->id];
+    task_t* task = cpu->current;
+
+    spin_lock(&rq->lock);
+    if (!rq->bitmap || task == cpu->idle_task) {
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        return;
+    }
+    task->slice_remaining = 0;
+    rq_add(rq, task);
+    schedule(rq);
+    irq_restore(flags);
+}
+
+void task_block_locked(wait_queue_t* queue) {
+    cpu_t* cpu = this_cpu();
+    task_t* task = cpu->current;
+    task->state = TASK_WAITING;
+    queue_push(&queue->tasks, task);
+    spin_unlock(&queue->lock);
+
+    // A waker may make us ready again before we are switched out; we then
+    // simply sit on our own run queue until the switch has finished
+    runqueue_t* rq = &runqueues[cpu->id];
+    spin_lock(&rq->lock);
+    schedule(rq);
+}
+
+void task_block(wait_queue_t* queue) {
+    uint32_t flags = spin_lock_irqsave(&queue->lock);
+    task_block_locked(queue);
+    irq_restore(flags);
+}
+
+// Woken tasks move up a level and start a fresh slice on the CPU they last
+// ran on. Interrupts must be disabled.
+static void task_wake(task_t* task) {
+    runqueue_t* rq = &runqueues[task->cpu];
+    spin_lock(&rq->lock);
+    task_sync_boost(task);
+    if (task->priority > 0) {
+        task->priority--;
+    }
+    task->slice_remaining = 0;
+    rq_add(rq, task);
+    spin_unlock(&rq->lock);
+
+    if (task->cpu != this_cpu()->id) {
+        kick_cpu(task->cpu);
+    } else if (this_cpu()->current != this_cpu()->idle_task) {
+        kick_idle_cpu();
+    }
+}
 
-    // Save the current task's state
-    save_task_state(current_task);
-
-    // Find the next READY task
-    task_t* next_task = current_task->next;
-    while (next_task && next_task->state != TASK_READY) {
-        next_task = next_task->next;
-    }
-
-    // If no READY task is found, fall back to the idle task
-    if (!next_task) {
-        next_task = &idle_task_struct;
-    }
-
-    // Switch to the selected task
-    current_task = next_task;
-    current_task->state = TASK_RUNNING;
-    restore_task_state(current_task);
-}
-
-// Save the task state (dummy implementation)
-void save_task_state(task_t* task) {
-    asm volatile (
-        "movl %%eax, %0\n"
-        "movl %%ebx, %1\n"
-        "movl %%ecx, %2\n"
-        "movl %%edx, %3\n"
-        "movl %%esi, %4\n"
-        "movl %%edi, %5\n"
-        "movl %%ebp, %6\n"
-        "movl %%esp, %7\n"
-        : "=m"(task->registers[0]), "=m"(task->registers[1]),
-          "=m"(task->registers[2]), "=m"(task->registers[3]),
-          "=m"(task->registers[4]), "=m"(task->registers[5]),
-          "=m"(task->registers[6]), "=m"(task->stack_pointer)
-    );
-}
-
-// Restore the task state (dummy implementation)
-void restore_task_state(task_t* task) {
-    asm volatile (
-        "movl %0, %%eax\n"
-        "movl %1, %%ebx\n"
-        "movl %2, %%ecx\n"
-        "movl %3, %%edx\n"
-        "movl %4, %%esi\n"
-        "movl %5, %%edi\n"
-        "movl %6, %%ebp\n"
-        "movl %7, %%esp\n"
-        :
-        : "m"(task->registers[0]), "m"(task->registers[1]),
-          "m"(task->registers[2]), "m"(task->registers[3]),
-          "m"(task->registers[4]), "m"(task->registers[5]),
-          "m"(task->registers[6]), "m"(task->stack_pointer)
-    );
+task_t* task_wake_one(wait_queue_t* queue) {
+    uint32_t flags = spin_lock_irqsave(&queue->lock);
+    task_t* task = queue_pop(&queue->tasks);
+    spin_unlock(&queue->lock);
+    if (task) {
+        task_wake(task);
+    }
+    irq_restore(flags);
+    return task;
+}
+
+task_t* task_wake_one_locked(wait_queue_t* queue) {
+    task_t* task = queue_pop(&queue->tasks);
+    if (task) {
+        task_wake(task);
+    }
+    return task;
+}
+
+// Take a task off a wait queue wherever it is; 0 if it was not on it
+static int queue_remove(task_queue_t* queue, task_t* task) {
+    task_t* prev = NULL;
+    for (task_t* current = queue->head; current; prev = current, current = current->queue_next) {
+        if (current != task) {
+            continue;
+        }
+        if (prev) {
+            prev->queue_next = task->queue_next;
+        } else {
+            queue->head = task->queue_next;
+        }
+        if (queue->tail == task) {
+            queue->tail = prev;
+        }
+        task->queue_next = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+typedef struct block_timeout {
+    ktimer_t timer;
+    wait_queue_t* queue;
+    task_t* task;
+    volatile int timed_out;
+} block_timeout_t;
+
+// Whoever takes the task off the queue first wakes it: a waker, or this
+static void block_timeout_expired(ktimer_t* timer) {
+    block_timeout_t* timeout = (block_timeout_t*)timer->data;
+    spin_lock(&timeout->queue->lock);
+    int queued = queue_remove(&timeout->queue->tasks, timeout->task);
+    spin_unlock(&timeout->queue->lock);
+    if (queued) {
+        timeout->timed_out = 1;
+        task_wake(timeout->task);
+    }
+}
+
+int task_block_locked_timeout(wait_queue_t* queue, uint32_t ticks) {
+    block_timeout_t timeout;
+    timeout.queue = queue;
+    timeout.task = current_task;
+    timeout.timed_out = 0;
+    ktimer_init(&timeout.timer, block_timeout_expired, &timeout);
+    ktimer_add(&timeout.timer, ticks);
+
+    task_block_locked(queue);
+    ktimer_cancel(&timeout.timer);
+    return !timeout.timed_out;
+}
+
+void task_wake_all(wait_queue_t* queue) {
+    uint32_t flags = spin_lock_irqsave(&queue->lock);
+    task_t* task = queue->tasks.head;
+    queue->tasks.head = queue->tasks.tail = NULL;
+    spin_unlock(&queue->lock);
+
+    while (task) {
+        task_t* next = task->queue_next;
+        task->queue_next = NULL;
+        task_wake(task);
+        task = next;
+    }
+    irq_restore(flags);
+}
+
+/*
+ * The task leaves the task list, queues itself for the reaper and switches
+ * away without going back on a run queue. Its stack stays in use until the
+ * switch is complete, which the reaper waits for through on_cpu.
+ */
+void task_exit(void) {
+    irq_disable();
+    task_t* task = current_task;
+    if (!task->stack_base || task == this_cpu()->idle_task) {
+        panic("Task without a pooled stack tried to exit.");
+    }
+    trace_event(TRACE_TASK_EXIT, 0, task->id);
+
+    spin_lock(&task_list_lock);
+    if (task->prev) {
+        task->prev->next = task->next;
+    } else {
+        task_list = task->next;
+    }
+    if (task->next) {
+        task->next->prev = task->prev;
+    }
+    spin_unlock(&task_list_lock);
+
+    spin_lock(&reaper_queue.lock);
+    task->queue_next = zombies;
+    zombies = task;
+    task_wake_one_locked(&reaper_queue);
+    spin_unlock(&reaper_queue.lock);
+
+    runqueue_t* rq = &runqueues[this_cpu()->id];
+    spin_lock(&rq->lock);
+    task->state = TASK_TERMINATED;
+    schedule(rq);
+    panic("Exited task was scheduled again.");
+}
+
+static void reaper_task(void) {
+    while (1) {
+        uint32_t flags = spin_lock_irqsave(&reaper_queue.lock);
+        while (!zombies) {
+            task_block_locked(&reaper_queue);
+            spin_lock(&reaper_queue.lock);
+        }
+        task_t* task = zombies;
+        zombies = NULL;
+        spin_unlock_irqrestore(&reaper_queue.lock, flags);
+
+        while (task) {
+            task_t* next = task->queue_next;
+            while (__atomic_load_n(&task->on_cpu, __ATOMIC_ACQUIRE)) {
+                __asm__ volatile("pause");
+            }
+            task_free(task);
+            __atomic_fetch_add(&tasks_reaped, 1, __ATOMIC_RELEASE);
+            task = next;
+        }
+    }
+}
+
+void scheduler_stats(void) {
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (!cpus[i].online) {
+            continue;
+        }
+        runqueue_t* rq = &runqueues[i];
+        kprintf("CPU %u: busy %u%%, switches %u, steals %u, ready %u\n", (unsigned int)i,
+                (unsigned int)(rq->ticks ? 100 - rq->idle_ticks / (rq->ticks / 100 + 1) : 0),
+                (unsigned int)rq->switches, (unsigned int)rq->steals, (unsigned int)rq->nr_ready);
+    }
+}
+
+/*
+ * Cost of one pick plus requeue with a small and a large population spread
+ * over all levels. The tasks are bare task_t's that never run. Both numbers
+ * should be the same; if the large one grows, something started scanning.
+ */
+#define SCHED_BENCH_ITERATIONS 10000
+
+static void sched_bench_population(runqueue_t* rq, uint32_t count) {
+    uint32_t created = 0;
+    for (; created < count; created++) {
+        task_t* task = (task_t*)kmem_cache_alloc(task_cache);
+        if (!task) {
+            break;
+        }
+        task->priority = created % SCHED_LEVELS;
+        task->boost_epoch = boost_epoch;
+        rq_add(rq, task);
+    }
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < SCHED_BENCH_ITERATIONS; i++) {
+        rq_add(rq, rq_pick(rq));
+    }
+    uint32_t cycles = (uint32_t)(rdtsc() - start);
+
+    task_t* task;
+    while ((task = rq_pick(rq))) {
+        kmem_cache_free(task_cache, task);
+    }
+
+    kprintf("Scheduler pick with %u ready tasks: %u cycles\n",
+            (unsigned int)created, (unsigned int)(cycles / SCHED_BENCH_ITERATIONS));
+}
+
+// Must run before any other task is ready: it drains this CPU's run queues
+void scheduler_bench(void) {
+    uint32_t flags = irq_save();
+    runqueue_t* rq = &runqueues[this_cpu()->id];
+    spin_lock(&rq->lock);
+    sched_bench_population(rq, 4);
+    sched_bench_population(rq, 4000);
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+}
+
+/*
+ * Ping-pong between two private tasks that do nothing but switch_to each
+ * other, so the numbers cover the switch path alone and not the scheduler.
+ * Each round trip is two switches; the best round is the one to compare
+ * across builds, the average shows how noisy the machine is.
+ *
+ * With bench_fpu set, both tasks run an FPU instruction before every
+ * switch, so each switch also saves one task's FPU state and traps to load
+ * the other's: what a task using SSE pays over one that does not.
+ *
+ * The tasks are kept for the context_switch benchmarks in the suite. Their
+ * first run goes through task_trampoline, which enables interrupts, so they
+ * can only be started safely before the timer is.
+ */
+#define SWITCH_BENCH_ROUNDS      8
+#define SWITCH_BENCH_ITERATIONS  10000  // Round trips per round
+
+static task_t* bench_caller;
+static task_t* bench_ping;
+static task_t* bench_pong;
+static uint32_t bench_rounds;
+static uint32_t bench_round_trips;
+static uint32_t bench_cycles[SWITCH_BENCH_ROUNDS];
+static volatile int bench_fpu;
+
+// What schedule does around switch_to; the #NM handler goes by current_task
+static void bench_switch(task_t* prev, task_t* next) {
+    this_cpu()->current = next;
+    fpu_switch(prev, next);
+    switch_to(prev, next);
+}
+
+static void bench_ping_task(void) {
+    irq_disable(); // task_trampoline enabled them
+    while (1) {
+        for (uint32_t round = 0; round < bench_rounds; round++) {
+            uint64_t start = rdtsc();
+            for (uint32_t i = 0; i < bench_round_trips; i++) {
+                if (bench_fpu) {
+                    __asm__ volatile("fnop");
+                }
+                bench_switch(bench_ping, bench_pong);
+            }
+            bench_cycles[round] = (uint32_t)(rdtsc() - start);
+        }
+        bench_switch(bench_ping, bench_caller);
+    }
+}
+
+static void bench_pong_task(void) {
+    irq_disable();
+    while (1) {
+        if (bench_fpu) {
+            __asm__ volatile("fnop");
+        }
+        bench_switch(bench_pong, bench_ping);
+    }
+}
+
+// Runs until bench_ping_task has finished every round; neither task is in
+// the task list, so the scheduler never sees them
+static void switch_bench_run(int fpu, uint32_t rounds, uint32_t round_trips) {
+    bench_fpu = fpu;
+    bench_caller = current_task;
+    bench_rounds = rounds;
+    bench_round_trips = round_trips;
+    bench_switch(bench_caller, bench_ping);
+    bench_fpu = 0;
+}
+
+static void switch_bench_report(const char* label) {
+    uint32_t best = bench_cycles[0];
+    uint32_t total = 0;
+    for (int round = 0; round < SWITCH_BENCH_ROUNDS; round++) {
+        if (bench_cycles[round] < best) {
+            best = bench_cycles[round];
+        }
+        total += bench_cycles[round];
+    }
+
+    kprintf("%s%u cycles best, %u cycles average\n", label,
+            (unsigned int)(best / (2 * SWITCH_BENCH_ITERATIONS)),
+            (unsigned int)(total / (2 * SWITCH_BENCH_ITERATIONS * SWITCH_BENCH_ROUNDS)));
+}
+
+// Must run with interrupts disabled or the timer not yet started: the
+// scheduler does not know about the benchmark tasks
+void task_switch_bench(void) {
+    if (!bench_ping) {
+        bench_ping = task_alloc(bench_ping_task);
+        bench_pong = task_alloc(bench_pong_task);
+        if (!bench_ping || !bench_pong) {
+            terminal_writestring("Error: Could not create benchmark tasks.\n");
+            if (bench_ping) task_free(bench_ping);
+            if (bench_pong) task_free(bench_pong);
+            bench_ping = bench_pong = NULL;
+            return;
+        }
+    }
+
+    switch_bench_run(0, SWITCH_BENCH_ROUNDS, SWITCH_BENCH_ITERATIONS);
+    switch_bench_report("Context switch: ");
+    if (fpu_available()) {
+        switch_bench_run(1, SWITCH_BENCH_ROUNDS, SWITCH_BENCH_ITERATIONS);
+        switch_bench_report("Context switch using the FPU: ");
+    }
+}
+
+/*
+ * Short-lived tasks created in batches, each waited for until the reaper has
+ * freed it: create_task, the first switch into the task, task_exit and the
+ * reaping together. Every stack after the first batch is a recycled one, so
+ * the pool should not grow past one batch. Runs with the scheduler going.
+ */
+#define SPAWN_BENCH_BATCH  16
+#define SPAWN_BENCH_TASKS  1024
+
+static void spawn_bench_task(void) {
+    // Returning goes through task_exit like any other task
+}
+
+void task_spawn_bench(void) {
+    uint32_t spawned = 0;
+    uint32_t reaped = tasks_reaped;
+    uint64_t start = rdtsc();
+    while (spawned < SPAWN_BENCH_TASKS) {
+        for (int i = 0; i < SPAWN_BENCH_BATCH; i++) {
+            if (!task_spawn(spawn_bench_task)) {
+                terminal_writestring("Error: Could not create benchmark tasks.\n");
+                return;
+            }
+        }
+        spawned += SPAWN_BENCH_BATCH;
+        while (tasks_reaped - reaped < spawned) {
+            task_yield();
+        }
+    }
+    uint32_t cycles = (uint32_t)(rdtsc() - start);
+
+    kprintf("Task spawn and exit: %u cycles per task, %u stacks mapped\n",
+            (unsigned int)(cycles / SPAWN_BENCH_TASKS), (unsigned int)kstack_mapped());
+}
+
+// Cycles per switch, using the tasks task_switch_bench started; skipped
+// without them. Called with interrupts disabled.
+BENCH(context_switch, 256) {
+    if (!bench_ping) {
+        return;
+    }
+    switch_bench_run(0, 1, iterations / 2);
+}
+
+// The same with both tasks using the FPU between switches
+BENCH(context_switch_fpu, 256) {
+    if (!bench_ping || !fpu_available()) {
+        return;
+    }
+    switch_bench_run(1, 1, iterations / 2);
 }
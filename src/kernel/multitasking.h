@@ -1,34 +1,85 @@
 #ifndef MULTITASKING_H
 #define MULTITASKING_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "smp.h"
+#include "spinlock.h"
+
 // Task states
 #define TASK_READY       0
 #define TASK_RUNNING     1
 #define TASK_WAITING     2
 #define TASK_TERMINATED  3
 
+#define TASK_STACK_SIZE  8192   // Default bytes of stack per task, stack_kb= overrides it
+#define TASK_DEFAULT_TIMESLICE 10 // Timer ticks before preemption at the top level
+
+#define SCHED_LEVELS       8        // Feedback queue levels, 0 is the highest priority
+#define SCHED_BOOST_TICKS  1000     // Move every task back to level 0 this often
+
 // Task structure
 typedef struct task {
     uint32_t id;                // Unique identifier for the task
-    uint32_t* stack_pointer;    // Pointer to the current stack top
+    uint32_t* stack_pointer;    // Saved ESP while switched out (offset 4, used by switch.s)
+    uint32_t* stack_base;       // Lowest address of the task's stack allocation
     uint8_t state;              // Current state of the task
+    uint8_t priority;           // Feedback queue level, 0 is the highest
+    uint8_t cpu;                // CPU whose run queue the task belongs to
+    volatile uint8_t on_cpu;    // Running, or still being switched out
+    uint8_t fpu_cpu;            // CPU that last loaded fpu_state into its registers
+    uint32_t slice_remaining;   // Timer ticks left in the current time slice
+    uint32_t boost_epoch;       // Last priority boost this task has seen
     struct task* next;          // Pointer to the next task in the task list
-    uint32_t registers[8];      // Registers saved during context switch (EAX, EBX, etc.)
+    struct task* prev;          // Previous task in the task list
+    struct task* queue_next;    // Next task on the same run queue or wait queue
+    void* fpu_state;            // FXSAVE area, allocated on the task's first FPU use (fpu.c)
 } task_t;
 
+// FIFO of tasks, used for the run queues and for anything tasks block on
+typedef struct task_queue {
+    task_t* head;
+    task_t* tail;
+} task_queue_t;
+
+typedef struct wait_queue {
+    spinlock_t lock;
+    task_queue_t tasks;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { SPINLOCK_INIT, { NULL, NULL } }
+
 // Global variables for task management
-extern task_t* current_task;    // Pointer to the currently running task
+#define current_task (this_cpu()->current) // Task running on this CPU
 extern task_t* task_list;       // Pointer to the head of the task list
-void panic(const char* msg);
+void panic(const char* msg) __attribute__((noreturn));
+void panic_enter(void);         // Halt the other CPUs and take the console over; panic starts with it
 
 // Function prototypes
-void multitasking_init(void);           // Initialize the multitasking system
+void multitasking_init(void);           // Turn the boot context into the first task
+void multitasking_init_cpu(void);       // Give an application processor its idle task
 task_t* create_task(void (*entry_point)(void)); // Create a new task
-void scheduler_tick(void);              // Trigger a scheduler tick
+void task_exit(void) __attribute__((noreturn)); // End the calling task; also reached by returning from its entry point
+void scheduler_tick(void);              // Timer tick: preempt the current task when its slice is used up
+void scheduler_set_timeslice(uint32_t ticks);
+void task_yield(void);                  // Give up the CPU voluntarily
+void task_block(wait_queue_t* queue);   // Sleep on queue until woken
+void task_block_locked(wait_queue_t* queue); // Same, with queue->lock held and interrupts off; drops the lock
+int task_block_locked_timeout(wait_queue_t* queue, uint32_t ticks); // Same, 0 if ticks passed first
+task_t* task_wake_one(wait_queue_t* queue); // Make the first waiter ready, NULL if none
+void task_wake_all(wait_queue_t* queue);
+task_t* task_wake_one_locked(wait_queue_t* queue); // With queue->lock held and interrupts off
+void schedule_tail(void);               // Finish a switch; called by every task switched to
+void scheduler_stats(void);             // Per-CPU load and stealing counters
+void scheduler_reschedule(void);        // Reschedule IPI handler
+void scheduler_account_idle(uint32_t ticks); // Idle time the stopped tick missed
 void idle_task(void);                   // Idle task to run when no other task is ready
-void save_task_state(task_t* task);     // Save the current task's CPU state
-void restore_task_state(task_t* task);  // Restore the next task's CPU state
+void task_switch_bench(void);           // Measure the cost of switch_to
+void task_spawn_bench(void);            // Measure creating, running and reaping short-lived tasks
+void scheduler_bench(void);             // Measure run queue cost with few and many tasks
+
+// switch.s
+void switch_to(task_t* prev, task_t* next); // Save prev's callee-saved state and resume next
 
 #endif // MULTITASKING_H
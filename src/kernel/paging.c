@@ -0,0 +1,179 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "paging.h"
+#include "string.h"
+#include "pmm.h"
+#include "memory.h"
+#include "cpu.h"
+#include "stdio.h"
+#include "spinlock.h"
+
+/*
+ * boot.s enables paging with a minimal directory: the first 4 MB identity
+ * mapped (so the code turning paging on keeps running) and the first 16 MB
+ * mapped at KERNEL_VIRT_BASE. paging_init extends the higher-half mapping
+ * over all usable RAM with 4 MB global pages and drops the identity mapping.
+ *
+ * Large global pages keep the kernel's footprint in the TLB tiny: one entry
+ * covers 4 MB of code, heap or page-allocator memory, and none of them are
+ * flushed on CR3 reloads. 4 KB page tables are only created on demand for
+ * mappings above VMAP_BASE, where per-page control is needed.
+ */
+#define PDE_INDEX(addr) ((addr) >> 22)
+#define PTE_INDEX(addr) (((addr) >> 12) & 0x3FF)
+#define BOOT_MAPPED_PDES 4              // 16 MB mapped by boot.s
+
+extern uint32_t boot_page_directory[1024]; // From boot.s
+static uint32_t* kernel_page_directory = boot_page_directory;
+
+static uintptr_t direct_map_end;            // Physical end of the direct map
+static uintptr_t vmap_next = VMAP_BASE;     // paging_map_phys hands out VMAP from here
+static spinlock_t paging_lock = SPINLOCK_INIT;
+
+void paging_init(multiboot_info_t* mbi) {
+    size_t pdes = (pmm_memory_end(mbi) + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE;
+    if (pdes < BOOT_MAPPED_PDES) {
+        pdes = BOOT_MAPPED_PDES;
+    }
+
+    direct_map_end = pdes * LARGE_PAGE_SIZE;
+    write_cr4(read_cr4() | CR4_PGE);
+    for (size_t i = 0; i < pdes; i++) {
+        kernel_page_directory[PDE_INDEX(KERNEL_VIRT_BASE) + i] =
+            (i * LARGE_PAGE_SIZE) | PTE_PRESENT | PTE_WRITABLE | PTE_LARGE | PTE_GLOBAL;
+    }
+
+    // Nothing runs from low addresses any more; the CR3 reload flushes the
+    // identity mapping while the global kernel entries stay cached
+    kernel_page_directory[0] = 0;
+    write_cr3(read_cr3());
+
+    kprintf("Paging: %u MB direct mapped with 4 MB pages\n", (unsigned int)(pdes * (LARGE_PAGE_SIZE >> 20)));
+}
+
+// Page table covering `virt`, optionally creating it
+static uint32_t* page_table(uintptr_t virt, int create) {
+    uint32_t* pde = &kernel_page_directory[PDE_INDEX(virt)];
+    if (*pde & PTE_PRESENT) {
+        if (*pde & PTE_LARGE) {
+            return NULL;
+        }
+        return (uint32_t*)phys_to_virt(*pde & ~0xFFFu);
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    uintptr_t frame = pmm_alloc(0);
+    if (!frame) {
+        return NULL;
+    }
+    uint32_t* table = (uint32_t*)phys_to_virt(frame);
+    memset(table, 0, PAGE_SIZE);
+    *pde = frame | PTE_PRESENT | PTE_WRITABLE;
+    return table;
+}
+
+// Caller holds paging_lock
+static int map_page(uintptr_t virt, uintptr_t phys, uint32_t flags) {
+    if (virt < VMAP_BASE || (virt | phys) & (PAGE_SIZE - 1)) {
+        terminal_writestring("Error: Invalid 4 KB mapping requested.\n");
+        return -1;
+    }
+
+    uint32_t* table = page_table(virt, 1);
+    if (!table) {
+        terminal_writestring("Error: Could not allocate a page table.\n");
+        return -1;
+    }
+
+    table[PTE_INDEX(virt)] = phys | (flags & 0xFFF) | PTE_PRESENT;
+    invlpg(virt);
+    return 0;
+}
+
+int paging_map_page(uintptr_t virt, uintptr_t phys, uint32_t flags) {
+    uint32_t irq_flags = spin_lock_irqsave(&paging_lock);
+    int result = map_page(virt, phys, flags);
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return result;
+}
+
+// Only the calling CPU's TLB is flushed; other CPUs may keep using the old
+// mapping until their next CR3 reload
+uintptr_t paging_unmap_page(uintptr_t virt) {
+    uint32_t irq_flags = spin_lock_irqsave(&paging_lock);
+    uint32_t* table = page_table(virt, 0);
+    uintptr_t phys = 0;
+    if (table && (table[PTE_INDEX(virt)] & PTE_PRESENT)) {
+        phys = table[PTE_INDEX(virt)] & ~0xFFFu;
+        table[PTE_INDEX(virt)] = 0;
+        invlpg(virt);
+    }
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return phys;
+}
+
+void* paging_map_phys(uintptr_t phys, size_t size, uint32_t flags) {
+    // Ordinary memory that is already direct mapped needs no new mapping
+    if (!(flags & PTE_NOCACHE) && phys + size <= direct_map_end) {
+        return phys_to_virt(phys);
+    }
+
+    uintptr_t offset = phys & (PAGE_SIZE - 1);
+    size_t pages = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t irq_flags = spin_lock_irqsave(&paging_lock);
+
+    uintptr_t virt = vmap_next;
+    if (pages > (0 - virt) / PAGE_SIZE) {
+        spin_unlock_irqrestore(&paging_lock, irq_flags);
+        terminal_writestring("Error: Out of VMAP space.\n");
+        return NULL;
+    }
+    vmap_next += pages * PAGE_SIZE;
+
+    for (size_t i = 0; i < pages; i++) {
+        if (map_page(virt + i * PAGE_SIZE, phys - offset + i * PAGE_SIZE, flags) != 0) {
+            spin_unlock_irqrestore(&paging_lock, irq_flags);
+            return NULL;
+        }
+    }
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return (void*)(virt + offset);
+}
+
+// Address space only: the caller maps pages into it as it needs them
+uintptr_t paging_reserve(size_t pages) {
+    uint32_t irq_flags = spin_lock_irqsave(&paging_lock);
+    uintptr_t virt = vmap_next;
+    if (pages > (0 - virt) / PAGE_SIZE) {
+        spin_unlock_irqrestore(&paging_lock, irq_flags);
+        terminal_writestring("Error: Out of VMAP space.\n");
+        return 0;
+    }
+    vmap_next += pages * PAGE_SIZE;
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return virt;
+}
+
+void paging_identity_map_low(int enable) {
+    kernel_page_directory[0] = enable ? PTE_PRESENT | PTE_WRITABLE | PTE_LARGE : 0;
+    write_cr3(read_cr3());
+}
+
+uintptr_t paging_translate(uintptr_t virt) {
+    uint32_t pde = kernel_page_directory[PDE_INDEX(virt)];
+    if (!(pde & PTE_PRESENT)) {
+        return 0;
+    }
+    if (pde & PTE_LARGE) {
+        return (pde & ~(uint32_t)(LARGE_PAGE_SIZE - 1)) | (virt & (LARGE_PAGE_SIZE - 1));
+    }
+
+    uint32_t pte = ((uint32_t*)phys_to_virt(pde & ~0xFFFu))[PTE_INDEX(virt)];
+    if (!(pte & PTE_PRESENT)) {
+        return 0;
+    }
+    return (pte & ~0xFFFu) | (virt & (PAGE_SIZE - 1));
+}
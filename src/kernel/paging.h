@@ -0,0 +1,43 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "multiboot.h"
+
+// The kernel runs in the higher half. Physical memory from 0 up to
+// DIRECT_MAP_SIZE is mapped at KERNEL_VIRT_BASE with 4 MB global pages, so
+// any frame from the page allocator is reachable at phys_to_virt(frame).
+// Addresses from VMAP_BASE up are reserved for 4 KB mappings.
+#define KERNEL_VIRT_BASE  0xC0000000
+#define DIRECT_MAP_SIZE   0x30000000    // 768 MB
+#define VMAP_BASE         (KERNEL_VIRT_BASE + DIRECT_MAP_SIZE)
+#define LARGE_PAGE_SIZE   0x400000      // 4 MB
+
+// Page directory / page table entry flags
+#define PTE_PRESENT       0x001
+#define PTE_WRITABLE      0x002
+#define PTE_USER          0x004
+#define PTE_WRITETHROUGH  0x008
+#define PTE_NOCACHE       0x010
+#define PTE_LARGE         0x080         // 4 MB page (page directory entries only)
+#define PTE_GLOBAL        0x100
+
+static inline void* phys_to_virt(uintptr_t phys) {
+    return (void*)(phys + KERNEL_VIRT_BASE);
+}
+
+static inline uintptr_t virt_to_phys(const void* virt) {
+    return (uintptr_t)virt - KERNEL_VIRT_BASE;
+}
+
+void paging_init(multiboot_info_t* mbi);
+int paging_map_page(uintptr_t virt, uintptr_t phys, uint32_t flags);  // 4 KB mapping, 0 on success
+uintptr_t paging_unmap_page(uintptr_t virt);                          // Returns the old frame, or 0
+uintptr_t paging_translate(uintptr_t virt);                           // Physical address, or 0
+void* paging_map_phys(uintptr_t phys, size_t size, uint32_t flags);   // Firmware tables, MMIO
+uintptr_t paging_reserve(size_t pages);                               // Unmapped VMAP range, or 0
+void paging_identity_map_low(int enable);   // First 4 MB at address 0, for the AP trampoline
+
+#endif // PAGING_H
@@ -0,0 +1,75 @@
+#include <stdint.h>
+
+#include "pic.h"
+#include "cpu.h"
+
+#define PIC1_COMMAND  0x20
+#define PIC1_DATA     0x21
+#define PIC2_COMMAND  0xA0
+#define PIC2_DATA     0xA1
+
+#define ICW1_INIT     0x11      // Edge triggered, cascade mode, ICW4 follows
+#define ICW4_8086     0x01
+#define OCW3_READ_ISR 0x0B
+#define PIC_EOI       0x20
+#define PIC_CASCADE   2
+
+void pic_init(uint8_t vector_base) {
+    outb(PIC1_COMMAND, ICW1_INIT);
+    io_wait();
+    outb(PIC2_COMMAND, ICW1_INIT);
+    io_wait();
+    outb(PIC1_DATA, vector_base);           // ICW2: vector offsets
+    io_wait();
+    outb(PIC2_DATA, vector_base + 8);
+    io_wait();
+    outb(PIC1_DATA, 1 << PIC_CASCADE);      // ICW3: slave on IRQ 2
+    io_wait();
+    outb(PIC2_DATA, PIC_CASCADE);
+    io_wait();
+    outb(PIC1_DATA, ICW4_8086);
+    io_wait();
+    outb(PIC2_DATA, ICW4_8086);
+    io_wait();
+
+    // Everything starts masked except the cascade; irq_register unmasks
+    outb(PIC1_DATA, (uint8_t)~(1 << PIC_CASCADE));
+    outb(PIC2_DATA, 0xFF);
+}
+
+void pic_mask(uint8_t irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) | (1 << (irq & 7)));
+}
+
+void pic_unmask(uint8_t irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) & ~(1 << (irq & 7)));
+}
+
+void pic_send_eoi(uint8_t irq) {
+    if (irq >= 8) {
+        outb(PIC2_COMMAND, PIC_EOI);
+    }
+    outb(PIC1_COMMAND, PIC_EOI);
+}
+
+// IRQ 7 and 15 fire spuriously when a request goes away before the CPU
+// acknowledges it; the in-service register tells them apart
+int pic_is_spurious(uint8_t irq) {
+    if (irq != 7 && irq != 15) {
+        return 0;
+    }
+
+    uint16_t port = irq == 7 ? PIC1_COMMAND : PIC2_COMMAND;
+    outb(port, OCW3_READ_ISR);
+    if (inb(port) & 0x80) {
+        return 0;
+    }
+
+    // The master did see a real cascade interrupt for a spurious slave IRQ
+    if (irq == 15) {
+        outb(PIC1_COMMAND, PIC_EOI);
+    }
+    return 1;
+}
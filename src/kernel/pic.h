@@ -0,0 +1,13 @@
+#ifndef PIC_H
+#define PIC_H
+
+#include <stdint.h>
+
+// 8259A pair: IRQ 0-7 on the master, 8-15 on the slave (cascaded on IRQ 2)
+void pic_init(uint8_t vector_base);     // Remap IRQs to vector_base..+15, all masked
+void pic_mask(uint8_t irq);
+void pic_unmask(uint8_t irq);
+void pic_send_eoi(uint8_t irq);
+int pic_is_spurious(uint8_t irq);       // Also acknowledges the master for a spurious IRQ 15
+
+#endif // PIC_H
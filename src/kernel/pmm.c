@@ -0,0 +1,419 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "pmm.h"
+#include "memory.h"
+#include "paging.h"
+#include "stdio.h"
+#include "spinlock.h"
+#include "string.h"
+#include "bench.h"
+#include "trace.h"
+
+/*
+ * Physical memory manager.
+ *
+ * pmm_init walks the multiboot memory map and builds one page_t per frame up
+ * to the highest usable address. Frames in holes, firmware areas, below 1 MB,
+ * under the kernel image, under what the bootloader handed over (multiboot
+ * info, memory map, command line, modules) or under the descriptor array
+ * itself stay PAGE_RESERVED forever. All other frames are handed to a
+ * binary buddy allocator.
+ *
+ * The buddy allocator keeps one free list per order plus a bitmap of
+ * non-empty orders. Allocation takes the smallest sufficient order with a
+ * ctz and splits it down. Freeing merges with the buddy (frame ^ 2^order) for
+ * as long as the buddy heads a free block of the same order. Free-list links
+ * live in the page descriptors, so free memory itself is never touched.
+ */
+#define LOW_MEMORY_END   0x100000        // IVT, BIOS data, VGA memory and option ROMs
+#define MAX_PHYS_ADDRESS DIRECT_MAP_SIZE // Frames must be reachable through the direct map
+
+extern uint8_t _kernel_start[]; // Start of the kernel image (virtual), from linker.ld
+extern uint8_t _kernel_end[];   // End of the kernel image (virtual), from linker.ld
+
+static page_t* pages;                            // Descriptors, indexed by frame number
+static size_t page_count;                        // Frames covered by `pages`
+static page_t* free_area[PMM_MAX_ORDER + 1];     // Free blocks of each order
+static size_t free_area_count[PMM_MAX_ORDER + 1];
+static uint32_t free_area_mask;                  // Bit o set: free_area[o] is non-empty
+static size_t free_count;
+static size_t usable_count;
+static spinlock_t pmm_lock = SPINLOCK_INIT;     // Free lists and counters
+
+static inline size_t page_frame(const page_t* page) {
+    return (size_t)(page - pages);
+}
+
+static inline uintptr_t align_down_page(uint64_t addr) {
+    return (uintptr_t)(addr & ~(uint64_t)(PAGE_SIZE - 1));
+}
+
+static inline uintptr_t align_up_page(uint64_t addr) {
+    return align_down_page(addr + PAGE_SIZE - 1);
+}
+
+static void free_area_push(unsigned int order, page_t* page) {
+    page->order = order;
+    page->flags |= PAGE_FREE;
+    page->prev = NULL;
+    page->next = free_area[order];
+    if (free_area[order]) free_area[order]->prev = page;
+    free_area[order] = page;
+    free_area_count[order]++;
+    free_area_mask |= 1U << order;
+}
+
+static void free_area_remove(unsigned int order, page_t* page) {
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        free_area[order] = page->next;
+        if (!page->next) free_area_mask &= ~(1U << order);
+    }
+    if (page->next) page->next->prev = page->prev;
+    page->flags &= ~PAGE_FREE;
+    free_area_count[order]--;
+}
+
+// Return a block to the free lists, merging it with free buddies
+static void buddy_free(size_t frame, unsigned int order) {
+    free_count += (size_t)1 << order;
+
+    while (order < PMM_MAX_ORDER) {
+        size_t buddy = frame ^ ((size_t)1 << order);
+        if (buddy >= page_count) {
+            break;
+        }
+        page_t* page = &pages[buddy];
+        if (!(page->flags & PAGE_FREE) || page->order != order) {
+            break;
+        }
+        free_area_remove(order, page);
+        frame &= ~((size_t)1 << order);
+        order++;
+    }
+    free_area_push(order, &pages[frame]);
+}
+
+// Free an arbitrary run of frames as a sequence of naturally aligned blocks
+static void buddy_free_run(size_t frame, size_t count) {
+    while (count > 0) {
+        unsigned int order = frame ? __builtin_ctz(frame) : PMM_MAX_ORDER;
+        if (order > PMM_MAX_ORDER) order = PMM_MAX_ORDER;
+        while (((size_t)1 << order) > count) order--;
+
+        buddy_free(frame, order);
+        frame += (size_t)1 << order;
+        count -= (size_t)1 << order;
+    }
+}
+
+// Iterate over the bootloader's memory map, falling back to mem_upper
+typedef void (*region_fn)(uint64_t start, uint64_t end);
+
+static void for_each_usable_region(multiboot_info_t* mbi, region_fn fn) {
+    if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+        uintptr_t cur = (uintptr_t)phys_to_virt(mbi->mmap_addr);
+        uintptr_t end = cur + mbi->mmap_length;
+        while (cur < end) {
+            multiboot_mmap_entry_t* entry = (multiboot_mmap_entry_t*)cur;
+            if (entry->type == MULTIBOOT_MEMORY_AVAILABLE && entry->len) {
+                fn(entry->addr, entry->addr + entry->len);
+            }
+            cur += entry->size + sizeof(entry->size);
+        }
+    } else if (mbi->flags & MULTIBOOT_INFO_MEMORY) {
+        fn(LOW_MEMORY_END, LOW_MEMORY_END + (uint64_t)mbi->mem_upper * 1024);
+    }
+}
+
+static uint64_t highest_usable;
+static uintptr_t metadata_size;
+static uintptr_t metadata_start;
+
+// Physical ranges the bootloader left data in, which the descriptor array
+// must not be placed over and which are never handed out
+#define BOOT_RANGES_MAX  32
+
+typedef struct boot_range {
+    uintptr_t start;
+    uintptr_t end;
+} boot_range_t;
+
+static boot_range_t boot_ranges[BOOT_RANGES_MAX];
+static size_t boot_range_count;
+
+static void add_boot_range(uintptr_t start, uintptr_t end) {
+    if (boot_range_count == BOOT_RANGES_MAX) {
+        terminal_writestring("Error: Too many bootloader ranges to track.\n");
+        return;
+    }
+    boot_ranges[boot_range_count].start = start;
+    boot_ranges[boot_range_count].end = end;
+    boot_range_count++;
+}
+
+static void add_string_range(uintptr_t phys) {
+    add_boot_range(phys, phys + strlen((const char*)phys_to_virt(phys)) + 1);
+}
+
+static void collect_boot_ranges(multiboot_info_t* mbi) {
+    boot_range_count = 0;
+    add_boot_range(virt_to_phys(mbi), virt_to_phys(mbi) + sizeof(*mbi));
+    if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+        add_boot_range(mbi->mmap_addr, mbi->mmap_addr + mbi->mmap_length);
+    }
+    if (mbi->flags & MULTIBOOT_INFO_CMDLINE) {
+        add_string_range(mbi->cmdline);
+    }
+    if (mbi->flags & MULTIBOOT_INFO_MODS) {
+        multiboot_module_t* mods = (multiboot_module_t*)phys_to_virt(mbi->mods_addr);
+        add_boot_range(mbi->mods_addr, mbi->mods_addr + mbi->mods_count * sizeof(*mods));
+        for (uint32_t i = 0; i < mbi->mods_count; i++) {
+            add_boot_range(mods[i].mod_start, mods[i].mod_end);
+            if (mods[i].string) {
+                add_string_range(mods[i].string);
+            }
+        }
+    }
+}
+
+static void find_highest(uint64_t start, uint64_t end) {
+    (void)start;
+    if (end > MAX_PHYS_ADDRESS) end = MAX_PHYS_ADDRESS;
+    if (end > highest_usable) highest_usable = end;
+}
+
+// First usable spot above the kernel image big enough for the descriptors
+// that is clear of every bootloader range
+static void find_metadata_spot(uint64_t start, uint64_t end) {
+    if (metadata_start) {
+        return;
+    }
+    if (start < virt_to_phys(_kernel_end)) start = virt_to_phys(_kernel_end);
+    if (start < LOW_MEMORY_END) start = LOW_MEMORY_END;
+    if (end > MAX_PHYS_ADDRESS) end = MAX_PHYS_ADDRESS;
+
+    uint64_t base = align_up_page(start);
+    for (size_t i = 0; i < boot_range_count && base + metadata_size <= end; i++) {
+        // Past an overlapping range, every range has to be checked again
+        if (base < boot_ranges[i].end && boot_ranges[i].start < base + metadata_size) {
+            base = align_up_page(boot_ranges[i].end);
+            i = (size_t)-1;
+        }
+    }
+    if (base + metadata_size <= end) {
+        metadata_start = (uintptr_t)base;
+    }
+}
+
+static void mark_usable(uint64_t start, uint64_t end) {
+    if (end > MAX_PHYS_ADDRESS) end = MAX_PHYS_ADDRESS;
+    size_t first = align_up_page(start) / PAGE_SIZE;
+    size_t last = align_down_page(end) / PAGE_SIZE;
+    for (size_t i = first; i < last && i < page_count; i++) {
+        pages[i].flags &= ~PAGE_RESERVED;
+    }
+}
+
+static void mark_reserved(uintptr_t start, uintptr_t end) {
+    size_t first = align_down_page(start) / PAGE_SIZE;
+    size_t last = align_up_page(end) / PAGE_SIZE;
+    for (size_t i = first; i < last && i < page_count; i++) {
+        pages[i].flags |= PAGE_RESERVED;
+    }
+}
+
+// End of the highest usable RAM the kernel can reach
+uintptr_t pmm_memory_end(multiboot_info_t* mbi) {
+    highest_usable = 0;
+    for_each_usable_region(mbi, find_highest);
+    return (uintptr_t)highest_usable;
+}
+
+void pmm_init(multiboot_info_t* mbi) {
+    if (!(mbi->flags & (MULTIBOOT_INFO_MEM_MAP | MULTIBOOT_INFO_MEMORY))) {
+        terminal_writestring("Error: Bootloader provided no memory map.\n");
+        return;
+    }
+
+    page_count = align_down_page(pmm_memory_end(mbi)) / PAGE_SIZE;
+    metadata_size = align_up_page((uint64_t)page_count * sizeof(page_t));
+    collect_boot_ranges(mbi);
+    for_each_usable_region(mbi, find_metadata_spot);
+    if (!metadata_start) {
+        terminal_writestring("Error: No room for page descriptors.\n");
+        return;
+    }
+
+    // Everything starts reserved; only frames inside usable regions are
+    // released, minus the areas the kernel is already using
+    pages = (page_t*)phys_to_virt(metadata_start);
+    for (size_t i = 0; i < page_count; i++) {
+        pages[i].next = NULL;
+        pages[i].prev = NULL;
+        pages[i].order = 0;
+        pages[i].flags = PAGE_RESERVED;
+        pages[i].count = 0;
+    }
+    for_each_usable_region(mbi, mark_usable);
+
+    mark_reserved(0, LOW_MEMORY_END);
+    mark_reserved(virt_to_phys(_kernel_start), virt_to_phys(_kernel_end));
+    mark_reserved(metadata_start, metadata_start + metadata_size);
+    for (size_t i = 0; i < boot_range_count; i++) {
+        mark_reserved(boot_ranges[i].start, boot_ranges[i].end);
+    }
+
+    // Hand every maximal run of available frames to the buddy allocator
+    for (size_t i = 0; i < page_count;) {
+        if (pages[i].flags & PAGE_RESERVED) {
+            i++;
+            continue;
+        }
+        size_t run = i;
+        while (i < page_count && !(pages[i].flags & PAGE_RESERVED)) i++;
+        buddy_free_run(run, i - run);
+    }
+    usable_count = free_count;
+}
+
+// Caller holds pmm_lock
+static uintptr_t buddy_alloc(unsigned int order) {
+    if (order > PMM_MAX_ORDER) {
+        return 0;
+    }
+
+    uint32_t mask = free_area_mask & (~0U << order);
+    if (!mask) {
+        return 0; // Out of memory
+    }
+
+    unsigned int current = __builtin_ctz(mask);
+    page_t* page = free_area[current];
+    free_area_remove(current, page);
+
+    // Split down to the requested order, returning the upper halves
+    while (current > order) {
+        current--;
+        free_area_push(current, page + ((size_t)1 << current));
+    }
+
+    page->order = order;
+    free_count -= (size_t)1 << order;
+    return page_frame(page) * PAGE_SIZE;
+}
+
+uintptr_t pmm_alloc(unsigned int order) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    uintptr_t addr = buddy_alloc(order);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    trace_event(TRACE_PAGE_ALLOC, addr, 1u << order);
+    return addr;
+}
+
+static int valid_block(uintptr_t addr, size_t count) {
+    size_t frame = addr / PAGE_SIZE;
+    if (addr % PAGE_SIZE || frame >= page_count || count > page_count - frame) {
+        terminal_writestring("Error: Invalid address passed to pmm_free.\n");
+        return 0;
+    }
+    if (pages[frame].flags & (PAGE_FREE | PAGE_RESERVED)) {
+        terminal_writestring("Error: Double free of a physical page.\n");
+        return 0;
+    }
+    return 1;
+}
+
+void pmm_free(uintptr_t addr, unsigned int order) {
+    if (order > PMM_MAX_ORDER) {
+        return;
+    }
+    if ((addr / PAGE_SIZE) & (((size_t)1 << order) - 1)) {
+        terminal_writestring("Error: Misaligned block passed to pmm_free.\n");
+        return;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    if (valid_block(addr, (size_t)1 << order)) {
+        buddy_free(addr / PAGE_SIZE, order);
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    trace_event(TRACE_PAGE_FREE, addr, 1u << order);
+}
+
+uintptr_t pmm_alloc_range(size_t count, size_t align) {
+    if (count == 0) {
+        return 0;
+    }
+    if (align == 0) {
+        align = 1;
+    }
+    if (align & (align - 1)) {
+        terminal_writestring("Error: Alignment must be a power of 2.\n");
+        return 0;
+    }
+
+    // Buddy blocks are naturally aligned, so one block covering both the
+    // size and the alignment satisfies the request; the unused tail is
+    // given back straight away
+    size_t span = count > align ? count : align;
+    unsigned int order = 0;
+    while (((size_t)1 << order) < span) order++;
+
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    uintptr_t addr = buddy_alloc(order);
+    size_t block = (size_t)1 << order;
+    if (addr && count < block) {
+        buddy_free_run(addr / PAGE_SIZE + count, block - count);
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    trace_event(TRACE_PAGE_ALLOC, addr, count);
+    return addr;
+}
+
+void pmm_free_range(uintptr_t addr, size_t count) {
+    if (count == 0) {
+        return;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    if (valid_block(addr, count)) {
+        buddy_free_run(addr / PAGE_SIZE, count);
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    trace_event(TRACE_PAGE_FREE, addr, count);
+}
+
+page_t* pmm_page(uintptr_t addr) {
+    size_t frame = addr / PAGE_SIZE;
+    return (pages && frame < page_count) ? &pages[frame] : NULL;
+}
+
+size_t pmm_free_count(void) {
+    return free_count;
+}
+
+size_t pmm_usable_count(void) {
+    return usable_count;
+}
+
+void pmm_stats(void) {
+    char orders[(PMM_MAX_ORDER + 1) * 11 + 1];  // " " and up to 10 digits each
+    size_t length = 0;
+    for (unsigned int order = 0; order <= PMM_MAX_ORDER; order++) {
+        length += ksnprintf(orders + length, sizeof(orders) - length, " %zu", free_area_count[order]);
+    }
+    kprintf("Physical Memory: %zu KB free of %zu KB\nFree blocks per order:%s\n",
+            free_count * (PAGE_SIZE / 1024), usable_count * (PAGE_SIZE / 1024), orders);
+}
+
+BENCH(pmm_alloc_page, 64) {
+    for (uint32_t i = 0; i < iterations; i++) {
+        uintptr_t frame = pmm_alloc(0);
+        if (frame) {
+            pmm_free(frame, 0);
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef PMM_H
+#define PMM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "multiboot.h"
+
+#define PMM_MAX_ORDER 10    // Largest block: 2^10 pages (4 MB)
+
+// Per-page flags
+#define PAGE_RESERVED 0x01  // Never handed out: firmware, holes, kernel image
+#define PAGE_FREE     0x02  // Head page of a free buddy block
+#define PAGE_HEAP     0x04  // Part of a kmalloc pool
+#define PAGE_LARGE    0x08  // Head page of a page-sized kmalloc allocation
+
+// One descriptor per physical page frame
+typedef struct page {
+    struct page* next;      // Free-list links, only valid on a free block's head page
+    struct page* prev;
+    uint8_t order;          // Order of the block this page heads
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t count;         // Pages in an allocated run, kept by its owner
+} page_t;
+
+// Physical memory manager: a binary buddy allocator over the usable RAM
+// reported by the bootloader's memory map. Addresses are physical; use
+// phys_to_virt() from paging.h to access the memory.
+void pmm_init(multiboot_info_t* mbi);
+uintptr_t pmm_memory_end(multiboot_info_t* mbi);         // Highest usable physical address
+uintptr_t pmm_alloc(unsigned int order);                 // 2^order pages, 0 on failure
+void pmm_free(uintptr_t addr, unsigned int order);
+uintptr_t pmm_alloc_range(size_t count, size_t align);   // Contiguous run, align in pages
+void pmm_free_range(uintptr_t addr, size_t count);
+page_t* pmm_page(uintptr_t addr);                        // Descriptor of a frame, or NULL
+size_t pmm_free_count(void);                             // Free pages
+size_t pmm_usable_count(void);                           // Pages of usable RAM
+void pmm_stats(void);
+
+#endif // PMM_H
@@ -0,0 +1,281 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "profile.h"
+#include "cpu.h"
+#include "smp.h"
+#include "memory.h"
+#include "paging.h"
+#include "serial.h"
+#include "stdio.h"
+
+#define PROFILE_DEPTH       8           // Frames per sample, the interrupted EIP first
+#define PROFILE_SLOT_BITS   11
+#define PROFILE_SLOTS       (1 << PROFILE_SLOT_BITS)
+#define PROFILE_PROBES      16          // Table slots tried before a sample is dropped
+#define PROFILE_STACK_SPAN  16384       // Largest kernel stack, the boot stack
+#define PROFILE_PAGES       ((PROFILE_SLOTS * sizeof(profile_stack_t) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+// Written by nm and awk at link time (see the Makefile); absent in the
+// first link, which the table is generated from
+extern const ksym_t ksym_table[] __attribute__((weak));
+extern const uint32_t ksym_count __attribute__((weak));
+
+typedef struct profile_stack {
+    uint32_t count;             // Samples; 0 marks a free slot
+    uint32_t depth;
+    uintptr_t pcs[PROFILE_DEPTH];
+} profile_stack_t;
+
+// Each CPU only samples into its own table, from its timer interrupt.
+// `sampling` lets profile_stop wait out samples in progress elsewhere.
+typedef struct profile_cpu {
+    profile_stack_t* stacks;
+    uint32_t samples;
+    uint32_t dropped;           // Samples whose stack found no free slot
+    volatile uint32_t sampling;
+    uintptr_t scratch[PROFILE_DEPTH];   // Task stacks are small; build the chain here
+} __attribute__((aligned(64))) profile_cpu_t;
+
+static profile_cpu_t profile_cpus[MAX_CPUS];
+static volatile int profile_active;
+
+// Follow saved frame pointers up the interrupted stack, which the interrupt
+// frame itself is on. Without FRAME_POINTERS=1, EBP is just another
+// register and only the EIP is kept.
+static uint32_t profile_callchain(interrupt_frame_t* frame, uintptr_t* pcs) {
+    uint32_t depth = 0;
+    pcs[depth++] = frame->eip;
+#ifdef PROFILE_CALLCHAIN
+    uintptr_t low = (uintptr_t)frame;
+    uintptr_t high = low + PROFILE_STACK_SPAN;
+    uintptr_t* fp = (uintptr_t*)frame->ebp;
+    while (depth < PROFILE_DEPTH && (uintptr_t)fp > low && (uintptr_t)fp < high - 8 &&
+           !((uintptr_t)fp & 3)) {
+        uintptr_t ret = fp[1];
+        if (ret < KERNEL_VIRT_BASE) {
+            break;
+        }
+        pcs[depth++] = ret;
+        uintptr_t* next = (uintptr_t*)fp[0];
+        if (next <= fp) {
+            break;
+        }
+        fp = next;
+    }
+#endif
+    return depth;
+}
+
+static uint32_t stack_hash(const uintptr_t* pcs, uint32_t depth) {
+    uint32_t hash = depth;
+    for (uint32_t i = 0; i < depth; i++) {
+        hash = (hash ^ pcs[i]) * 0x9E3779B1;
+    }
+    return hash >> (32 - PROFILE_SLOT_BITS);
+}
+
+static int stack_equal(const profile_stack_t* stack, const uintptr_t* pcs, uint32_t depth) {
+    if (stack->depth != depth) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < depth; i++) {
+        if (stack->pcs[i] != pcs[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Interrupts are disabled
+void profile_tick(interrupt_frame_t* frame) {
+    if (!profile_active) {
+        return;
+    }
+    profile_cpu_t* cpu = &profile_cpus[this_cpu()->id];
+    __atomic_exchange_n(&cpu->sampling, 1, __ATOMIC_SEQ_CST);
+    if (!profile_active || !cpu->stacks) {
+        __atomic_store_n(&cpu->sampling, 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+    uint32_t depth = profile_callchain(frame, cpu->scratch);
+    uint32_t slot = stack_hash(cpu->scratch, depth);
+    cpu->samples++;
+    for (int probe = 0; probe < PROFILE_PROBES; probe++) {
+        profile_stack_t* stack = &cpu->stacks[(slot + probe) & (PROFILE_SLOTS - 1)];
+        if (!stack->count) {
+            stack->depth = depth;
+            for (uint32_t i = 0; i < depth; i++) {
+                stack->pcs[i] = cpu->scratch[i];
+            }
+            stack->count = 1;
+            __atomic_store_n(&cpu->sampling, 0, __ATOMIC_RELEASE);
+            return;
+        }
+        if (stack_equal(stack, cpu->scratch, depth)) {
+            stack->count++;
+            __atomic_store_n(&cpu->sampling, 0, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+    cpu->dropped++;
+    __atomic_store_n(&cpu->sampling, 0, __ATOMIC_RELEASE);
+}
+
+void profile_start(void) {
+    profile_stop();
+    for (uint32_t id = 0; id < cpu_count; id++) {
+        profile_cpu_t* cpu = &profile_cpus[id];
+        if (!cpu->stacks) {
+            cpu->stacks = (profile_stack_t*)alloc_pages(PROFILE_PAGES, 1);
+            if (!cpu->stacks) {
+                terminal_writestring("Error: Not enough memory for profile tables.\n");
+                return;
+            }
+        }
+        for (uint32_t i = 0; i < PROFILE_SLOTS; i++) {
+            cpu->stacks[i].count = 0;
+        }
+        cpu->samples = 0;
+        cpu->dropped = 0;
+    }
+    __atomic_store_n(&profile_active, 1, __ATOMIC_SEQ_CST);
+}
+
+void profile_stop(void) {
+    __atomic_store_n(&profile_active, 0, __ATOMIC_SEQ_CST);
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        while (profile_cpus[id].sampling) {
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+static int32_t ksym_index(uintptr_t address) {
+    uint32_t count = &ksym_count ? ksym_count : 0;
+    if (!count || address < ksym_table[0].address) {
+        return -1;
+    }
+    // Last symbol at or below the address
+    uint32_t low = 0, high = count;
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if (ksym_table[mid].address <= address) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return (int32_t)low;
+}
+
+const char* ksym_lookup(uintptr_t address, uint32_t* offset) {
+    int32_t index = ksym_index(address);
+    if (index < 0) {
+        return NULL;
+    }
+    if (offset) {
+        *offset = address - ksym_table[index].address;
+    }
+    return ksym_table[index].name;
+}
+
+// Append one frame's name to a collapsed stack line. Return addresses are
+// looked up one byte back so a call at the very end of a function is not
+// charged to the next one.
+static size_t append_frame(char* line, size_t used, size_t size, uintptr_t pc, int return_address) {
+    const char* name = ksym_lookup(return_address ? pc - 1 : pc, NULL);
+    int length = name ? ksnprintf(line + used, size - used, "%s", name)
+                      : ksnprintf(line + used, size - used, "0x%08x", (unsigned int)pc);
+    used += length;
+    return used < size ? used : size - 1;
+}
+
+/*
+ * Top functions by samples taken in them, then every distinct stack as a
+ * collapsed line, "outer;inner;leaf count", which flamegraph.pl and
+ * speedscope read directly. A function sampled on several CPUs or at
+ * several addresses has several lines; both tools add them up.
+ */
+void profile_dump(uint32_t top) {
+    profile_stop();
+
+    uint32_t symbols = &ksym_count ? ksym_count : 0;
+    uint32_t* self = symbols ? (uint32_t*)kmalloc(symbols * sizeof(uint32_t)) : NULL;
+    if (self) {
+        for (uint32_t i = 0; i < symbols; i++) {
+            self[i] = 0;
+        }
+    }
+
+    uint32_t samples = 0, dropped = 0, unknown = 0;
+    for (uint32_t id = 0; id < cpu_count; id++) {
+        profile_cpu_t* cpu = &profile_cpus[id];
+        samples += cpu->samples;
+        dropped += cpu->dropped;
+        for (uint32_t i = 0; cpu->stacks && i < PROFILE_SLOTS; i++) {
+            profile_stack_t* stack = &cpu->stacks[i];
+            if (!stack->count) {
+                continue;
+            }
+            int32_t index = ksym_index(stack->pcs[0]);
+            if (index < 0 || !self) {
+                unknown += stack->count;
+            } else {
+                self[index] += stack->count;
+            }
+        }
+    }
+
+    char line[512];
+    int length;
+    serial_write_all("PROFILE BEGIN\n", 14);
+    length = ksnprintf(line, sizeof(line), "PROFILE samples=%u dropped=%u unknown=%u cpus=%u symbols=%u\n",
+                       (unsigned int)samples, (unsigned int)dropped, (unsigned int)unknown,
+                       (unsigned int)cpu_count, (unsigned int)symbols);
+    serial_write_all(line, length);
+
+    // Selection of the top entries; the table is consumed as it goes
+    for (uint32_t rank = 1; self && rank <= top; rank++) {
+        uint32_t best = 0;
+        for (uint32_t i = 1; i < symbols; i++) {
+            if (self[i] > self[best]) {
+                best = i;
+            }
+        }
+        if (!self[best]) {
+            break;
+        }
+        uint32_t permille = samples ? self[best] * 1000 / samples : 0;
+        length = ksnprintf(line, sizeof(line), "PROFILE top=%u samples=%u percent=%u.%u function=%s\n",
+                           (unsigned int)rank, (unsigned int)self[best], (unsigned int)(permille / 10),
+                           (unsigned int)(permille % 10), ksym_table[best].name);
+        serial_write_all(line, length);
+        self[best] = 0;
+    }
+    kfree(self);
+
+    serial_write_all("PROFILE stacks\n", 15);
+    for (uint32_t id = 0; id < cpu_count; id++) {
+        profile_cpu_t* cpu = &profile_cpus[id];
+        for (uint32_t i = 0; cpu->stacks && i < PROFILE_SLOTS; i++) {
+            profile_stack_t* stack = &cpu->stacks[i];
+            if (!stack->count) {
+                continue;
+            }
+            size_t used = 0;
+            for (uint32_t frame = stack->depth; frame-- > 0;) {
+                used = append_frame(line, used, sizeof(line) - 16, stack->pcs[frame], frame != 0);
+                if (frame) {
+                    line[used++] = ';';
+                }
+            }
+            used += ksnprintf(line + used, sizeof(line) - used, " %u\n", (unsigned int)stack->count);
+            serial_write_all(line, used);
+        }
+    }
+    serial_write_all("PROFILE END\n", 12);
+
+    kprintf("Profile: %u samples dumped to serial\n", (unsigned int)samples);
+}
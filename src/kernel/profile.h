@@ -0,0 +1,28 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+#include "idt.h"
+
+/*
+ * Sampling profiler. Every timer tick on every CPU records the interrupted
+ * EIP into that CPU's table of distinct stacks; a kernel built with
+ * FRAME_POINTERS=1 records the caller chain too. Samples are symbolized on
+ * the machine against the symbol table the Makefile links into the kernel.
+ * Idle CPUs with their tick stopped are not sampled.
+ */
+#define PROFILE_TOP  20             // Functions listed by profile_dump
+
+typedef struct ksym {
+    uintptr_t address;
+    const char* name;
+} ksym_t;
+
+void profile_start(void);           // Clear the tables and start sampling, after smp_init
+void profile_stop(void);
+void profile_tick(interrupt_frame_t* frame);  // From the timer interrupts
+void profile_dump(uint32_t top);    // Stop, then top functions and collapsed stacks over serial
+const char* ksym_lookup(uintptr_t address, uint32_t* offset);  // Function containing address, or NULL
+
+#endif // PROFILE_H
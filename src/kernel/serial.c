@@ -0,0 +1,259 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "serial.h"
+#include "idt.h"
+#include "cpu.h"
+
+#define COM1            0x3F8
+#define UART_DATA       0       // THR on write, with DLAB clear
+#define UART_IER        1
+#define UART_DLL        0       // Divisor, with DLAB set
+#define UART_DLH        1
+#define UART_FCR        2
+#define UART_LCR        3
+#define UART_MCR        4
+#define UART_LSR        5
+#define UART_SCRATCH    7
+
+#define IER_THRE        0x02    // Interrupt when the transmit FIFO empties
+#define FCR_ENABLE      0x07    // Enable and clear both FIFOs
+#define LCR_8N1         0x03
+#define LCR_DLAB        0x80
+#define MCR_DTR_RTS     0x03
+#define MCR_OUT2        0x08    // Gates the UART interrupt onto the IRQ line
+#define LSR_THRE        0x20
+
+#define UART_FIFO_SIZE  16
+#define UART_DIVISOR    1       // 115200 baud
+#define IRQ_COM1        4
+
+#define LOG_RING_SIZE   16384   // Power of two
+#define LOG_RING_MASK   (LOG_RING_SIZE - 1)
+
+/*
+ * Multi-producer, single-consumer byte ring. All three positions run
+ * freely and are masked on use.
+ *
+ * A writer reserves its bytes by advancing `reserved` with a CAS, giving up
+ * and counting a drop if they would overwrite what the consumer has not
+ * sent yet, copies them in and then publishes them by advancing
+ * `committed`. Reservations are published in order, so a writer waits for
+ * those reserved before it to be published first; interrupts are off from
+ * reserve to publish, so that wait is only ever for another CPU's memcpy.
+ *
+ * Whoever sets `tx_busy` is the one consumer: a writer finding the UART
+ * idle fills its FIFO and hands over to the transmit interrupt, which keeps
+ * refilling it until the ring is empty and then clears `tx_busy` again.
+ */
+static char log_ring[LOG_RING_SIZE];
+static volatile uint32_t reserved;
+static volatile uint32_t committed;
+static volatile uint32_t sent;
+static volatile uint32_t dropped;
+static volatile uint32_t tx_busy;
+static int serial_present;
+static int serial_irq;
+static volatile int serial_direct;      // Set by serial_panic: the ring is bypassed
+
+static int uart_ready(void) {
+    return inb(COM1 + UART_LSR) & LSR_THRE;
+}
+
+// Move up to a FIFO's worth of bytes into the UART; the caller owns tx_busy
+// and has checked the FIFO is empty. Returns 0 if the ring was empty.
+static int uart_fill(void) {
+    uint32_t tail = sent;
+    uint32_t head = __atomic_load_n(&committed, __ATOMIC_ACQUIRE);
+    if (tail == head) {
+        return 0;
+    }
+    uint32_t count = head - tail;
+    if (count > UART_FIFO_SIZE) count = UART_FIFO_SIZE;
+    for (uint32_t i = 0; i < count; i++) {
+        outb(COM1 + UART_DATA, log_ring[(tail + i) & LOG_RING_MASK]);
+    }
+    __atomic_store_n(&sent, tail + count, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Give up the consumer role, or keep it if bytes were published meanwhile
+static int tx_release(void) {
+    __atomic_store_n(&tx_busy, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&committed, __ATOMIC_SEQ_CST) == sent) {
+        return 0;
+    }
+    return __atomic_exchange_n(&tx_busy, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+// Only runs as the consumer: IER_THRE is set by the owner of tx_busy when it
+// hands over, and only cleared by this handler
+static void serial_handler(interrupt_frame_t* frame) {
+    (void)frame;
+    if (!(inb(COM1 + UART_IER) & IER_THRE) || !uart_ready()) {
+        return;
+    }
+    while (!uart_fill()) {
+        outb(COM1 + UART_IER, 0);
+        if (!tx_release()) {
+            return;
+        }
+        outb(COM1 + UART_IER, IER_THRE);
+    }
+}
+
+// Interrupts disabled
+static void tx_kick(void) {
+    if (__atomic_exchange_n(&tx_busy, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    if (!serial_irq) {
+        // No interrupt yet: send everything now
+        do {
+            do {
+                while (!uart_ready()) {
+                    __asm__ volatile("pause");
+                }
+            } while (uart_fill());
+        } while (tx_release());
+        return;
+    }
+    // Start the FIFO going and let the interrupt take it from there; it
+    // fires at once if there was nothing left to send
+    if (uart_ready()) {
+        uart_fill();
+    }
+    outb(COM1 + UART_IER, IER_THRE);
+}
+
+// Copy into the ring and publish; 0 if it does not fit at the moment
+static int log_append(const char* data, size_t size) {
+    uint32_t flags = irq_save();
+    uint32_t start = __atomic_load_n(&reserved, __ATOMIC_RELAXED);
+    do {
+        if (start + size - __atomic_load_n(&sent, __ATOMIC_ACQUIRE) > LOG_RING_SIZE) {
+            irq_restore(flags);
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&reserved, &start, start + size, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    for (size_t i = 0; i < size; i++) {
+        log_ring[(start + i) & LOG_RING_MASK] = data[i];
+    }
+    while (__atomic_load_n(&committed, __ATOMIC_RELAXED) != start) {
+        __asm__ volatile("pause");
+    }
+    __atomic_store_n(&committed, start + size, __ATOMIC_SEQ_CST);
+
+    tx_kick();
+    irq_restore(flags);
+    return 1;
+}
+
+static void uart_write_polled(const char* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        while (!uart_ready()) {
+            __asm__ volatile("pause");
+        }
+        outb(COM1 + UART_DATA, data[i]);
+    }
+}
+
+void serial_write(const char* data, size_t size) {
+    if (!serial_present || size == 0) {
+        return;
+    }
+    if (serial_direct) {
+        uart_write_polled(data, size);
+        return;
+    }
+    if (!log_append(data, size)) {
+        __atomic_add_fetch(&dropped, size, __ATOMIC_RELAXED);
+    }
+}
+
+// Bulk output such as trace dumps, which must arrive whole. Other writers
+// keep dropping while this one fills the ring.
+void serial_write_all(const char* data, size_t size) {
+    if (!serial_present) {
+        return;
+    }
+    if (serial_direct) {
+        uart_write_polled(data, size);
+        return;
+    }
+    while (size) {
+        size_t chunk = size < LOG_RING_SIZE / 2 ? size : LOG_RING_SIZE / 2;
+        while (!log_append(data, chunk)) {
+            __asm__ volatile("pause");
+        }
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+// Takes sending over from the interrupt and polls the rest out, for when
+// interrupts may never be serviced again
+void serial_flush(void) {
+    if (!serial_present || serial_direct) {
+        return;
+    }
+    uint32_t flags = irq_save();
+    serial_irq = 0;
+    outb(COM1 + UART_IER, 0);
+    __atomic_store_n(&tx_busy, 0, __ATOMIC_SEQ_CST);
+    tx_kick();
+    irq_restore(flags);
+}
+
+/*
+ * For panics, with the other CPUs halted: one of them may have stopped
+ * between reserving ring space and publishing it, which log_append would
+ * wait for forever. Send what was published, then write straight to the
+ * UART from here on.
+ */
+void serial_panic(void) {
+    if (!serial_present) {
+        return;
+    }
+    uint32_t flags = irq_save();
+    serial_direct = 1;
+    serial_irq = 0;
+    outb(COM1 + UART_IER, 0);
+    uint32_t head = __atomic_load_n(&committed, __ATOMIC_ACQUIRE);
+    for (uint32_t tail = sent; tail != head; tail++) {
+        uart_write_polled(&log_ring[tail & LOG_RING_MASK], 1);
+    }
+    sent = head;
+    irq_restore(flags);
+}
+
+uint32_t serial_dropped(void) {
+    return dropped;
+}
+
+void serial_init(void) {
+    // No UART behind the port reads back all ones
+    outb(COM1 + UART_SCRATCH, 0x5A);
+    if (inb(COM1 + UART_SCRATCH) != 0x5A) {
+        return;
+    }
+
+    outb(COM1 + UART_IER, 0);
+    outb(COM1 + UART_LCR, LCR_DLAB);
+    outb(COM1 + UART_DLL, UART_DIVISOR & 0xFF);
+    outb(COM1 + UART_DLH, UART_DIVISOR >> 8);
+    outb(COM1 + UART_LCR, LCR_8N1);
+    outb(COM1 + UART_FCR, FCR_ENABLE);
+    outb(COM1 + UART_MCR, MCR_DTR_RTS | MCR_OUT2);
+    serial_present = 1;
+}
+
+void serial_enable_irq(void) {
+    if (!serial_present) {
+        return;
+    }
+    irq_register(IRQ_COM1, serial_handler);
+    serial_irq = 1;
+}
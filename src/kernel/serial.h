@@ -0,0 +1,17 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// COM1 console. Writers copy into a shared log ring and return at once; the
+// UART's transmit interrupt drains the ring in the background.
+void serial_init(void);                 // Probe and program the UART; polled until serial_enable_irq
+void serial_enable_irq(void);           // Needs the IDT
+void serial_write(const char* data, size_t size);   // Never blocks; drops what does not fit
+void serial_write_all(const char* data, size_t size); // Waits for room; needs interrupts enabled
+void serial_flush(void);                // Drain the ring by polling, e.g. before halting
+void serial_panic(void);                // Bypass the ring for good, polling the UART directly
+uint32_t serial_dropped(void);          // Bytes lost to a full ring so far
+
+#endif // SERIAL_H
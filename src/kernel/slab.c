@@ -0,0 +1,215 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "slab.h"
+#include "memory.h"
+#include "stdio.h"
+#include "spinlock.h"
+
+/*
+ * Slab allocator for fixed-size objects.
+ *
+ * Each slab is one page: a slab_t header followed by equally sized objects.
+ * Free objects are chained through a link word stored inside the object
+ * itself, so alloc and free are a couple of pointer operations and objects
+ * carry no per-object header. A slab's header is found by masking an object
+ * address down to its page.
+ *
+ * Caches keep their slabs on three lists (partial, full, empty). Allocation
+ * is served from a partial slab first; one empty slab is kept around to
+ * absorb churn and any further empty slab goes straight back to the page
+ * allocator.
+ */
+#define SLAB_SIZE PAGE_SIZE
+
+typedef struct slab {
+    struct slab* next;
+    struct slab* prev;
+    kmem_cache_t* cache;   // Owning cache
+    void* free;            // First free object, each one links to the next
+    uint32_t inuse;        // Number of allocated objects
+} slab_t;
+
+struct kmem_cache {
+    spinlock_t lock;       // Slab lists and counters
+    const char* name;
+    size_t object_size;    // Size requested by the creator
+    size_t stride;         // Distance between objects in a slab
+    size_t link_offset;    // Where the free-list link lives inside a free object
+    size_t first_offset;   // Offset of the first object from the slab start
+    uint32_t per_slab;     // Objects per slab
+    void (*ctor)(void*);
+    slab_t* partial;
+    slab_t* full;
+    slab_t* empty;
+    uint32_t slab_count;
+    uint32_t active_objects;
+};
+
+static inline size_t align_to(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static inline void** object_link(kmem_cache_t* cache, void* obj) {
+    return (void**)((uint8_t*)obj + cache->link_offset);
+}
+
+static void slab_list_push(slab_t** list, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+static void slab_list_remove(slab_t** list, slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) slab->next->prev = slab->prev;
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*)) {
+    if (align == 0) {
+        align = sizeof(void*);
+    }
+    if (size == 0 || (align & (align - 1))) {
+        terminal_writestring("Error: Invalid object size or alignment for kmem_cache_create().\n");
+        return NULL;
+    }
+
+    kmem_cache_t* cache = (kmem_cache_t*)kmalloc(sizeof(kmem_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+
+    cache->lock = (spinlock_t)SPINLOCK_INIT;
+    cache->name = name;
+    cache->object_size = size;
+    cache->ctor = ctor;
+
+    // A constructed object must survive sitting on the free list, so caches
+    // with a constructor keep the link in an extra word past the object
+    if (ctor) {
+        cache->link_offset = align_to(size, sizeof(void*));
+        size = cache->link_offset + sizeof(void*);
+    } else {
+        cache->link_offset = 0;
+        if (size < sizeof(void*)) size = sizeof(void*);
+    }
+
+    cache->stride = align_to(size, align);
+    cache->first_offset = align_to(sizeof(slab_t), align);
+    if (cache->first_offset + cache->stride > SLAB_SIZE) {
+        terminal_writestring("Error: Object too large for a slab.\n");
+        kfree(cache);
+        return NULL;
+    }
+    cache->per_slab = (SLAB_SIZE - cache->first_offset) / cache->stride;
+
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->slab_count = 0;
+    cache->active_objects = 0;
+    return cache;
+}
+
+// Carve a fresh page into objects
+static slab_t* cache_grow(kmem_cache_t* cache) {
+    slab_t* slab = (slab_t*)alloc_page();
+    if (!slab) {
+        return NULL;
+    }
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free = NULL;
+
+    // Link the objects back to front so the free list runs in address order
+    uint8_t* base = (uint8_t*)slab + cache->first_offset;
+    for (uint32_t i = cache->per_slab; i-- > 0;) {
+        void* obj = base + i * cache->stride;
+        if (cache->ctor) cache->ctor(obj);
+        *object_link(cache, obj) = slab->free;
+        slab->free = obj;
+    }
+
+    cache->slab_count++;
+    return slab;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+    slab_t* slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            slab_list_remove(&cache->empty, slab);
+        } else {
+            slab = cache_grow(cache);
+            if (!slab) {
+                spin_unlock_irqrestore(&cache->lock, flags);
+                terminal_writestring("Error: Out of pages for kmem_cache_alloc().\n");
+                return NULL;
+            }
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void* obj = slab->free;
+    slab->free = *object_link(cache, obj);
+    slab->inuse++;
+    cache->active_objects++;
+
+    if (!slab->free) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (!obj) {
+        return;
+    }
+
+    slab_t* slab = (slab_t*)((uintptr_t)obj & ~(uintptr_t)(SLAB_SIZE - 1));
+    size_t offset = (uintptr_t)obj - (uintptr_t)slab;
+    if (slab->cache != cache || offset < cache->first_offset ||
+        (offset - cache->first_offset) % cache->stride != 0) {
+        terminal_writestring("Error: Invalid pointer passed to kmem_cache_free.\n");
+        return;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+    int was_full = (slab->free == NULL);
+    *object_link(cache, obj) = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+    cache->active_objects--;
+
+    slab_t** from = was_full ? &cache->full : &cache->partial;
+    if (slab->inuse == 0) {
+        slab_list_remove(from, slab);
+        if (cache->empty) {
+            cache->slab_count--;
+            free_page(slab);
+        } else {
+            slab_list_push(&cache->empty, slab);
+        }
+    } else if (was_full) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+void kmem_cache_stats(kmem_cache_t* cache) {
+    kprintf("Cache %s: %u/%u objects in %u slabs\n", cache->name,
+            (unsigned int)cache->active_objects,
+            (unsigned int)(cache->slab_count * cache->per_slab),
+            (unsigned int)cache->slab_count);
+}
@@ -0,0 +1,19 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Object cache for fixed-size kernel objects (task_t, stacks, buffers...).
+// Objects are carved from whole pages and handed out without touching the heap.
+typedef struct kmem_cache kmem_cache_t;
+
+// Create a cache of `size`-byte objects aligned to `align` (0 for the default).
+// `ctor`, if given, runs once when an object is carved out of a fresh slab;
+// objects must be returned to the cache in their constructed state.
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*));
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+void kmem_cache_stats(kmem_cache_t* cache);
+
+#endif // SLAB_H
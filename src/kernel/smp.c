@@ -0,0 +1,363 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "smp.h"
+#include "string.h"
+#include "gdt.h"
+#include "lapic.h"
+#include "idt.h"
+#include "paging.h"
+#include "memory.h"
+#include "timer.h"
+#include "cpu.h"
+#include "stdio.h"
+#include "multitasking.h"
+#include "fpu.h"
+
+#define AP_TRAMPOLINE_ADDR  0x8000      // Must match ap_boot.s; below 1 MB, never handed out by the pmm
+#define AP_STARTUP_TIMEOUT  100         // Milliseconds to wait for an AP to check in
+#define VECTOR_NMI          2
+
+cpu_t cpus[MAX_CPUS];
+uint32_t cpu_count = 1;
+
+static uintptr_t lapic_phys;
+static cpu_t* ap_starting;              // CPU whose startup IPI is in flight, until claimed
+static volatile int ap_release;         // Set once every AP is up
+static volatile int halting;            // smp_halt_others sent the NMIs
+
+// ap_boot.s
+extern uint8_t ap_trampoline_start[], ap_trampoline_end[];
+extern uint8_t ap_cr3[], ap_stack[], ap_entry[];
+
+// ACPI and MP table layouts
+typedef struct {
+    char signature[8];          // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt;
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+typedef struct {
+    acpi_header_t header;       // "APIC"
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed)) acpi_madt_t;
+
+#define MADT_LOCAL_APIC      0
+#define MADT_APIC_ENABLED    0x1
+
+typedef struct {
+    char signature[4];          // "_MP_"
+    uint32_t config;
+    uint8_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    uint8_t features[5];
+} __attribute__((packed)) mp_floating_t;
+
+typedef struct {
+    char signature[4];          // "PCMP"
+    uint16_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[8];
+    char product_id[12];
+    uint32_t oem_table;
+    uint16_t oem_table_size;
+    uint16_t entry_count;
+    uint32_t lapic_address;
+    uint16_t extended_length;
+    uint8_t extended_checksum;
+    uint8_t reserved;
+} __attribute__((packed)) mp_config_t;
+
+#define MP_ENTRY_PROCESSOR   0
+#define MP_PROCESSOR_SIZE    20
+#define MP_OTHER_SIZE        8
+#define MP_CPU_ENABLED       0x1
+
+static int signature_equal(const void* data, const char* signature, size_t length) {
+    const char* bytes = (const char*)data;
+    for (size_t i = 0; i < length; i++) {
+        if (bytes[i] != signature[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int checksum_ok(const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+// Search [start, start + length) of low memory on 16-byte boundaries
+static void* scan_low_memory(uintptr_t start, size_t length, const char* signature, size_t size) {
+    for (uintptr_t addr = start; addr + size <= start + length; addr += 16) {
+        void* candidate = phys_to_virt(addr);
+        if (signature_equal(candidate, signature, 4) && checksum_ok(candidate, size)) {
+            return candidate;
+        }
+    }
+    return NULL;
+}
+
+// The firmware structures live in the EBDA, the last KB of base memory or
+// the BIOS ROM area
+static void* find_firmware_table(const char* signature, size_t size) {
+    uintptr_t ebda = (uintptr_t)*(uint16_t*)phys_to_virt(0x40E) << 4;
+    void* found = NULL;
+    if (ebda) {
+        found = scan_low_memory(ebda, 1024, signature, size);
+    }
+    if (!found) {
+        found = scan_low_memory(0x9FC00, 1024, signature, size);
+    }
+    if (!found) {
+        found = scan_low_memory(0xE0000, 0x20000, signature, size);
+    }
+    return found;
+}
+
+static void add_cpu(uint32_t apic_id) {
+    if (cpu_count < MAX_CPUS) {
+        cpus[cpu_count].apic_id = apic_id;
+        cpu_count++;
+    }
+}
+
+// Map a table whose length is only known once its header is readable
+static acpi_header_t* map_acpi_table(uintptr_t phys) {
+    acpi_header_t* header = (acpi_header_t*)paging_map_phys(phys, sizeof(acpi_header_t), 0);
+    if (!header) {
+        return NULL;
+    }
+    return (acpi_header_t*)paging_map_phys(phys, header->length, 0);
+}
+
+// CPU entries are recorded in cpus[1..]; the caller fixes up the bootstrap
+// CPU once the local APIC is mapped and its own ID is known
+static int find_cpus_acpi(uint32_t* apic_ids, uint32_t* count) {
+    acpi_rsdp_t* rsdp = (acpi_rsdp_t*)find_firmware_table("RSD ", sizeof(acpi_rsdp_t));
+    if (!rsdp || !signature_equal(rsdp->signature, "RSD PTR ", 8)) {
+        return 0;
+    }
+
+    acpi_header_t* rsdt = map_acpi_table(rsdp->rsdt);
+    if (!rsdt || !signature_equal(rsdt->signature, "RSDT", 4)) {
+        return 0;
+    }
+
+    uint32_t* entries = (uint32_t*)(rsdt + 1);
+    size_t entry_count = (rsdt->length - sizeof(acpi_header_t)) / sizeof(uint32_t);
+    for (size_t i = 0; i < entry_count; i++) {
+        acpi_header_t* table = map_acpi_table(entries[i]);
+        if (!table || !signature_equal(table->signature, "APIC", 4)) {
+            continue;
+        }
+
+        acpi_madt_t* madt = (acpi_madt_t*)table;
+        lapic_phys = madt->lapic_address;
+        uint8_t* entry = (uint8_t*)(madt + 1);
+        uint8_t* end = (uint8_t*)madt + madt->header.length;
+        while (entry + 2 <= end && entry[1]) {
+            if (entry[0] == MADT_LOCAL_APIC && (*(uint32_t*)(entry + 4) & MADT_APIC_ENABLED)
+                && *count < MAX_CPUS) {
+                apic_ids[(*count)++] = entry[3];
+            }
+            entry += entry[1];
+        }
+        return *count > 0;
+    }
+    return 0;
+}
+
+static int find_cpus_mp(uint32_t* apic_ids, uint32_t* count) {
+    mp_floating_t* mp = (mp_floating_t*)find_firmware_table("_MP_", sizeof(mp_floating_t));
+    if (!mp || !mp->config) {
+        return 0;
+    }
+
+    mp_config_t* config = (mp_config_t*)paging_map_phys(mp->config, sizeof(mp_config_t), 0);
+    if (!config || !signature_equal(config->signature, "PCMP", 4)) {
+        return 0;
+    }
+    config = (mp_config_t*)paging_map_phys(mp->config, config->length, 0);
+    lapic_phys = config->lapic_address;
+
+    uint8_t* entry = (uint8_t*)(config + 1);
+    for (uint16_t i = 0; i < config->entry_count; i++) {
+        if (entry[0] != MP_ENTRY_PROCESSOR) {
+            entry += MP_OTHER_SIZE;
+            continue;
+        }
+        if ((entry[3] & MP_CPU_ENABLED) && *count < MAX_CPUS) {
+            apic_ids[(*count)++] = entry[1];
+        }
+        entry += MP_PROCESSOR_SIZE;
+    }
+    return *count > 0;
+}
+
+void smp_early_init(void) {
+    for (size_t i = 0; i < MAX_CPUS; i++) {
+        cpus[i].self = &cpus[i];
+        cpus[i].id = i;
+    }
+    cpus[0].online = 1;
+
+    gdt_init();
+    gdt_load(&cpus[0]);
+}
+
+// First C code on an application processor, on the stack smp_start_ap gave it
+static void ap_main(void) {
+    // Whoever takes ap_starting first decides: smp_start_ap takes it back
+    // when it gives up on a CPU, and parks that CPU with INIT
+    cpu_t* cpu = __atomic_exchange_n(&ap_starting, NULL, __ATOMIC_ACQ_REL);
+    if (!cpu) {
+        while (1) {
+            __asm__ volatile("cli; hlt");
+        }
+    }
+    gdt_load(cpu);
+    idt_load();
+    fpu_init_cpu();
+    lapic_enable();
+    multitasking_init_cpu();
+    lapic_timer_start();
+    cpu->online = 1;
+
+    // The trampoline's identity mapping is dropped once every AP is through
+    while (!ap_release) {
+        __asm__ volatile("pause");
+    }
+    write_cr3(read_cr3());
+
+    // This context becomes the CPU's idle task
+    irq_enable();
+    idle_task();
+}
+
+static void smp_start_ap(cpu_t* cpu) {
+    void* stack = alloc_page();
+    if (!stack) {
+        terminal_writestring("Error: No stack for application processor.\n");
+        return;
+    }
+
+    uint8_t* trampoline = (uint8_t*)phys_to_virt(AP_TRAMPOLINE_ADDR);
+    *(uint32_t*)(trampoline + (ap_cr3 - ap_trampoline_start)) = read_cr3();
+    *(uint32_t*)(trampoline + (ap_stack - ap_trampoline_start)) = (uint32_t)stack + PAGE_SIZE;
+    *(uint32_t*)(trampoline + (ap_entry - ap_trampoline_start)) = (uint32_t)ap_main;
+    __atomic_store_n(&ap_starting, cpu, __ATOMIC_RELEASE);
+
+    // INIT, then up to two startup IPIs as the MP specification asks
+    lapic_send_init(cpu->apic_id);
+    timer_delay_ms(10);
+    for (int attempt = 0; attempt < 2 && !cpu->online; attempt++) {
+        lapic_send_startup(cpu->apic_id, AP_TRAMPOLINE_ADDR);
+        timer_delay_ms(1);
+    }
+    for (int waited = 0; waited < AP_STARTUP_TIMEOUT && !cpu->online; waited++) {
+        timer_delay_ms(1);
+    }
+
+    if (cpu->online) {
+        return;
+    }
+    if (__atomic_exchange_n(&ap_starting, NULL, __ATOMIC_ACQ_REL)) {
+        // It never reached ap_main. INIT stops it wherever it is, so a late
+        // start can neither run on the freed stack nor claim the next cpu_t.
+        lapic_send_init(cpu->apic_id);
+        timer_delay_ms(10);
+        free_page(stack);
+        kprintf("Error: CPU %u did not start.\n", (unsigned int)cpu->id);
+    } else {
+        // It has claimed its cpu_t and keeps the stack; it comes online late
+        kprintf("Error: CPU %u is slow to start.\n", (unsigned int)cpu->id);
+    }
+}
+
+// An NMI gets through however long the CPU has had interrupts disabled, for
+// instance while spinning on a lock the panicking CPU holds
+static void halt_handler(interrupt_frame_t* frame) {
+    (void)frame;
+    if (!halting) {
+        panic("Unexpected NMI.");
+    }
+    while (1) {
+        __asm__ volatile("cli; hlt");
+    }
+}
+
+void smp_halt_others(void) {
+    halting = 1;
+    uint32_t self = this_cpu()->id;
+    for (uint32_t id = 0; id < cpu_count; id++) {
+        if (id != self && cpus[id].online) {
+            lapic_send_nmi(cpus[id].apic_id);
+        }
+    }
+}
+
+// Needs the timer running and interrupts enabled for the startup delays
+void smp_init(void) {
+    uint32_t apic_ids[MAX_CPUS];
+    uint32_t found = 0;
+    if (!find_cpus_acpi(apic_ids, &found)) {
+        found = 0;
+        if (!find_cpus_mp(apic_ids, &found)) {
+            terminal_writestring("SMP: no ACPI MADT or MP table, using one CPU\n");
+            return;
+        }
+    }
+
+    lapic_init(lapic_phys);
+    interrupt_register(VECTOR_NMI, halt_handler);
+    lapic_enable();
+    cpus[0].apic_id = lapic_id();
+    for (uint32_t i = 0; i < found; i++) {
+        if (apic_ids[i] != cpus[0].apic_id) {
+            add_cpu(apic_ids[i]);
+        }
+    }
+
+    if (cpu_count > 1) {
+        lapic_timer_calibrate();
+
+        memcpy(phys_to_virt(AP_TRAMPOLINE_ADDR), ap_trampoline_start,
+               ap_trampoline_end - ap_trampoline_start);
+
+        paging_identity_map_low(1);
+        for (uint32_t i = 1; i < cpu_count; i++) {
+            smp_start_ap(&cpus[i]);
+        }
+        paging_identity_map_low(0);
+        ap_release = 1;
+    }
+
+    uint32_t online = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        online += cpus[i].online;
+    }
+    kprintf("SMP: %u of %u CPUs online\n", (unsigned int)online, (unsigned int)cpu_count);
+}
@@ -0,0 +1,36 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+
+#define MAX_CPUS 8
+
+struct task;
+
+// Per-CPU data. Each CPU's %gs segment starts at its own cpu_t, so
+// this_cpu() is a single load however the task migrated.
+typedef struct cpu {
+    struct cpu* self;           // %gs:0
+    uint32_t id;                // Index into cpus[]
+    uint32_t apic_id;           // Local APIC ID, used to address IPIs
+    volatile int online;        // Set by the CPU itself once it can run tasks
+    struct task* current;       // Task running on this CPU
+    struct task* idle_task;     // Runs when this CPU has nothing else to do
+    struct task* prev_task;     // Task being switched out, until schedule_tail
+    struct task* fpu_owner;     // Task whose state was last loaded into this CPU's FPU
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+extern uint32_t cpu_count;      // CPUs found, online or not
+
+static inline cpu_t* this_cpu(void) {
+    cpu_t* cpu;
+    __asm__ volatile("movl %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+void smp_early_init(void);      // Per-CPU data for the bootstrap processor
+void smp_init(void);            // Find and start the application processors
+void smp_halt_others(void);     // Stop every other online CPU for good, for panics
+
+#endif // SMP_H
@@ -0,0 +1,45 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+// Test-and-test-and-set lock. Waiters spin on a plain read so the cache line
+// stays shared until the holder releases it.
+typedef struct spinlock {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock(spinlock_t* lock) {
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (lock->locked) {
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+static inline int spin_trylock(spinlock_t* lock) {
+    return !__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+// For data also touched from interrupt handlers: a handler spinning on a lock
+// its own CPU holds would never get it
+static inline uint32_t spin_lock_irqsave(spinlock_t* lock) {
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif // SPINLOCK_H
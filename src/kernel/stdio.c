@@ -1,16 +1,62 @@
 #include "stdio.h"  // Include the header where enum is declared
+#include "paging.h"
+#include "spinlock.h"
+#include "cpu.h"
+#include "ktimer.h"
+#include "timer.h"
+#include "serial.h"
+#include "string.h"
+#include "bench.h"
 
 #include <stdarg.h>
 
 /* VGA constants */
-static const size_t VGA_WIDTH = 80;
-static const size_t VGA_HEIGHT = 25;
+#define VGA_WIDTH        80
+#define VGA_HEIGHT       25
+#define VGA_MEMORY_ROWS  (0x8000 / (VGA_WIDTH * 2))  // Rows the 32 KB text window holds
+#define VGA_CRTC_INDEX   0x3D4
+#define VGA_CRTC_DATA    0x3D5
+#define CRTC_START_HIGH  0x0C
+#define CRTC_START_LOW   0x0D
+#define CRTC_CURSOR_HIGH 0x0E
+#define CRTC_CURSOR_LOW  0x0F
+
+#define TERMINAL_FLUSH_MS 20    // Longest a deferred write stays off screen
+
+/*
+ * Output goes to a shadow copy of the screen in RAM, and terminal_flush
+ * copies only what changed into VGA memory, which is uncached and, under
+ * emulation, trapped on every store.
+ *
+ * The shadow is a ring of rows: scrolling moves shadow_top and clears one
+ * row instead of moving the screen. VGA memory has room for many screens,
+ * so a flush scrolls the hardware the same way by moving the CRTC start
+ * address, and only rewrites every row when it runs off the end of the
+ * window. Each shadow row carries the column span changed since its last
+ * flush, and the cursor registers are written once per flush.
+ *
+ * Until terminal_defer_flush is called every write is flushed at once;
+ * after that a timer flushes at most TERMINAL_FLUSH_MS after a write.
+ */
+typedef struct terminal_line {
+    uint16_t cells[VGA_WIDTH];
+    uint8_t dirty_start;        // Changed columns, dirty_start == dirty_end if none
+    uint8_t dirty_end;
+} terminal_line_t;
 
 /* Terminal state */
-size_t terminal_row;
+size_t terminal_row;            // Cursor, in screen coordinates
 size_t terminal_column;
 uint8_t terminal_color;
-uint16_t* terminal_buffer;
+uint16_t* terminal_buffer;      // VGA text memory
+static terminal_line_t shadow[VGA_HEIGHT];
+static size_t shadow_top;       // Shadow row shown at the top of the screen
+static size_t vga_start;        // VGA memory row shown at the top of the screen
+static size_t pending_scroll;   // Lines scrolled since the last flush
+static int flush_deferred;
+static int flush_armed;
+static ktimer_t flush_timer;
+static spinlock_t terminal_lock = SPINLOCK_INIT;
 
 /* VGA Helpers */
 static inline uint8_t vga_entry_color(enum vga_color fg, enum vga_color bg) {
@@ -21,12 +67,93 @@ static inline uint16_t vga_entry(unsigned char uc, uint8_t color) {
     return (uint16_t) uc | (uint16_t) color << 8;
 }
 
-/* String helpers */
-size_t strlen(const char* str) {
-    size_t len = 0;
-    while (str[len])
-        len++;
-    return len;
+static inline void crtc_write(uint8_t index, uint8_t value) {
+    outb(VGA_CRTC_INDEX, index);
+    outb(VGA_CRTC_DATA, value);
+}
+
+// Bulk copy into VGA memory, one 16-bit cell per store
+static inline void vga_copy(uint16_t* dst, const uint16_t* src, size_t count) {
+    __asm__ volatile("rep movsw" : "+D"(dst), "+S"(src), "+c"(count) : : "memory");
+}
+
+static inline void line_fill(uint16_t* dst, uint16_t value, size_t count) {
+    __asm__ volatile("rep stosw" : "+D"(dst), "+c"(count) : "a"(value) : "memory");
+}
+
+static inline terminal_line_t* screen_line(size_t y) {
+    return &shadow[(shadow_top + y) % VGA_HEIGHT];
+}
+
+static inline void mark_dirty(terminal_line_t* line, size_t start, size_t end) {
+    if (line->dirty_start == line->dirty_end) {
+        line->dirty_start = start;
+        line->dirty_end = end;
+        return;
+    }
+    if (start < line->dirty_start) line->dirty_start = start;
+    if (end > line->dirty_end) line->dirty_end = end;
+}
+
+static void clear_line(terminal_line_t* line) {
+    line_fill(line->cells, vga_entry(' ', terminal_color), VGA_WIDTH);
+    line->dirty_start = 0;
+    line->dirty_end = VGA_WIDTH;
+}
+
+static void terminal_scroll(void) {
+    shadow_top = (shadow_top + 1) % VGA_HEIGHT;
+    clear_line(screen_line(VGA_HEIGHT - 1));
+    pending_scroll++;
+}
+
+static void terminal_flush_unlocked(void) {
+    if (pending_scroll) {
+        vga_start += pending_scroll;
+        pending_scroll = 0;
+        if (vga_start + VGA_HEIGHT > VGA_MEMORY_ROWS) {
+            // Out of room below: start over at the top with a full redraw
+            vga_start = 0;
+            for (size_t y = 0; y < VGA_HEIGHT; y++) {
+                mark_dirty(&shadow[y], 0, VGA_WIDTH);
+            }
+        }
+        uint32_t offset = vga_start * VGA_WIDTH;
+        crtc_write(CRTC_START_HIGH, offset >> 8);
+        crtc_write(CRTC_START_LOW, offset & 0xFF);
+    }
+
+    for (size_t y = 0; y < VGA_HEIGHT; y++) {
+        terminal_line_t* line = screen_line(y);
+        if (line->dirty_start == line->dirty_end) {
+            continue;
+        }
+        vga_copy(terminal_buffer + (vga_start + y) * VGA_WIDTH + line->dirty_start,
+                 line->cells + line->dirty_start, line->dirty_end - line->dirty_start);
+        line->dirty_start = line->dirty_end = 0;
+    }
+
+    uint32_t cursor = (vga_start + terminal_row) * VGA_WIDTH + terminal_column;
+    crtc_write(CRTC_CURSOR_HIGH, cursor >> 8);
+    crtc_write(CRTC_CURSOR_LOW, cursor & 0xFF);
+}
+
+static void flush_timer_expired(ktimer_t* timer) {
+    (void)timer;
+    spin_lock(&terminal_lock);
+    flush_armed = 0;
+    terminal_flush_unlocked();
+    spin_unlock(&terminal_lock);
+}
+
+// End of every write, with the lock held
+static void terminal_written(void) {
+    if (!flush_deferred) {
+        terminal_flush_unlocked();
+    } else if (!flush_armed) {
+        flush_armed = 1;
+        ktimer_add(&flush_timer, timer_ms_to_ticks(TERMINAL_FLUSH_MS));
+    }
 }
 
 /* Terminal functions */
@@ -34,42 +161,98 @@ void terminal_initialize(void) {
     terminal_row = 0;
     terminal_column = 0;
     terminal_color = vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK);
-    terminal_buffer = (uint16_t*) 0xB8000;
+    terminal_buffer = (uint16_t*) phys_to_virt(0xB8000);
+    shadow_top = 0;
+    vga_start = 0;
+    pending_scroll = 0;
     for (size_t y = 0; y < VGA_HEIGHT; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            const size_t index = y * VGA_WIDTH + x;
-            terminal_buffer[index] = vga_entry(' ', terminal_color);
-        }
+        clear_line(&shadow[y]);
     }
+    crtc_write(CRTC_START_HIGH, 0);
+    crtc_write(CRTC_START_LOW, 0);
+    terminal_flush_unlocked();
+}
+
+// Needs the timer wheel; from then on writes reach the screen in batches
+void terminal_defer_flush(void) {
+    uint32_t flags = spin_lock_irqsave(&terminal_lock);
+    ktimer_init(&flush_timer, flush_timer_expired, NULL);
+    flush_deferred = 1;
+    spin_unlock_irqrestore(&terminal_lock, flags);
+}
+
+// Panics only, with the other CPUs halted. The lock may be held by one of
+// them or by the code that failed, so it is broken rather than waited for,
+// and writes reach the screen and the UART at once from here on.
+void terminal_panic(void) {
+    serial_panic();
+    spinlock_t unlocked = SPINLOCK_INIT;
+    terminal_lock = unlocked;
+    flush_deferred = 0;
+}
+
+void terminal_flush(void) {
+    uint32_t flags = spin_lock_irqsave(&terminal_lock);
+    terminal_flush_unlocked();
+    spin_unlock_irqrestore(&terminal_lock, flags);
 }
 
 void terminal_setcolor(uint8_t color) {
     terminal_color = color;
 }
 
+static void terminal_putentryat_unlocked(char c, uint8_t color, size_t x, size_t y) {
+    terminal_line_t* line = screen_line(y);
+    line->cells[x] = vga_entry(c, color);
+    mark_dirty(line, x, x + 1);
+}
+
 void terminal_putentryat(char c, uint8_t color, size_t x, size_t y) {
-    const size_t index = y * VGA_WIDTH + x;
-    terminal_buffer[index] = vga_entry(c, color);
+    uint32_t flags = spin_lock_irqsave(&terminal_lock);
+    terminal_putentryat_unlocked(c, color, x, y);
+    terminal_written();
+    spin_unlock_irqrestore(&terminal_lock, flags);
 }
 
-void terminal_putchar(char c) {
-    if (c == '\n') {
+static void terminal_newline(void) {
+    terminal_column = 0;
+    if (terminal_row + 1 == VGA_HEIGHT) {
+        terminal_scroll();
+    } else {
         terminal_row++;
-        terminal_column = 0;
+    }
+}
+
+static void terminal_putchar_unlocked(char c) {
+    if (c == '\n') {
+        terminal_newline();
         return;
     }
 
-    terminal_putentryat(c, terminal_color, terminal_column, terminal_row);
+    terminal_putentryat_unlocked(c, terminal_color, terminal_column, terminal_row);
     if (++terminal_column == VGA_WIDTH) {
-        terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT)
-            terminal_row = 0;  // Wrap around
+        terminal_newline();
     }
 }
 
+void terminal_putchar(char c) {
+    serial_write(&c, 1);
+    uint32_t flags = spin_lock_irqsave(&terminal_lock);
+    terminal_putchar_unlocked(c);
+    terminal_written();
+    spin_unlock_irqrestore(&terminal_lock, flags);
+}
+
+// Output goes to the serial log as well. A whole string goes out under one
+// lock, and into the log as one piece, so lines from different CPUs do not
+// interleave character by character
 void terminal_write(const char* data, size_t size) {
+    serial_write(data, size);
+    uint32_t flags = spin_lock_irqsave(&terminal_lock);
     for (size_t i = 0; i < size; i++)
-        terminal_putchar(data[i]);
+        terminal_putchar_unlocked(data[i]);
+    terminal_written();
+    spin_unlock_irqrestore(&terminal_lock, flags);
 }
 
 void terminal_writestring(const char* data) {
@@ -78,130 +261,428 @@ void terminal_writestring(const char* data) {
 
 /* New printf-like functionality */
 
-/* Write a single digit */
-void terminal_write_digit(int num) {
-    terminal_putchar(num + '0');
+/*
+ * kvsnprintf is the one formatting engine; everything else here is a thin
+ * wrapper around it. It supports the C99 flags - 0 + space and #, width and
+ * precision (also as *), the length modifiers hh h l ll z t j and the
+ * conversions d i u x X o p c s and %%. It never allocates.
+ *
+ * Output goes through a sink: either a caller's buffer, truncated like
+ * snprintf, or a stack buffer that is handed to terminal_write whenever it
+ * fills up, so a normal line reaches the console in one write.
+ */
+#define KPRINTF_BUFFER 256
+
+typedef struct format_sink {
+    char* buffer;
+    size_t size;
+    size_t used;
+    size_t total;       // Characters produced, including any cut off
+    int console;        // Flush to the terminal when full instead of truncating
+} format_sink_t;
+
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static void sink_put(format_sink_t* sink, const char* data, size_t count) {
+    sink->total += count;
+    while (count) {
+        if (sink->used == sink->size) {
+            if (!sink->console) {
+                return;
+            }
+            terminal_write(sink->buffer, sink->used);
+            sink->used = 0;
+        }
+        size_t chunk = sink->size - sink->used;
+        if (chunk > count) chunk = count;
+        memcpy(sink->buffer + sink->used, data, chunk);
+        sink->used += chunk;
+        data += chunk;
+        count -= chunk;
+    }
 }
 
-/* Write an integer */
-void terminal_write_int(int num) {
-    if (num == 0) {
-        terminal_putchar('0');
-        return;
+static void sink_fill(format_sink_t* sink, char c, int count) {
+    char run[16];
+    memset(run, c, sizeof(run));
+    while (count > 0) {
+        int chunk = count < 16 ? count : 16;
+        sink_put(sink, run, chunk);
+        count -= chunk;
     }
+}
 
-    int divisor = 1000000000; // Max int is 10 digits
-    int leading_zero = 1;
+// Decimal digits of value, written backwards ending at `end`, two at a time
+static char* format_decimal32(uint32_t value, char* end) {
+    while (value >= 100) {
+        const char* pair = &digit_pairs[(value % 100) * 2];
+        value /= 100;
+        *--end = pair[1];
+        *--end = pair[0];
+    }
+    if (value >= 10) {
+        *--end = digit_pairs[value * 2 + 1];
+        *--end = digit_pairs[value * 2];
+    } else {
+        *--end = '0' + value;
+    }
+    return end;
+}
 
-    while (divisor > 0) {
-        int digit = num / divisor;
-        if (digit != 0 || !leading_zero) {
-            terminal_write_digit(digit);
-            leading_zero = 0;
+static char* format_decimal(uint64_t value, char* end) {
+    while (value >> 32) {
+        char* chunk_end = end;
+        end = format_decimal32(div64_32(&value, 1000000000), end);
+        while (end > chunk_end - 9) {
+            *--end = '0';
         }
-        num %= divisor;
-        divisor /= 10;
     }
+    return format_decimal32((uint32_t)value, end);
 }
 
-/* Write a string */
-void terminal_write_string(const char* str) {
-    while (*str != '\0') {
-        terminal_putchar(*str);
-        str++;
-    }
+// Base 8 or 16
+static char* format_power_of_two(uint64_t value, int shift, const char* digits, char* end) {
+    uint32_t mask = (1u << shift) - 1;
+    do {
+        *--end = digits[value & mask];
+        value >>= shift;
+    } while (value);
+    return end;
 }
 
-void terminal_write_hex(uintptr_t num) {
-    const char hex_chars[] = "0123456789ABCDEF";  // Hexadecimal character lookup
-    char hex_buffer[9];  // Enough space for a 32-bit value (8 hex digits + null terminator)
-    
-    // Handle the case of 0
-    if (num == 0) {
-        terminal_putchar('0');
-        return;
+enum {
+    FLAG_LEFT  = 1,
+    FLAG_ZERO  = 2,
+    FLAG_PLUS  = 4,
+    FLAG_SPACE = 8,
+    FLAG_ALT   = 16,
+};
+
+static void format_number(format_sink_t* sink, uint64_t value, int negative, char conversion,
+                          int flags, int width, int precision) {
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* start;
+    char prefix[2];
+    int prefix_length = 0;
+
+    if (precision == 0 && value == 0) {
+        start = end;
+    } else if (conversion == 'x' || conversion == 'p') {
+        start = format_power_of_two(value, 4, "0123456789abcdef", end);
+    } else if (conversion == 'X') {
+        start = format_power_of_two(value, 4, "0123456789ABCDEF", end);
+    } else if (conversion == 'o') {
+        start = format_power_of_two(value, 3, "01234567", end);
+    } else {
+        start = format_decimal(value, end);
+    }
+    int length = end - start;
+
+    if (negative) {
+        prefix[prefix_length++] = '-';
+    } else if (flags & FLAG_PLUS) {
+        prefix[prefix_length++] = '+';
+    } else if (flags & FLAG_SPACE) {
+        prefix[prefix_length++] = ' ';
+    }
+    if ((flags & FLAG_ALT) && value != 0 && (conversion == 'x' || conversion == 'X' || conversion == 'p')) {
+        prefix[prefix_length++] = '0';
+        prefix[prefix_length++] = conversion == 'X' ? 'X' : 'x';
+    } else if ((flags & FLAG_ALT) && conversion == 'o' && precision <= length) {
+        precision = length + 1;     // Forces a leading zero
     }
 
-    int i = 7;  // Start from the last position of the buffer (for 32-bit, the last hex digit)
-    hex_buffer[8] = '\0';  // Null-terminate the string
-
-    // Convert the number to hexadecimal and store it in hex_buffer
-    while (num > 0) {
-        hex_buffer[i] = hex_chars[num & 0xF];  // Get the last 4 bits and map to hex char
-        num >>= 4;  // Shift the number 4 bits to the right
-        i--;
+    int zeros = precision > length ? precision - length : 0;
+    int padding = width - prefix_length - zeros - length;
+    if ((flags & FLAG_ZERO) && !(flags & FLAG_LEFT) && precision < 0 && padding > 0) {
+        zeros += padding;
+        padding = 0;
     }
 
-    // Output the hexadecimal string
-    terminal_writestring(&hex_buffer[i + 1]);
+    if (!(flags & FLAG_LEFT)) sink_fill(sink, ' ', padding);
+    sink_put(sink, prefix, prefix_length);
+    sink_fill(sink, '0', zeros);
+    sink_put(sink, start, length);
+    if (flags & FLAG_LEFT) sink_fill(sink, ' ', padding);
 }
 
-/* Simple printf implementation */
-void terminal_printf(const char* format, ...) {
-    va_list args;
-    va_start(args, format);
+static void format_string(format_sink_t* sink, const char* str, int flags, int width, int precision) {
+    if (!str) {
+        str = "(null)";
+    }
+    int length = 0;
+    while ((precision < 0 || length < precision) && str[length]) {
+        length++;
+    }
+    if (!(flags & FLAG_LEFT)) sink_fill(sink, ' ', width - length);
+    sink_put(sink, str, length);
+    if (flags & FLAG_LEFT) sink_fill(sink, ' ', width - length);
+}
+
+static void format(format_sink_t* sink, const char* fmt, va_list args) {
+    while (*fmt) {
+        // Copy literal text in one go
+        const char* literal = fmt;
+        while (*fmt && *fmt != '%') {
+            fmt++;
+        }
+        sink_put(sink, literal, fmt - literal);
+        if (!*fmt) {
+            break;
+        }
+        fmt++;
+
+        int flags = 0;
+        for (;; fmt++) {
+            if (*fmt == '-') flags |= FLAG_LEFT;
+            else if (*fmt == '0') flags |= FLAG_ZERO;
+            else if (*fmt == '+') flags |= FLAG_PLUS;
+            else if (*fmt == ' ') flags |= FLAG_SPACE;
+            else if (*fmt == '#') flags |= FLAG_ALT;
+            else break;
+        }
 
-    while (*format) {
-        if (*format == '%') {
-            format++;
-            if (*format == 'd') {
-                int num = va_arg(args, int);
-                terminal_write_int(num);
-            } else if (*format == 's') {
-                char* str = va_arg(args, char*);
-                terminal_write_string(str);
-            } else if (*format == 'c') {
-                char c = (char) va_arg(args, int);
-                terminal_putchar(c);
+        int width = 0;
+        if (*fmt == '*') {
+            width = va_arg(args, int);
+            if (width < 0) {
+                flags |= FLAG_LEFT;
+                width = -width;
             }
+            fmt++;
         } else {
-            terminal_putchar(*format);
+            while (*fmt >= '0' && *fmt <= '9') {
+                width = width * 10 + (*fmt++ - '0');
+            }
+        }
+
+        int precision = -1;
+        if (*fmt == '.') {
+            fmt++;
+            precision = 0;
+            if (*fmt == '*') {
+                precision = va_arg(args, int);
+                fmt++;
+            } else {
+                while (*fmt >= '0' && *fmt <= '9') {
+                    precision = precision * 10 + (*fmt++ - '0');
+                }
+            }
+        }
+
+        // int, long, size_t and ptrdiff_t are all 32 bits here
+        int is_long_long = 0;
+        int narrow = 0;     // 1 for h, 2 for hh
+        while (*fmt == 'l' || *fmt == 'h' || *fmt == 'z' || *fmt == 't' || *fmt == 'j') {
+            if (*fmt == 'l' && fmt[1] == 'l') {
+                is_long_long = 1;
+                fmt++;
+            } else if (*fmt == 'j') {
+                is_long_long = 1;
+            } else if (*fmt == 'h') {
+                narrow++;
+            }
+            fmt++;
+        }
+
+        char conversion = *fmt;
+        if (!conversion) {
+            break;
+        }
+        fmt++;
+
+        switch (conversion) {
+        case 'd':
+        case 'i': {
+            int64_t value = is_long_long ? va_arg(args, int64_t) : va_arg(args, int);
+            if (narrow == 1) value = (short)value;
+            if (narrow >= 2) value = (signed char)value;
+            int negative = value < 0;
+            format_number(sink, negative ? -(uint64_t)value : (uint64_t)value, negative,
+                          'd', flags, width, precision);
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o': {
+            uint64_t value = is_long_long ? va_arg(args, uint64_t) : va_arg(args, unsigned int);
+            if (narrow == 1) value = (unsigned short)value;
+            if (narrow >= 2) value = (unsigned char)value;
+            format_number(sink, value, 0, conversion, flags, width, precision);
+            break;
         }
-        format++;
+        case 'p':
+            format_number(sink, (uintptr_t)va_arg(args, void*), 0, 'p',
+                          flags | FLAG_ALT, width, precision < 0 ? 8 : precision);
+            break;
+        case 'c': {
+            char c = (char)va_arg(args, int);
+            if (!(flags & FLAG_LEFT)) sink_fill(sink, ' ', width - 1);
+            sink_put(sink, &c, 1);
+            if (flags & FLAG_LEFT) sink_fill(sink, ' ', width - 1);
+            break;
+        }
+        case 's':
+            format_string(sink, va_arg(args, const char*), flags, width, precision);
+            break;
+        case '%':
+            sink_put(sink, "%", 1);
+            break;
+        default:
+            // Unknown conversion: print it as written
+            sink_put(sink, "%", 1);
+            sink_put(sink, &conversion, 1);
+            break;
+        }
+    }
+}
+
+int kvsnprintf(char* buffer, size_t size, const char* fmt, va_list args) {
+    format_sink_t sink = { buffer, size ? size - 1 : 0, 0, 0, 0 };
+    format(&sink, fmt, args);
+    if (size) {
+        buffer[sink.used] = '\0';
     }
+    return sink.total;
+}
 
+int ksnprintf(char* buffer, size_t size, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int length = kvsnprintf(buffer, size, fmt, args);
     va_end(args);
+    return length;
 }
 
+int kvprintf(const char* fmt, va_list args) {
+    char buffer[KPRINTF_BUFFER];
+    format_sink_t sink = { buffer, sizeof(buffer), 0, 0, 1 };
+    format(&sink, fmt, args);
+    terminal_write(buffer, sink.used);
+    return sink.total;
+}
+
+int kprintf(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int length = kvprintf(fmt, args);
+    va_end(args);
+    return length;
+}
+
+/* Write an integer */
+void terminal_write_int(int num) {
+    kprintf("%d", num);
+}
+
+/* Write a string */
+void terminal_write_string(const char* str) {
+    terminal_writestring(str);
+}
+
+void terminal_write_hex(uintptr_t num) {
+    kprintf("%X", (unsigned int)num);
+}
+
+void terminal_printf(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    kvprintf(format, args);
+    va_end(args);
+}
+
+// Bases 10, 8 and 16 format like %d, %o and %x; others treat num as unsigned
 void itoa(int num, char* str, int base) {
-    int i = 0;
-    int isNegative = 0;
+    char digits[33];
+    char* end = digits + sizeof(digits);
+    char* start;
 
-    // Handle 0 explicitly, otherwise empty string is printed
-    if (num == 0) {
-        str[i++] = '0';
-        str[i] = '\0';
+    if (base == 10) {
+        ksnprintf(str, 12, "%d", num);
         return;
+    } else if (base == 8) {
+        start = format_power_of_two((unsigned int)num, 3, "01234567", end);
+    } else if (base == 16) {
+        start = format_power_of_two((unsigned int)num, 4, "0123456789abcdef", end);
+    } else {
+        uint32_t value = num;
+        start = end;
+        do {
+            uint32_t digit = value % base;
+            *--start = digit > 9 ? digit - 10 + 'a' : digit + '0';
+            value /= base;
+        } while (value);
+    }
+    while (start < end) {
+        *str++ = *start++;
     }
+    *str = '\0';
+}
 
-    // Handle negative numbers only if base is 10
-    if (num < 0 && base == 10) {
-        isNegative = 1;
-        num = -num;
+/*
+ * The same status line printed piecewise, one terminal call per field the
+ * way callers used to, and with a single kprintf, which formats into a stack
+ * buffer and writes it in one go. Then the cost of formatting alone.
+ */
+#define KPRINTF_BENCH_LINES       8
+#define KPRINTF_BENCH_ITERATIONS  1000
+
+void kprintf_bench(void) {
+    unsigned int allocated = 123456, free_bytes = 7890123, blocks = 42;
+    int delta = -317;
+    uintptr_t address = 0xC0104000;
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < KPRINTF_BENCH_LINES; i++) {
+        terminal_writestring("Heap: ");
+        terminal_write_int(allocated);
+        terminal_writestring(" used, ");
+        terminal_write_int(free_bytes);
+        terminal_writestring(" free, ");
+        terminal_write_int(blocks);
+        terminal_writestring(" blocks, delta ");
+        terminal_write_int(delta);
+        terminal_writestring(" at 0x");
+        terminal_write_hex(address);
+        terminal_writestring("\n");
     }
+    unsigned int piecewise = (uint32_t)(rdtsc() - start) / KPRINTF_BENCH_LINES;
 
-    // Process each digit
-    while (num != 0) {
-        int rem = num % base;
-        str[i++] = (rem > 9) ? (rem - 10) + 'a' : rem + '0'; // Convert to character
-        num = num / base;
+    start = rdtsc();
+    for (int i = 0; i < KPRINTF_BENCH_LINES; i++) {
+        kprintf("Heap: %u used, %u free, %u blocks, delta %d at %p\n",
+                allocated, free_bytes, blocks, delta, (void*)address);
     }
+    unsigned int formatted = (uint32_t)(rdtsc() - start) / KPRINTF_BENCH_LINES;
 
-    // Append negative sign for negative numbers
-    if (isNegative) {
-        str[i++] = '-';
+    char line[KPRINTF_BUFFER];
+    start = rdtsc();
+    for (int i = 0; i < KPRINTF_BENCH_ITERATIONS; i++) {
+        ksnprintf(line, sizeof(line), "Heap: %u used, %u free, %u blocks, delta %d at %p\n",
+                  allocated + i, free_bytes, blocks, delta, (void*)address);
     }
+    unsigned int format_only = (uint32_t)(rdtsc() - start) / KPRINTF_BENCH_ITERATIONS;
 
-    str[i] = '\0';  // Null-terminate string
+    kprintf("kprintf: %u cycles per line, %u piecewise, %u to format only\n",
+            formatted, piecewise, format_only);
+}
 
-    // Reverse the string
-    int start = 0;
-    int end = i - 1;
-    while (start < end) {
-        char temp = str[start];
-        str[start] = str[end];
-        str[end] = temp;
-        start++;
-        end--;
+BENCH(ksnprintf_line, 16) {
+    char line[KPRINTF_BUFFER];
+    for (uint32_t i = 0; i < iterations; i++) {
+        ksnprintf(line, sizeof(line), "Heap: %u used, %u free, %u blocks, delta %d at %p\n",
+                  (unsigned int)i, 7890123u, 42u, -317, (void*)line);
     }
-}
\ No newline at end of file
+}
+
+// Few samples: each one is a line on the screen and in the serial log
+BENCH_SAMPLED(console_line, 1, 32) {
+    for (uint32_t i = 0; i < iterations; i++) {
+        terminal_writestring("console_line benchmark: 0123456789abcdefghijklmnopqrstuvwxyz\n");
+    }
+}
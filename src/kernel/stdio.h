@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdarg.h>
 
 /* VGA Colors - defined once in the header */
 enum vga_color {
@@ -30,12 +31,24 @@ void terminal_setcolor(uint8_t color);
 void terminal_putchar(char c);
 void terminal_write(const char* data, size_t size);
 void terminal_writestring(const char* data);
+void terminal_flush(void);         // Copy pending output to the screen now
+void terminal_defer_flush(void);   // Batch screen updates on a timer; needs the timer wheel
+void terminal_panic(void);         // Take the console over without waiting on its lock
 
 /* New printf-like functionality */
+// printf-style formatting without allocation; see kvsnprintf in stdio.c for
+// what is supported. The sn variants return the length the output would
+// have had, like snprintf. kprintf writes each line to the console at once.
+int kvsnprintf(char* buffer, size_t size, const char* fmt, va_list args);
+int ksnprintf(char* buffer, size_t size, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+int kvprintf(const char* fmt, va_list args);
+int kprintf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void kprintf_bench(void);               // Cycles per line: kprintf against piecewise output
+
 void terminal_write_int(int num);
 void terminal_write_string(const char* str);
 void terminal_write_hex(uintptr_t num);
-void terminal_printf(const char* format, ...);
+void terminal_printf(const char* format, ...) __attribute__((format(printf, 1, 2)));
 void itoa(int num, char* str, int base);
 
 
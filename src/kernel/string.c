@@ -0,0 +1,286 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "string.h"
+#include "cpu.h"
+#include "pmm.h"
+#include "memory.h"
+#include "paging.h"
+#include "stdio.h"
+
+/*
+ * Copies and fills below SMALL_SIZE bytes are plain loops: the string
+ * instructions have a startup cost of a few dozen cycles that a handful of
+ * moves does not make up for. Bigger ones align the destination and use
+ * rep movsl/stosl, or on CPUs with enhanced rep movsb (ERMS) rep movsb from
+ * ERMS_SIZE up, which microcode turns into full cache-line moves.
+ *
+ * No SSE: copies run in interrupt handlers too, and fpu.h forbids FPU use
+ * there, as the interrupted task's vector state is not saved; the Makefile
+ * builds the kernel with -mno-sse to hold to that. The string instructions
+ * already run at cache-line speed.
+ *
+ * This file is built with -fno-tree-loop-distribute-patterns, or GCC would
+ * turn the small loops back into calls to memcpy and memset.
+ */
+#define SMALL_SIZE  32
+#define ERMS_SIZE   512
+
+#define CPUID_EXTENDED_FEATURES 7
+#define CPUID_EBX_ERMS          (1 << 9)
+
+// Word loads in strlen and memchr may read past the end of the string, but
+// never past the aligned word it ends in, so never onto another page
+typedef uint32_t __attribute__((may_alias)) word_t;
+
+#define ONES   0x01010101u
+#define HIGHS  0x80808080u
+#define HAS_ZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+
+static int erms;
+
+void string_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= CPUID_EXTENDED_FEATURES) {
+        cpuid(CPUID_EXTENDED_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+        erms = (ebx & CPUID_EBX_ERMS) != 0;
+    }
+}
+
+static inline void rep_movsb(void* dest, const void* src, size_t n) {
+    __asm__ volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void rep_stosb(void* dest, uint8_t c, size_t n) {
+    __asm__ volatile("rep stosb" : "+D"(dest), "+c"(n) : "a"(c) : "memory");
+}
+
+void* memcpy(void* restrict dest, const void* restrict src, size_t n) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+
+    if (n < SMALL_SIZE) {
+        for (; n >= 4; n -= 4, d += 4, s += 4) {
+            *(word_t*)d = *(const word_t*)s;
+        }
+        while (n--) {
+            *d++ = *s++;
+        }
+        return dest;
+    }
+    if (erms && n >= ERMS_SIZE) {
+        rep_movsb(d, s, n);
+        return dest;
+    }
+
+    size_t head = -(uintptr_t)d & 3;
+    size_t words = (n - head) >> 2;
+    size_t tail = (n - head) & 3;
+    __asm__ volatile("rep movsb\n\t"
+                     "mov %3, %%ecx\n\t"
+                     "rep movsl\n\t"
+                     "mov %4, %%ecx\n\t"
+                     "rep movsb"
+                     : "+D"(d), "+S"(s), "+c"(head)
+                     : "rm"(words), "rm"(tail)
+                     : "memory");
+    return dest;
+}
+
+// Forwards whenever that cannot overwrite source bytes before reading them,
+// otherwise backwards with the direction flag set
+void* memmove(void* dest, const void* src, size_t n) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+
+    if (d == s || n == 0) {
+        return dest;
+    }
+    if (d < s || d >= s + n) {
+        if (n < SMALL_SIZE) {
+            while (n--) {
+                *d++ = *s++;
+            }
+            return dest;
+        }
+        return memcpy(dest, src, n);
+    }
+
+    // Tail bytes one at a time, then whole words from the top down
+    size_t words = n >> 2;
+    for (size_t i = n; i > words * 4; i--) {
+        d[i - 1] = s[i - 1];
+    }
+    if (words) {
+        const uint8_t* s_last = s + words * 4 - 4;
+        uint8_t* d_last = d + words * 4 - 4;
+        __asm__ volatile("std\n\t"
+                         "rep movsl\n\t"
+                         "cld"
+                         : "+D"(d_last), "+S"(s_last), "+c"(words)
+                         :
+                         : "memory");
+    }
+    return dest;
+}
+
+void* memset(void* dest, int c, size_t n) {
+    uint8_t* d = dest;
+    uint32_t word = (uint8_t)c * ONES;
+
+    if (n < SMALL_SIZE) {
+        for (; n >= 4; n -= 4, d += 4) {
+            *(word_t*)d = word;
+        }
+        while (n--) {
+            *d++ = (uint8_t)c;
+        }
+        return dest;
+    }
+    if (erms && n >= ERMS_SIZE) {
+        rep_stosb(d, (uint8_t)c, n);
+        return dest;
+    }
+
+    size_t head = -(uintptr_t)d & 3;
+    size_t words = (n - head) >> 2;
+    size_t tail = (n - head) & 3;
+    __asm__ volatile("rep stosb\n\t"
+                     "mov %2, %%ecx\n\t"
+                     "rep stosl\n\t"
+                     "mov %3, %%ecx\n\t"
+                     "rep stosb"
+                     : "+D"(d), "+c"(head)
+                     : "rm"(words), "rm"(tail), "a"(word)
+                     : "memory");
+    return dest;
+}
+
+int memcmp(const void* a, const void* b, size_t n) {
+    const uint8_t* x = a;
+    const uint8_t* y = b;
+
+    // Skip equal words, then find the differing byte
+    for (; n >= 4 && *(const word_t*)x == *(const word_t*)y; n -= 4, x += 4, y += 4) {
+    }
+    for (; n; n--, x++, y++) {
+        if (*x != *y) {
+            return *x - *y;
+        }
+    }
+    return 0;
+}
+
+void* memchr(const void* s, int c, size_t n) {
+    const uint8_t* p = s;
+    uint8_t byte = (uint8_t)c;
+
+    for (; n && ((uintptr_t)p & 3); n--, p++) {
+        if (*p == byte) {
+            return (void*)p;
+        }
+    }
+    // A word holding the byte has a zero byte once xored with it in every lane
+    uint32_t pattern = byte * ONES;
+    for (; n >= 4; n -= 4, p += 4) {
+        uint32_t word = *(const word_t*)p ^ pattern;
+        if (HAS_ZERO(word)) {
+            break;
+        }
+    }
+    for (; n; n--, p++) {
+        if (*p == byte) {
+            return (void*)p;
+        }
+    }
+    return NULL;
+}
+
+size_t strlen(const char* str) {
+    const char* p = str;
+
+    for (; (uintptr_t)p & 3; p++) {
+        if (!*p) {
+            return p - str;
+        }
+    }
+    while (!HAS_ZERO(*(const word_t*)p)) {
+        p += 4;
+    }
+    while (*p) {
+        p++;
+    }
+    return p - str;
+}
+
+/*
+ * Copy and fill bandwidth from 8 B to 1 MB, each size repeated until
+ * STRING_BENCH_BYTES have moved, against a byte loop. Up to the cache sizes
+ * this measures the instructions, beyond them memory.
+ */
+#define STRING_BENCH_ORDER  8           // 1 MB buffers, 2^8 pages
+#define STRING_BENCH_MAX    (PAGE_SIZE << STRING_BENCH_ORDER)
+#define STRING_BENCH_BYTES  (4 * 1024 * 1024)
+
+static const size_t bench_sizes[] = { 8, 64, 512, 4096, 32768, 262144, STRING_BENCH_MAX };
+
+static void byte_copy(uint8_t* dest, const uint8_t* src, size_t n) {
+    while (n--) {
+        *dest++ = *src++;
+    }
+}
+
+// Bytes per 1024 cycles
+static unsigned int bench_rate(uint64_t cycles) {
+    return (unsigned int)(((uint64_t)STRING_BENCH_BYTES << 10) / (cycles ? cycles : 1));
+}
+
+void string_bench(void) {
+    uintptr_t src_frame = pmm_alloc(STRING_BENCH_ORDER);
+    uintptr_t dest_frame = pmm_alloc(STRING_BENCH_ORDER);
+    if (!src_frame || !dest_frame) {
+        terminal_writestring("Error: No memory for the string benchmark.\n");
+        if (src_frame) pmm_free(src_frame, STRING_BENCH_ORDER);
+        if (dest_frame) pmm_free(dest_frame, STRING_BENCH_ORDER);
+        return;
+    }
+    uint8_t* src = phys_to_virt(src_frame);
+    uint8_t* dest = phys_to_virt(dest_frame);
+    memset(src, 0x5A, STRING_BENCH_MAX);
+
+    kprintf("String bandwidth, bytes per 1024 cycles (%s):\n", erms ? "ERMS" : "rep movsl");
+    kprintf("%8s %10s %10s %10s\n", "size", "memcpy", "memset", "byte loop");
+    for (size_t i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+        size_t size = bench_sizes[i];
+        uint32_t rounds = STRING_BENCH_BYTES / size;
+        uint32_t flags = irq_save();
+
+        uint64_t start = rdtsc();
+        for (uint32_t round = 0; round < rounds; round++) {
+            memcpy(dest, src, size);
+            __asm__ volatile("" : : : "memory");
+        }
+        uint64_t copy = rdtsc() - start;
+
+        start = rdtsc();
+        for (uint32_t round = 0; round < rounds; round++) {
+            memset(dest, round, size);
+            __asm__ volatile("" : : : "memory");
+        }
+        uint64_t fill = rdtsc() - start;
+
+        start = rdtsc();
+        for (uint32_t round = 0; round < rounds; round++) {
+            byte_copy(dest, src, size);
+            __asm__ volatile("" : : : "memory");
+        }
+        uint64_t bytes = rdtsc() - start;
+
+        irq_restore(flags);
+        kprintf("%8zu %10u %10u %10u\n", size, bench_rate(copy), bench_rate(fill), bench_rate(bytes));
+    }
+
+    pmm_free(src_frame, STRING_BENCH_ORDER);
+    pmm_free(dest_frame, STRING_BENCH_ORDER);
+}
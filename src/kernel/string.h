@@ -0,0 +1,19 @@
+#ifndef STRING_H
+#define STRING_H
+
+#include <stddef.h>
+
+// The freestanding C library subset the kernel uses. GCC also emits calls to
+// memcpy, memmove, memset and memcmp on its own, for struct copies and
+// initialisers, so these must exist under exactly these names.
+void* memcpy(void* restrict dest, const void* restrict src, size_t n);
+void* memmove(void* dest, const void* src, size_t n);
+void* memset(void* dest, int c, size_t n);
+int memcmp(const void* a, const void* b, size_t n);
+void* memchr(const void* s, int c, size_t n);
+size_t strlen(const char* str);
+
+void string_init(void);         // Pick the bulk copy method for this CPU
+void string_bench(void);        // memcpy/memset bandwidth from 8 B to 1 MB
+
+#endif // STRING_H
@@ -0,0 +1,49 @@
+/* Offset of task_t.stack_pointer, checked by a static assertion in multitasking.c */
+.set TASK_STACK_POINTER, 4
+
+/*
+ * void switch_to(task_t* prev, task_t* next)
+ *
+ * Everything the C calling convention lets a callee clobber (EAX, ECX, EDX,
+ * flags) is already dead at the call site, so only EBP, EBX, ESI and EDI are
+ * pushed on the outgoing stack. The return address is left there by the call
+ * itself; swapping ESP is enough to resume the other task where it called
+ * switch_to, or in task_trampoline if it has never run.
+ */
+.section .text
+.global switch_to
+.type switch_to, @function
+switch_to:
+	movl 4(%esp), %eax              /* prev */
+	movl 8(%esp), %edx              /* next */
+
+	pushl %ebp
+	pushl %ebx
+	pushl %esi
+	pushl %edi
+	movl %esp, TASK_STACK_POINTER(%eax)
+
+	movl TASK_STACK_POINTER(%edx), %esp
+	popl %edi
+	popl %esi
+	popl %ebx
+	popl %ebp
+	ret
+.size switch_to, . - switch_to
+
+/*
+ * First code run by a new task. create_task builds a stack that makes
+ * switch_to "return" here with the entry point in EBX. It finishes the
+ * switch like schedule would have, then enables interrupts: switches happen
+ * with interrupts disabled, and a new task has no interrupt frame to IRET
+ * through that would re-enable them. A task that returns from its entry
+ * point exits.
+ */
+.global task_trampoline
+.type task_trampoline, @function
+task_trampoline:
+	call schedule_tail
+	sti
+	call *%ebx
+	call task_exit
+.size task_trampoline, . - task_trampoline
@@ -0,0 +1,334 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sync.h"
+#include "cpu.h"
+#include "stdio.h"
+#include "timer.h"
+#include "bench.h"
+
+#define MUTEX_WAITERS     0x1       // Low bit of mutex_t.owner
+#define MUTEX_SPIN_LIMIT  1000      // Pause loops to wait for an owner running elsewhere
+
+static void lock_stats_init(lock_stats_t* stats, const char* name) {
+    stats->name = name;
+    stats->acquisitions = 0;
+    stats->contended = 0;
+    stats->spin_acquired = 0;
+    stats->handoffs = 0;
+    stats->handoff_cycles = 0;
+    stats->handoff_samples = 0;
+    stats->max_handoff_cycles = 0;
+}
+
+// Called by the waiter once it runs; the caller keeps the stats consistent
+static void lock_stats_handoff(lock_stats_t* stats, uint64_t release_time) {
+    uint32_t cycles = (uint32_t)(rdtsc() - release_time);
+    stats->handoffs++;
+    if (stats->handoff_cycles > 0x80000000u - cycles) {
+        stats->handoff_cycles /= 2;
+        stats->handoff_samples /= 2;
+    }
+    stats->handoff_cycles += cycles;
+    stats->handoff_samples++;
+    if (cycles > stats->max_handoff_cycles) {
+        stats->max_handoff_cycles = cycles;
+    }
+}
+
+void lock_stats_print(const lock_stats_t* stats) {
+    char handoff[48] = "";
+    if (stats->handoff_samples) {
+        ksnprintf(handoff, sizeof(handoff), " (%u cycles average, %u max)",
+                  (unsigned int)(stats->handoff_cycles / stats->handoff_samples),
+                  (unsigned int)stats->max_handoff_cycles);
+    }
+    kprintf("%s: %u acquired, %u contended, %u by spinning, %u handed off%s\n",
+            stats->name ? stats->name : "lock", (unsigned int)stats->acquisitions,
+            (unsigned int)stats->contended, (unsigned int)stats->spin_acquired,
+            (unsigned int)stats->handoffs, handoff);
+}
+
+/*
+ * Mutexes. owner holds the owning task, with MUTEX_WAITERS set while tasks
+ * sleep on the wait queue; it is only set or cleared with the queue lock
+ * held. Uncontended lock and unlock are a single compare-and-swap each.
+ *
+ * A contended locker spins as long as the owner is running on another CPU,
+ * since it is then likely to release the lock soon, and sleeps otherwise.
+ * Unlocking with waiters hands the mutex straight to the first one.
+ */
+void mutex_init(mutex_t* mutex, const char* name) {
+    mutex->owner = 0;
+    mutex->waiters = (wait_queue_t)WAIT_QUEUE_INIT;
+    mutex->release_time = 0;
+    lock_stats_init(&mutex->stats, name);
+}
+
+static int mutex_try_acquire(mutex_t* mutex, task_t* self) {
+    uintptr_t expected = 0;
+    return __atomic_compare_exchange_n(&mutex->owner, &expected, (uintptr_t)self, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static int mutex_spin(mutex_t* mutex, task_t* self) {
+    for (int i = 0; i < MUTEX_SPIN_LIMIT; i++) {
+        uintptr_t owner = mutex->owner;
+        if (!owner) {
+            if (mutex_try_acquire(mutex, self)) {
+                return 1;
+            }
+            continue;
+        }
+        // A sleeping or preempted owner will not let go any time soon, and
+        // queued waiters get the mutex before any spinner could
+        if ((owner & MUTEX_WAITERS) || !((task_t*)owner)->on_cpu) {
+            return 0;
+        }
+        __asm__ volatile("pause");
+    }
+    return 0;
+}
+
+int mutex_trylock(mutex_t* mutex) {
+    if (!mutex_try_acquire(mutex, current_task)) {
+        return 0;
+    }
+    mutex->stats.acquisitions++;
+    return 1;
+}
+
+void mutex_lock(mutex_t* mutex) {
+    task_t* self = current_task;
+    if (mutex_try_acquire(mutex, self)) {
+        mutex->stats.acquisitions++;
+        return;
+    }
+
+    if (cpu_count > 1 && mutex_spin(mutex, self)) {
+        mutex->stats.acquisitions++;
+        mutex->stats.contended++;
+        mutex->stats.spin_acquired++;
+        return;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&mutex->waiters.lock);
+    while (1) {
+        uintptr_t owner = mutex->owner;
+        if (!owner) {
+            if (mutex_try_acquire(mutex, self)) {
+                spin_unlock_irqrestore(&mutex->waiters.lock, flags);
+                mutex->stats.acquisitions++;
+                mutex->stats.contended++;
+                return;
+            }
+        } else if ((owner & MUTEX_WAITERS) ||
+                   __atomic_compare_exchange_n(&mutex->owner, &owner, owner | MUTEX_WAITERS, 0,
+                                               __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    // mutex_unlock makes us the owner before waking us
+    task_block_locked(&mutex->waiters);
+    irq_restore(flags);
+    mutex->stats.acquisitions++;
+    mutex->stats.contended++;
+    lock_stats_handoff(&mutex->stats, mutex->release_time);
+}
+
+void mutex_unlock(mutex_t* mutex) {
+    uintptr_t expected = (uintptr_t)current_task;
+    if (__atomic_compare_exchange_n(&mutex->owner, &expected, 0, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    // Waiters are queued: pass ownership to the first one
+    uint32_t flags = spin_lock_irqsave(&mutex->waiters.lock);
+    task_t* next = mutex->waiters.tasks.head;
+    if (!next) {
+        __atomic_store_n(&mutex->owner, 0, __ATOMIC_RELEASE);
+        spin_unlock_irqrestore(&mutex->waiters.lock, flags);
+        return;
+    }
+
+    uintptr_t owner = (uintptr_t)next;
+    if (next->queue_next) {
+        owner |= MUTEX_WAITERS;
+    }
+    mutex->release_time = rdtsc();
+    __atomic_store_n(&mutex->owner, owner, __ATOMIC_RELEASE);
+    spin_unlock(&mutex->waiters.lock);
+    // next is still at the head: only the owner takes waiters off, and the
+    // owner is now next, asleep
+    task_wake_one(&mutex->waiters);
+    irq_restore(flags);
+}
+
+/*
+ * Counting semaphores. The count is only raised when nobody is waiting;
+ * otherwise semaphore_up hands its unit to the first sleeper. Both the
+ * slow path of down and all of up run under the wait queue lock, so a
+ * sleeper cannot miss an up. Several tasks can hold units at once, so the
+ * statistics are updated atomically and the handoff time is approximate
+ * when handoffs overlap.
+ */
+void semaphore_init(semaphore_t* sem, const char* name, int32_t count) {
+    sem->count = count;
+    sem->waiters = (wait_queue_t)WAIT_QUEUE_INIT;
+    sem->release_time = 0;
+    lock_stats_init(&sem->stats, name);
+}
+
+int semaphore_trydown(semaphore_t* sem) {
+    int32_t count = sem->count;
+    while (count > 0) {
+        if (__atomic_compare_exchange_n(&sem->count, &count, count - 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            __atomic_add_fetch(&sem->stats.acquisitions, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// ticks == 0 waits for as long as it takes
+static int semaphore_wait(semaphore_t* sem, uint32_t ticks) {
+    if (semaphore_trydown(sem)) {
+        return 1;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&sem->waiters.lock);
+    __atomic_add_fetch(&sem->stats.contended, 1, __ATOMIC_RELAXED);
+    if (semaphore_trydown(sem)) {
+        spin_unlock_irqrestore(&sem->waiters.lock, flags);
+        return 1;
+    }
+
+    if (ticks) {
+        if (!task_block_locked_timeout(&sem->waiters, ticks)) {
+            irq_restore(flags);
+            return 0;
+        }
+    } else {
+        task_block_locked(&sem->waiters);
+    }
+    irq_restore(flags);
+
+    __atomic_add_fetch(&sem->stats.acquisitions, 1, __ATOMIC_RELAXED);
+    flags = spin_lock_irqsave(&sem->waiters.lock);
+    lock_stats_handoff(&sem->stats, sem->release_time);
+    spin_unlock_irqrestore(&sem->waiters.lock, flags);
+    return 1;
+}
+
+void semaphore_down(semaphore_t* sem) {
+    semaphore_wait(sem, 0);
+}
+
+int semaphore_down_timeout(semaphore_t* sem, uint32_t ms) {
+    return semaphore_wait(sem, timer_ms_to_ticks(ms) + 1);
+}
+
+void semaphore_up(semaphore_t* sem) {
+    uint32_t flags = spin_lock_irqsave(&sem->waiters.lock);
+    if (!sem->waiters.tasks.head) {
+        __atomic_add_fetch(&sem->count, 1, __ATOMIC_RELEASE);
+        spin_unlock_irqrestore(&sem->waiters.lock, flags);
+        return;
+    }
+
+    // Taken off the queue under the lock, so a waiter timing out at the
+    // same moment cannot take the unit with it
+    sem->release_time = rdtsc();
+    task_wake_one_locked(&sem->waiters);
+    spin_unlock_irqrestore(&sem->waiters.lock, flags);
+}
+
+/*
+ * Condition variables. The waiter takes the queue lock before it drops the
+ * mutex, so a signal sent by the next owner always finds it queued.
+ */
+void condvar_init(condvar_t* cond) {
+    cond->waiters = (wait_queue_t)WAIT_QUEUE_INIT;
+}
+
+void condvar_wait(condvar_t* cond, mutex_t* mutex) {
+    uint32_t flags = spin_lock_irqsave(&cond->waiters.lock);
+    mutex_unlock(mutex);
+    task_block_locked(&cond->waiters);
+    irq_restore(flags);
+    mutex_lock(mutex);
+}
+
+int condvar_wait_timeout(condvar_t* cond, mutex_t* mutex, uint32_t ms) {
+    uint32_t flags = spin_lock_irqsave(&cond->waiters.lock);
+    mutex_unlock(mutex);
+    int woken = task_block_locked_timeout(&cond->waiters, timer_ms_to_ticks(ms) + 1);
+    irq_restore(flags);
+    mutex_lock(mutex);
+    return woken;
+}
+
+void condvar_signal(condvar_t* cond) {
+    task_wake_one(&cond->waiters);
+}
+
+void condvar_broadcast(condvar_t* cond) {
+    task_wake_all(&cond->waiters);
+}
+
+/*
+ * SYNC_BENCH_TASKS tasks take turns on one mutex around a short critical
+ * section; they only collide when one is preempted or runs on another CPU
+ * while holding it. Then a semaphore ping-pong between the caller and a
+ * partner task makes every down sleep, so each one measures a handoff.
+ */
+#define SYNC_BENCH_TASKS       4
+#define SYNC_BENCH_ITERATIONS  20000
+#define SYNC_BENCH_PING_PONGS  2000
+
+static mutex_t bench_mutex = MUTEX_INIT("bench mutex");
+static semaphore_t bench_ping = SEMAPHORE_INIT("bench ping", 0);
+static semaphore_t bench_pong = SEMAPHORE_INIT("bench pong", 0);
+static uint32_t bench_counter;          // Protected by bench_mutex
+
+static void sync_bench_mutex_task(void) {
+    for (int i = 0; i < SYNC_BENCH_ITERATIONS; i++) {
+        mutex_lock(&bench_mutex);
+        uint32_t value = bench_counter;
+        for (volatile int spin = 0; spin < 50; spin++) {}
+        bench_counter = value + 1;
+        mutex_unlock(&bench_mutex);
+    }
+}
+
+static void sync_bench_pong_task(void) {
+    for (int i = 0; i < SYNC_BENCH_PING_PONGS; i++) {
+        semaphore_down(&bench_ping);
+        semaphore_up(&bench_pong);
+    }
+}
+
+// Needs multitasking and interrupts enabled
+void sync_bench(void) {
+    bench_counter = 0;
+    uint32_t tasks = bench_spawn(sync_bench_mutex_task, SYNC_BENCH_TASKS);
+    bench_join();
+    if (bench_counter != tasks * SYNC_BENCH_ITERATIONS) {
+        terminal_writestring("Error: Mutex lost updates.\n");
+    }
+    lock_stats_print(&bench_mutex.stats);
+
+    if (!bench_spawn(sync_bench_pong_task, 1)) {
+        return;
+    }
+    for (int i = 0; i < SYNC_BENCH_PING_PONGS; i++) {
+        semaphore_up(&bench_ping);
+        semaphore_down(&bench_pong);
+    }
+    bench_join();
+    lock_stats_print(&bench_ping.stats);
+    lock_stats_print(&bench_pong.stats);
+}
@@ -0,0 +1,65 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdint.h>
+
+#include "multitasking.h"
+
+// Sleeping locks for task context. Waiters block in TASK_WAITING on a wait
+// queue and use no CPU; they are handed the lock or the unit directly by the
+// task releasing it, so a woken task never has to compete for it again.
+
+typedef struct lock_stats {
+    const char* name;
+    uint32_t acquisitions;
+    uint32_t contended;         // Not free on the first try
+    uint32_t spin_acquired;     // ...of which were taken by spinning
+    uint32_t handoffs;          // Passed directly to a sleeping waiter
+    uint32_t handoff_cycles;    // Release to waiter running, summed over handoff_samples
+    uint32_t handoff_samples;   // Both are halved when the sum gets large
+    uint32_t max_handoff_cycles;
+} lock_stats_t;
+
+typedef struct mutex {
+    volatile uintptr_t owner;   // Owning task, low bit set while tasks sleep on it
+    wait_queue_t waiters;
+    uint64_t release_time;      // TSC when the lock was last handed to a waiter
+    lock_stats_t stats;
+} mutex_t;
+
+typedef struct semaphore {
+    volatile int32_t count;
+    wait_queue_t waiters;
+    uint64_t release_time;
+    lock_stats_t stats;
+} semaphore_t;
+
+typedef struct condvar {
+    wait_queue_t waiters;
+} condvar_t;
+
+#define MUTEX_INIT(name)            { 0, WAIT_QUEUE_INIT, 0, { name, 0, 0, 0, 0, 0, 0, 0 } }
+#define SEMAPHORE_INIT(name, count) { count, WAIT_QUEUE_INIT, 0, { name, 0, 0, 0, 0, 0, 0, 0 } }
+#define CONDVAR_INIT                { WAIT_QUEUE_INIT }
+
+void mutex_init(mutex_t* mutex, const char* name);
+void mutex_lock(mutex_t* mutex);        // Spins while the owner runs on another CPU, then sleeps
+int mutex_trylock(mutex_t* mutex);      // 1 if the mutex was taken
+void mutex_unlock(mutex_t* mutex);
+
+void semaphore_init(semaphore_t* sem, const char* name, int32_t count);
+void semaphore_down(semaphore_t* sem);  // Sleeps while the count is zero
+int semaphore_down_timeout(semaphore_t* sem, uint32_t ms); // 0 if ms passed first
+int semaphore_trydown(semaphore_t* sem);
+void semaphore_up(semaphore_t* sem);
+
+void condvar_init(condvar_t* cond);
+void condvar_wait(condvar_t* cond, mutex_t* mutex); // Drops mutex while asleep, holds it again on return
+int condvar_wait_timeout(condvar_t* cond, mutex_t* mutex, uint32_t ms); // 0 if ms passed first
+void condvar_signal(condvar_t* cond);
+void condvar_broadcast(condvar_t* cond);
+
+void lock_stats_print(const lock_stats_t* stats);
+void sync_bench(void);                  // Contended mutex and semaphore handoff
+
+#endif // SYNC_H
@@ -0,0 +1,267 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "timer.h"
+#include "idt.h"
+#include "cpu.h"
+#include "stdio.h"
+#include "multitasking.h"
+#include "ktimer.h"
+#include "lapic.h"
+#include "smp.h"
+#include "profile.h"
+
+#define PIT_CHANNEL0  0x40
+#define PIT_COMMAND   0x43
+#define PIT_MODE_RATE 0x34      // Channel 0, lobyte/hibyte, mode 2 (rate generator)
+#define PIT_MODE_ONESHOT 0x30   // Channel 0, lobyte/hibyte, mode 0 (interrupt on terminal count)
+
+#define TSC_CALIBRATE_TICKS 16
+
+volatile uint32_t timer_ticks = 0;
+static uint32_t timer_divisor;
+
+/*
+ * Tickless idle. An idle CPU stops its periodic interrupt: the application
+ * processors mask their APIC timer and only wake for an IPI, and the
+ * bootstrap CPU, which keeps time and runs the timer wheel, reprograms the
+ * PIT as a one-shot for the wheel's next deadline. Ticks that pass in the
+ * meantime are accounted from the TSC when it wakes up, and
+ * timer_now() extrapolates from the TSC for other CPUs reading the clock
+ * while it sleeps. tick_tsc and timer_ticks change together under
+ * clock_sequence (odd while an update is in progress).
+ */
+static int tickless_enabled;
+static uint32_t tsc_per_tick;               // Calibrated over the first ticks
+static uint64_t calibrate_start;
+static uint64_t tick_tsc;                   // TSC at the last tick counted in timer_ticks
+static volatile uint32_t clock_sequence;
+static uint32_t tickless_deadline;          // Tick the one-shot PIT is set for
+static volatile uint8_t cpu_tickless[MAX_CPUS];
+static uint32_t idle_start[MAX_CPUS];
+static uint32_t idle_wakeups[MAX_CPUS];
+
+// Tick timestamps collected by timer_jitter_bench
+#define JITTER_SAMPLES 100
+static uint32_t jitter_intervals[JITTER_SAMPLES];
+static volatile int jitter_count = -1;      // -1 while not sampling
+static uint64_t jitter_last;
+
+static void pit_program(uint8_t mode, uint32_t count) {
+    outb(PIT_COMMAND, mode);
+    outb(PIT_CHANNEL0, count & 0xFF);
+    outb(PIT_CHANNEL0, (count >> 8) & 0xFF);
+}
+
+static void clock_advance(uint32_t ticks, uint64_t tsc) {
+    __atomic_add_fetch(&clock_sequence, 1, __ATOMIC_ACQ_REL);
+    timer_ticks += ticks;
+    tick_tsc = tsc;
+    __atomic_add_fetch(&clock_sequence, 1, __ATOMIC_ACQ_REL);
+}
+
+static void idle_exit(int tick_fired);
+
+static void timer_handler(interrupt_frame_t* frame) {
+    uint64_t now = rdtsc();
+    profile_tick(frame);
+
+    // The one-shot fired: this accounts for every tick up to now
+    if (cpu_tickless[0]) {
+        idle_exit(1);
+    } else {
+        clock_advance(1, now);
+    }
+
+    if (timer_ticks == 1) {
+        calibrate_start = now;
+    } else if (timer_ticks == 1 + TSC_CALIBRATE_TICKS && !tsc_per_tick) {
+        tsc_per_tick = (uint32_t)(now - calibrate_start) / TSC_CALIBRATE_TICKS;
+    }
+
+    if (jitter_count >= 0 && jitter_count < JITTER_SAMPLES) {
+        if (jitter_last) {
+            jitter_intervals[jitter_count++] = (uint32_t)(now - jitter_last);
+        }
+        jitter_last = now;
+    }
+
+    ktimer_run(timer_ticks);
+    scheduler_tick();
+}
+
+void timer_init(uint32_t hz) {
+    // The divisor is 16 bits wide; 0 would mean 65536
+    uint32_t divisor = hz ? PIT_FREQUENCY / hz : 0;
+    if (divisor < 1) divisor = 1;
+    if (divisor > 0xFFFF) divisor = 0xFFFF;
+    timer_divisor = divisor;
+    pit_program(PIT_MODE_RATE, divisor);
+
+    irq_register(IRQ_TIMER, timer_handler);
+
+    kprintf("Timer: %u Hz\n", (unsigned int)timer_frequency());
+}
+
+uint32_t timer_frequency(void) {
+    return PIT_FREQUENCY / timer_divisor;
+}
+
+uint32_t timer_ms_to_ticks(uint32_t ms) {
+    return (ms * timer_frequency() + 999) / 1000;
+}
+
+uint32_t timer_now(void) {
+    while (1) {
+        uint32_t sequence = __atomic_load_n(&clock_sequence, __ATOMIC_ACQUIRE);
+        uint32_t ticks = timer_ticks;
+        uint64_t last = tick_tsc;
+        int asleep = cpu_tickless[0];
+        if (sequence & 1 || __atomic_load_n(&clock_sequence, __ATOMIC_ACQUIRE) != sequence) {
+            continue;
+        }
+        if (asleep && tsc_per_tick) {
+            ticks += (uint32_t)(rdtsc() - last) / tsc_per_tick;
+        }
+        return ticks;
+    }
+}
+
+uint32_t timer_tsc_per_tick(void) {
+    return tsc_per_tick;
+}
+
+uint64_t timer_tick_tsc(void) {
+    return tick_tsc;
+}
+
+void timer_set_tickless(int enabled) {
+    tickless_enabled = enabled;
+}
+
+int timer_tickless(void) {
+    return tickless_enabled;
+}
+
+uint32_t timer_idle_wakeups(void) {
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        total += idle_wakeups[i];
+    }
+    return total;
+}
+
+// Called by the idle task with interrupts disabled, right before it halts
+void timer_idle_enter(void) {
+    cpu_t* cpu = this_cpu();
+    if (!tickless_enabled || !tsc_per_tick) {
+        return;
+    }
+
+    if (cpu->id == 0) {
+        // Not worth it for a deadline within the next tick or two
+        uint32_t now = timer_ticks;
+        uint32_t delta = ktimer_next_expiry() - now;
+        uint32_t max = 0xFFFF / timer_divisor;
+        if ((int32_t)delta < 2 || max < 2) {
+            return;
+        }
+        if (delta > max) {
+            delta = max;
+        }
+
+        // Count from the last tick boundary, not from now
+        uint32_t since_tick = (uint32_t)(rdtsc() - tick_tsc);
+        uint32_t tsc_per_count = tsc_per_tick / timer_divisor;
+        uint32_t count = delta * timer_divisor;
+        if (tsc_per_count && since_tick / tsc_per_count < count) {
+            count -= since_tick / tsc_per_count;
+        }
+        tickless_deadline = now + delta;
+        pit_program(PIT_MODE_ONESHOT, count);
+    } else {
+        lapic_timer_stop();
+    }
+
+    idle_start[cpu->id] = timer_now();
+    __atomic_store_n(&cpu_tickless[cpu->id], 1, __ATOMIC_RELEASE);
+}
+
+// The one-shot PIT fires right on a tick boundary, so its own wakeup rounds
+// to the nearest tick; any other wakeup only counts the ticks fully past
+static void idle_exit(int tick_fired) {
+    cpu_t* cpu = this_cpu();
+    if (!cpu_tickless[cpu->id]) {
+        return;
+    }
+
+    if (cpu->id == 0) {
+        uint32_t elapsed = (uint32_t)(rdtsc() - tick_tsc);
+        if (tick_fired) {
+            elapsed += tsc_per_tick / 2;
+        }
+        uint32_t ticks = elapsed / tsc_per_tick;
+        clock_advance(ticks, tick_tsc + (uint64_t)ticks * tsc_per_tick);
+        pit_program(PIT_MODE_RATE, timer_divisor);
+    } else {
+        lapic_timer_start();
+    }
+
+    __atomic_store_n(&cpu_tickless[cpu->id], 0, __ATOMIC_RELEASE);
+    idle_wakeups[cpu->id]++;
+    scheduler_account_idle(timer_now() - idle_start[cpu->id]);
+}
+
+// Called with interrupts disabled by whatever wakes an idle CPU first: the
+// reschedule IPI or the idle task itself
+void timer_idle_exit(void) {
+    idle_exit(0);
+}
+
+// A timer was added for `expires`; wake the bootstrap CPU if its one-shot
+// would go off too late for it
+void timer_deadline_changed(uint32_t expires) {
+    if (cpu_tickless[0] && (int32_t)(expires - tickless_deadline) < 0 && this_cpu()->id != 0) {
+        lapic_send_reschedule(cpus[0].apic_id);
+    }
+}
+
+void timer_delay_ms(uint32_t ms) {
+    // One extra tick since the current one may be about to end
+    uint32_t ticks = timer_ms_to_ticks(ms) + 1;
+    uint32_t start = timer_ticks;
+    while (timer_ticks - start < ticks) {
+        __asm__ volatile("hlt");
+    }
+}
+
+/*
+ * Sample the TSC on consecutive ticks and report the interval spread. The
+ * PIT itself is exact, so the spread is interrupt latency: time spent with
+ * interrupts disabled and, under QEMU, host scheduling of the vCPU.
+ */
+void timer_jitter_bench(void) {
+    uint32_t flags = irq_save();
+    jitter_last = 0;
+    jitter_count = 0;
+    irq_enable();
+    while (jitter_count < JITTER_SAMPLES) {
+        __asm__ volatile("hlt");
+    }
+    irq_disable();
+    jitter_count = -1;
+
+    uint32_t min = 0xFFFFFFFF, max = 0;
+    uint64_t sum = 0;
+    for (int i = 0; i < JITTER_SAMPLES; i++) {
+        uint32_t interval = jitter_intervals[i];
+        if (interval < min) min = interval;
+        if (interval > max) max = interval;
+        sum += interval;
+    }
+    uint32_t mean = (uint32_t)(sum / JITTER_SAMPLES);
+    irq_restore(flags);
+
+    kprintf("Tick interval: %u cycles mean, %u min, %u max\n",
+            (unsigned int)mean, (unsigned int)min, (unsigned int)max);
+}
@@ -0,0 +1,26 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+#define TIMER_DEFAULT_HZ  1000
+#define PIT_FREQUENCY     1193182   // PIT input clock in Hz
+
+extern volatile uint32_t timer_ticks;   // IRQ0 count since timer_init
+
+void timer_init(uint32_t hz);           // Program PIT channel 0 and hook IRQ0
+uint32_t timer_frequency(void);         // Actual tick rate after rounding the divisor
+void timer_delay_ms(uint32_t ms);       // Wait at least ms; needs interrupts enabled
+uint32_t timer_ms_to_ticks(uint32_t ms); // Rounded up
+uint32_t timer_now(void);               // timer_ticks, kept current while the tick is stopped
+uint32_t timer_tsc_per_tick(void);      // 0 until calibrated, shortly after timer_init
+uint64_t timer_tick_tsc(void);          // TSC at the last tick
+void timer_set_tickless(int enabled);   // Stop the tick on idle CPUs
+int timer_tickless(void);
+void timer_idle_enter(void);            // Idle task, interrupts disabled
+void timer_idle_exit(void);             // First thing on wakeup, interrupts disabled
+void timer_deadline_changed(uint32_t expires);
+uint32_t timer_idle_wakeups(void);      // Tickless wakeups so far, all CPUs
+void timer_jitter_bench(void);          // Measure the spread of tick intervals
+
+#endif // TIMER_H
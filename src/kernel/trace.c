@@ -0,0 +1,241 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "trace.h"
+#include "cpu.h"
+#include "idt.h"
+#include "smp.h"
+#include "memory.h"
+#include "paging.h"
+#include "serial.h"
+#include "stdio.h"
+#include "timer.h"
+
+#define TRACE_EVENTS       8192        // Per CPU, power of two
+#define TRACE_EVENT_MASK   (TRACE_EVENTS - 1)
+#define TRACE_PAGES        (TRACE_EVENTS * sizeof(trace_event_t) / PAGE_SIZE)
+#define TRACE_BATCH        4096        // Bytes of JSON handed to serial at once
+
+// Chrome trace "threads" within each CPU's "process"
+#define TRACK_TASKS        1
+#define TRACK_INTERRUPTS   2
+#define TRACK_MEMORY       3
+
+/*
+ * Only the owning CPU writes a ring, with interrupts off, so recording an
+ * event is a plain store and increment. `writing` lets trace_stop wait out
+ * events being recorded on other CPUs when tracing is turned off; the
+ * exchange that sets it orders it before the read of trace_active.
+ */
+typedef struct trace_buffer {
+    trace_event_t* events;
+    uint32_t head;              // Events recorded since trace_start
+    volatile uint32_t writing;
+} __attribute__((aligned(64))) trace_buffer_t;
+
+volatile int trace_active;
+static trace_buffer_t trace_buffers[MAX_CPUS];
+static uint64_t trace_start_tsc;
+
+void trace_record(trace_type_t type, uint32_t arg0, uint32_t arg1) {
+    uint32_t flags = irq_save();
+    trace_buffer_t* buffer = &trace_buffers[this_cpu()->id];
+    __atomic_exchange_n(&buffer->writing, 1, __ATOMIC_SEQ_CST);
+    if (trace_active && buffer->events) {
+        trace_event_t* event = &buffer->events[buffer->head & TRACE_EVENT_MASK];
+        event->tsc = rdtsc();
+        event->arg0 = arg0;
+        event->type = type;
+        event->arg1 = arg1 < TRACE_ARG1_MAX ? arg1 : TRACE_ARG1_MAX;
+        buffer->head++;
+    }
+    __atomic_store_n(&buffer->writing, 0, __ATOMIC_RELEASE);
+    irq_restore(flags);
+}
+
+void trace_start(void) {
+    trace_stop();
+    for (uint32_t id = 0; id < cpu_count; id++) {
+        trace_buffer_t* buffer = &trace_buffers[id];
+        if (!buffer->events) {
+            buffer->events = (trace_event_t*)alloc_pages(TRACE_PAGES, 1);
+            if (!buffer->events) {
+                terminal_writestring("Error: Not enough memory for trace buffers.\n");
+                return;
+            }
+        }
+        buffer->head = 0;
+    }
+    trace_start_tsc = rdtsc();
+    __atomic_store_n(&trace_active, 1, __ATOMIC_SEQ_CST);
+}
+
+void trace_stop(void) {
+    __atomic_store_n(&trace_active, 0, __ATOMIC_SEQ_CST);
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        while (trace_buffers[id].writing) {
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+static uint32_t cycles_per_ms;
+
+// Microseconds since trace_start with three decimals, as Chrome expects
+static void format_ts(char* out, size_t size, uint64_t tsc) {
+    uint64_t cycles = tsc > trace_start_tsc ? tsc - trace_start_tsc : 0;
+    uint32_t remainder = div64_32(&cycles, cycles_per_ms);
+    uint64_t ns = (uint64_t)remainder * 1000000;
+    div64_32(&ns, cycles_per_ms);
+    ksnprintf(out, size, "%llu.%03u", (unsigned long long)cycles * 1000 + (uint32_t)ns / 1000,
+              (unsigned int)((uint32_t)ns % 1000));
+}
+
+static char batch[TRACE_BATCH];
+static size_t batch_used;
+
+static void emit(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void emit(const char* fmt, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, fmt);
+    int length = kvsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (length >= (int)sizeof(line)) {
+        length = sizeof(line) - 1;
+    }
+    if (batch_used + length > TRACE_BATCH) {
+        serial_write_all(batch, batch_used);
+        batch_used = 0;
+    }
+    for (int i = 0; i < length; i++) {
+        batch[batch_used++] = line[i];
+    }
+}
+
+static const char* vector_kind(uint32_t vector) {
+    if (vector < 32) return "exception";
+    if (vector >= IRQ_BASE && vector < IRQ_BASE + IRQ_COUNT) return "irq";
+    return "vector";
+}
+
+static uint32_t vector_number(uint32_t vector) {
+    return vector >= IRQ_BASE && vector < IRQ_BASE + IRQ_COUNT ? vector - IRQ_BASE : vector;
+}
+
+/*
+ * Each CPU is a process with three tracks: the running task as one slice
+ * per switch, interrupt handlers as nested slices, and allocations as
+ * instant events. Lines are whole JSON values ending in a comma, so the
+ * array stays well formed up to the closing event, and every line starts
+ * with '{' for picking them out of a serial log other output went to too.
+ */
+static void dump_cpu(uint32_t id) {
+    trace_buffer_t* buffer = &trace_buffers[id];
+    uint32_t count = buffer->head < TRACE_EVENTS ? buffer->head : TRACE_EVENTS;
+    int task_open = 0;
+    uint32_t irq_depth = 0;
+    char ts[24];
+
+    emit("{\"ph\":\"M\",\"pid\":%u,\"name\":\"process_name\",\"args\":{\"name\":\"CPU %u\"}},\n",
+         (unsigned int)id, (unsigned int)id);
+    emit("{\"ph\":\"M\",\"pid\":%u,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"tasks\"}},\n",
+         (unsigned int)id, TRACK_TASKS);
+    emit("{\"ph\":\"M\",\"pid\":%u,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"interrupts\"}},\n",
+         (unsigned int)id, TRACK_INTERRUPTS);
+    emit("{\"ph\":\"M\",\"pid\":%u,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"memory\"}},\n",
+         (unsigned int)id, TRACK_MEMORY);
+
+    for (uint32_t i = buffer->head - count; i != buffer->head; i++) {
+        trace_event_t* event = &buffer->events[i & TRACE_EVENT_MASK];
+        unsigned int arg0 = event->arg0;
+        unsigned int arg1 = event->arg1;
+        format_ts(ts, sizeof(ts), event->tsc);
+
+        switch (event->type) {
+        case TRACE_SWITCH:
+            if (task_open) {
+                emit("{\"ph\":\"E\",\"pid\":%u,\"tid\":%d,\"ts\":%s},\n", (unsigned int)id, TRACK_TASKS, ts);
+            }
+            emit("{\"ph\":\"B\",\"pid\":%u,\"tid\":%d,\"ts\":%s,\"name\":\"%s %u\"},\n",
+                 (unsigned int)id, TRACK_TASKS, ts, arg1 & TRACE_SWITCH_IDLE ? "idle" : "task",
+                 arg1 & ~TRACE_SWITCH_IDLE);
+            task_open = 1;
+            break;
+        case TRACE_TASK_CREATE:
+            emit("{\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,\"tid\":%d,\"ts\":%s,\"name\":\"create_task\","
+                 "\"args\":{\"task\":%u,\"entry\":\"0x%08x\"}},\n", (unsigned int)id, TRACK_TASKS, ts, arg1, arg0);
+            break;
+        case TRACE_TASK_EXIT:
+            emit("{\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,\"tid\":%d,\"ts\":%s,\"name\":\"task_exit\","
+                 "\"args\":{\"task\":%u}},\n", (unsigned int)id, TRACK_TASKS, ts, arg1);
+            break;
+        case TRACE_KMALLOC:
+            emit("{\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,\"tid\":%d,\"ts\":%s,\"name\":\"kmalloc\","
+                 "\"args\":{\"ptr\":\"0x%08x\",\"size\":%u}},\n", (unsigned int)id, TRACK_MEMORY, ts, arg0, arg1);
+            break;
+        case TRACE_KFREE:
+            emit("{\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,\"tid\":%d,\"ts\":%s,\"name\":\"kfree\","
+                 "\"args\":{\"ptr\":\"0x%08x\"}},\n", (unsigned int)id, TRACK_MEMORY, ts, arg0);
+            break;
+        case TRACE_PAGE_ALLOC:
+        case TRACE_PAGE_FREE:
+            emit("{\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,\"tid\":%d,\"ts\":%s,\"name\":\"%s\","
+                 "\"args\":{\"phys\":\"0x%08x\",\"pages\":%u}},\n", (unsigned int)id, TRACK_MEMORY, ts,
+                 event->type == TRACE_PAGE_ALLOC ? "alloc_page" : "free_page", arg0, arg1);
+            break;
+        case TRACE_IRQ_ENTRY:
+            emit("{\"ph\":\"B\",\"pid\":%u,\"tid\":%d,\"ts\":%s,\"name\":\"%s %u\"},\n",
+                 (unsigned int)id, TRACK_INTERRUPTS, ts, vector_kind(arg0), (unsigned int)vector_number(arg0));
+            irq_depth++;
+            break;
+        case TRACE_IRQ_EXIT:
+            // An exit whose entry was overwritten or happened before
+            // tracing started has no slice to end
+            if (irq_depth) {
+                emit("{\"ph\":\"E\",\"pid\":%u,\"tid\":%d,\"ts\":%s},\n", (unsigned int)id, TRACK_INTERRUPTS, ts);
+                irq_depth--;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void trace_dump(void) {
+    trace_stop();
+
+    uint32_t tsc_per_tick = timer_tsc_per_tick();
+    uint64_t per_ms = (uint64_t)tsc_per_tick * timer_frequency();
+    div64_32(&per_ms, 1000);
+    cycles_per_ms = tsc_per_tick ? (uint32_t)per_ms : 1000000;  // Uncalibrated: assume 1 GHz
+
+    uint32_t recorded = 0, overwritten = 0;
+    for (uint32_t id = 0; id < cpu_count; id++) {
+        uint32_t head = trace_buffers[id].head;
+        recorded += head;
+        overwritten += head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+    }
+
+    char ts[24];
+    format_ts(ts, sizeof(ts), rdtsc());
+    batch_used = 0;
+    serial_write_all("TRACE BEGIN\n", 12);
+    emit("{\"displayTimeUnit\":\"ns\",\"otherData\":{\"cpus\":%u,\"recorded\":%u,\"overwritten\":%u,"
+         "\"cycles_per_ms\":%u},\"traceEvents\":[\n", (unsigned int)cpu_count, (unsigned int)recorded,
+         (unsigned int)overwritten, (unsigned int)cycles_per_ms);
+    for (uint32_t id = 0; id < cpu_count; id++) {
+        if (trace_buffers[id].events) {
+            dump_cpu(id);
+        }
+    }
+    emit("{\"ph\":\"i\",\"s\":\"g\",\"pid\":0,\"tid\":%d,\"ts\":%s,\"name\":\"trace_dump\"}]}\n", TRACK_TASKS, ts);
+    serial_write_all(batch, batch_used);
+    serial_write_all("TRACE END\n", 10);
+
+    kprintf("Trace: %u events dumped to serial, %u overwritten\n",
+            (unsigned int)(recorded - overwritten), (unsigned int)overwritten);
+}
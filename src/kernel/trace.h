@@ -0,0 +1,52 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Static tracepoints. Each CPU records into its own ring of fixed-size
+ * events stamped with the TSC, overwriting the oldest once full, and
+ * trace_dump streams them over serial as Chrome trace format JSON between
+ * "TRACE BEGIN" and "TRACE END" lines (load it in ui.perfetto.dev or
+ * chrome://tracing). While tracing is off a tracepoint is one load and a
+ * branch that is never taken.
+ */
+typedef enum trace_type {
+    TRACE_NONE,
+    TRACE_SWITCH,           // arg0 previous task ID, arg1 next task ID
+    TRACE_TASK_CREATE,      // arg0 entry point, arg1 task ID
+    TRACE_KMALLOC,          // arg0 pointer, arg1 size
+    TRACE_KFREE,            // arg0 pointer
+    TRACE_PAGE_ALLOC,       // arg0 physical address, arg1 pages
+    TRACE_PAGE_FREE,        // arg0 physical address, arg1 pages
+    TRACE_IRQ_ENTRY,        // arg0 vector
+    TRACE_IRQ_EXIT,         // arg0 vector
+    TRACE_TASK_EXIT,        // arg1 task ID
+    TRACE_TYPES
+} trace_type_t;
+
+#define TRACE_ARG1_MAX     0x00FFFFFF  // arg1 shares a word with the type
+#define TRACE_SWITCH_IDLE  0x00800000  // Flag in arg1: the next task is the idle task
+
+typedef struct trace_event {
+    uint64_t tsc;
+    uint32_t arg0;
+    uint32_t type : 8;
+    uint32_t arg1 : 24;
+} trace_event_t;
+
+extern volatile int trace_active;
+
+void trace_record(trace_type_t type, uint32_t arg0, uint32_t arg1);
+
+static inline void trace_event(trace_type_t type, uint32_t arg0, uint32_t arg1) {
+    if (__builtin_expect(trace_active, 0)) {
+        trace_record(type, arg0, arg1);
+    }
+}
+
+void trace_start(void);         // Clear the rings and start recording, after smp_init
+void trace_stop(void);          // Stop recording and wait for writers on other CPUs
+void trace_dump(void);          // Stop and stream the rings over serial; task context
+
+#endif // TRACE_H
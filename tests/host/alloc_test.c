@@ -0,0 +1,669 @@
+/*
+ * Host build of the kernel heap (src/kernel/memory.c) for testing and
+ * measuring it without booting. memory.c is compiled into this file so the
+ * checks can see its internals; host_kernel.h stands in for the headers
+ * that need ring 0, and the page allocator below hands out pages from one
+ * big host allocation.
+ *
+ * Usage:
+ *   alloc_test [--seed N] [--ops N] [--live N] [--cpus N] [--check-every N]
+ *              [--record FILE]         random alloc/free mix
+ *   alloc_test --replay FILE           recorded trace
+ *
+ * Traces are text, one operation per line:
+ *   a <slot> <size> [<alignment>]      kmalloc, or kmalloc_aligned
+ *   f <slot>                           kfree
+ *   c <cpu>                            run what follows on this CPU
+ *
+ * After every operation (or every N with --check-every) the whole heap is
+ * walked and checked; see check_heap. Contents of every allocation are
+ * filled with a pattern and verified when it is freed. Timings cover the
+ * kmalloc and kfree calls only, in nanoseconds of CLOCK_MONOTONIC.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "memory.c"
+
+#define HOST_ARENA_PAGES    16384               // 64 MB of "physical" memory
+#define HOST_ARENA_ALIGN    (4 * 1024 * 1024)
+#define MAX_SLOTS           16384
+#define MAX_CHECK_BLOCKS    (HOST_ARENA_PAGES * PAGE_SIZE / MIN_BLOCK_SIZE)
+
+/* Kernel symbols memory.c links against */
+
+cpu_t cpus[MAX_CPUS];
+uint32_t cpu_count = 1;
+uint32_t host_cpu;
+uintptr_t host_phys_base;
+
+static int verbose;
+static unsigned long error_messages;
+static unsigned long operation;     // Index of the operation running, for reports
+
+static void fail(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "alloc_test: operation %lu: ", operation);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+    exit(1);
+}
+
+void host_lock_error(const char* what) {
+    fail("%s", what);
+}
+
+void terminal_writestring(const char* data) {
+    if (strncmp(data, "Error", 5) == 0) {
+        error_messages++;
+        fprintf(stderr, "alloc_test: operation %lu: kernel said: %s", operation, data);
+    } else if (verbose) {
+        fputs(data, stdout);
+    }
+}
+
+void terminal_write_int(int num) {
+    if (verbose) printf("%d", num);
+}
+
+int kprintf(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int length = vprintf(fmt, args);
+    va_end(args);
+    return length;
+}
+
+// Only kmalloc_bench uses tasks, and it is never called here
+uint32_t bench_spawn(void (*worker)(void), uint32_t count) { (void)worker; (void)count; fail("bench_spawn"); return 0; }
+void bench_join(void) { fail("bench_join"); }
+void task_yield(void) { fail("task_yield"); }
+void task_block_locked(wait_queue_t* queue) { (void)queue; fail("task_block_locked"); }
+void task_wake_all(wait_queue_t* queue) { (void)queue; fail("task_wake_all"); }
+
+// Tracing stays off
+volatile int trace_active;
+void trace_record(trace_type_t type, uint32_t arg0, uint32_t arg1) { (void)type; (void)arg0; (void)arg1; }
+
+/* Page allocator: first fit over a page map of the arena */
+
+static uint8_t* arena;
+static page_t arena_pages[HOST_ARENA_PAGES];
+static uint8_t arena_used[HOST_ARENA_PAGES];
+static size_t arena_used_pages;
+
+static size_t arena_index(uintptr_t addr) {
+    return (addr - (uintptr_t)arena) / PAGE_SIZE;
+}
+
+page_t* pmm_page(uintptr_t addr) {
+    if (addr < (uintptr_t)arena || addr >= (uintptr_t)arena + HOST_ARENA_PAGES * PAGE_SIZE) {
+        return NULL;
+    }
+    return &arena_pages[arena_index(addr)];
+}
+
+uintptr_t pmm_alloc_range(size_t count, size_t align) {
+    if (align == 0) align = 1;
+    for (size_t start = 0; start + count <= HOST_ARENA_PAGES; start += align) {
+        size_t i = 0;
+        while (i < count && !arena_used[start + i]) {
+            i++;
+        }
+        if (i == count) {
+            memset(&arena_used[start], 1, count);
+            arena_used_pages += count;
+            return (uintptr_t)arena + start * PAGE_SIZE;
+        }
+    }
+    return 0;
+}
+
+void pmm_free_range(uintptr_t addr, size_t count) {
+    if (addr % PAGE_SIZE || !pmm_page(addr) || arena_index(addr) + count > HOST_ARENA_PAGES) {
+        fail("pmm_free_range of %#lx outside the arena", (unsigned long)addr);
+    }
+    size_t start = arena_index(addr);
+    for (size_t i = 0; i < count; i++) {
+        if (!arena_used[start + i]) {
+            fail("pmm_free_range of free page %#lx", (unsigned long)(addr + i * PAGE_SIZE));
+        }
+        arena_used[start + i] = 0;
+        arena_pages[start + i].flags = 0;
+    }
+    arena_used_pages -= count;
+}
+
+uintptr_t pmm_alloc(unsigned int order) {
+    return pmm_alloc_range((size_t)1 << order, (size_t)1 << order);
+}
+
+void pmm_free(uintptr_t addr, unsigned int order) {
+    pmm_free_range(addr, (size_t)1 << order);
+}
+
+/* Allocations the test holds */
+
+typedef struct slot {
+    uint8_t* ptr;
+    size_t size;
+    size_t alignment;
+} slot_t;
+
+static slot_t slots[MAX_SLOTS];
+static size_t live_bytes;
+static size_t live_count;
+
+static uint8_t pattern(size_t slot, size_t offset) {
+    return (uint8_t)(slot * 31 + offset * 7 + 1);
+}
+
+static void fill(size_t index) {
+    slot_t* slot = &slots[index];
+    for (size_t i = 0; i < slot->size; i++) {
+        slot->ptr[i] = pattern(index, i);
+    }
+}
+
+static void verify(size_t index) {
+    slot_t* slot = &slots[index];
+    for (size_t i = 0; i < slot->size; i++) {
+        if (slot->ptr[i] != pattern(index, i)) {
+            fail("slot %zu (%zu bytes at %p) overwritten at offset %zu", index, slot->size,
+                 (void*)slot->ptr, i);
+        }
+    }
+}
+
+/*
+ * Heap invariants:
+ *  - pools are on the list, HEAP_POOL_SIZE aligned, marked PAGE_HEAP, and
+ *    the counters match the list;
+ *  - the blocks of each pool tile it exactly up to the sentinel, each at
+ *    least MIN_BLOCK_SIZE and a multiple of ALIGNMENT;
+ *  - BLOCK_PREV_FREE and the boundary tag match the previous block, and no
+ *    two free blocks are adjacent;
+ *  - every free block is on exactly the bin list mapping_insert picks,
+ *    the lists are properly linked and the bitmaps match them;
+ *  - every live allocation and every block cached in a magazine or a depot
+ *    is the start of a distinct allocated block big enough for it;
+ *  - page-sized allocations are tagged PAGE_LARGE and cover their size.
+ */
+static uintptr_t* check_blocks;     // Allocated block addresses, sorted for claim()
+static uint8_t* check_claimed;
+
+static size_t peak_heap;           // Pools plus page-sized allocations
+static size_t peak_live;           // Bytes requested and not yet freed
+
+static int compare_addresses(const void* a, const void* b) {
+    uintptr_t x = *(const uintptr_t*)a, y = *(const uintptr_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void claim(size_t block_count, const void* block, const char* owner, size_t need) {
+    uintptr_t key = (uintptr_t)block;
+    uintptr_t* found = bsearch(&key, check_blocks, block_count, sizeof(uintptr_t), compare_addresses);
+    if (!found) {
+        fail("%s at %p is not an allocated heap block", owner, block);
+    }
+    if (check_claimed[found - check_blocks]++) {
+        fail("%s at %p shares its block with another owner", owner, block);
+    }
+    if (block_size(block) - BLOCK_OVERHEAD < need) {
+        fail("%s at %p: block has %zu usable bytes, %zu needed", owner, block,
+             block_size(block) - BLOCK_OVERHEAD, need);
+    }
+}
+
+static void check_heap(void) {
+    size_t pools = 0, free_blocks = 0, block_count = 0;
+
+    for (heap_pool_t* pool = heap_pools; pool; pool = pool->next) {
+        if (++pools > heap_pool_count) {
+            fail("pool list longer than heap_pool_count %zu", heap_pool_count);
+        }
+        if ((uintptr_t)pool % HEAP_POOL_SIZE) {
+            fail("pool %p is not aligned to its size", (void*)pool);
+        }
+        if (pool->next && pool->next->prev != pool) {
+            fail("pool list links broken after %p", (void*)pool);
+        }
+        for (size_t i = 0; i < HEAP_POOL_PAGES; i++) {
+            page_t* page = pmm_page((uintptr_t)pool + i * PAGE_SIZE);
+            if (!page || !(page->flags & PAGE_HEAP)) {
+                fail("page %zu of pool %p is not marked PAGE_HEAP", i, (void*)pool);
+            }
+        }
+
+        uint8_t* end = (uint8_t*)pool + HEAP_POOL_SIZE - BLOCK_OVERHEAD;
+        block_header_t* block = pool_first_block(pool);
+        int prev_free = 0;
+        size_t prev_size = 0;
+        while (block_size(block)) {
+            size_t size = block_size(block);
+            if (size < MIN_BLOCK_SIZE || size % ALIGNMENT || (uint8_t*)block + size > end) {
+                fail("block %p in pool %p has bad size %zu", (void*)block, (void*)pool, size);
+            }
+            if (!!(block->size & BLOCK_PREV_FREE) != prev_free) {
+                fail("block %p: BLOCK_PREV_FREE does not match the previous block", (void*)block);
+            }
+            if (prev_free && block->prev_size != prev_size) {
+                fail("block %p: boundary tag %zu, previous block is %zu", (void*)block,
+                     block->prev_size, prev_size);
+            }
+            if (block_is_free(block)) {
+                if (prev_free) {
+                    fail("free blocks %p and its predecessor were not coalesced", (void*)block);
+                }
+                free_blocks++;
+            } else {
+                if (block_count == MAX_CHECK_BLOCKS) {
+                    fail("too many blocks to check");
+                }
+                check_blocks[block_count++] = (uintptr_t)block;
+            }
+            prev_free = block_is_free(block);
+            prev_size = size;
+            block = block_next(block);
+        }
+        if ((uint8_t*)block != end) {
+            fail("blocks of pool %p end at %p, sentinel expected at %p", (void*)pool, (void*)block,
+                 (void*)end);
+        }
+        if (!!(block->size & BLOCK_PREV_FREE) != prev_free) {
+            fail("sentinel of pool %p: BLOCK_PREV_FREE does not match", (void*)pool);
+        }
+    }
+    if (pools != heap_pool_count || HEAP_SIZE != pools * HEAP_POOL_SIZE) {
+        fail("%zu pools on the list, heap_pool_count %zu, HEAP_SIZE %zu", pools, heap_pool_count,
+             HEAP_SIZE);
+    }
+
+    size_t listed = 0;
+    for (int fl = 0; fl < FL_COUNT; fl++) {
+        if (!!(fl_bitmap & (1U << fl)) != !!sl_bitmap[fl]) {
+            fail("fl_bitmap bit %d does not match sl_bitmap", fl);
+        }
+        for (int sl = 0; sl < SL_COUNT; sl++) {
+            block_header_t* head = free_lists[fl][sl];
+            if (!!(sl_bitmap[fl] & (1U << sl)) != (head != NULL)) {
+                fail("sl_bitmap bit %d/%d does not match its list", fl, sl);
+            }
+            block_header_t* prev = NULL;
+            for (block_header_t* block = head; block; prev = block, block = block->next_free) {
+                int bin_fl, bin_sl;
+                mapping_insert(block_size(block), &bin_fl, &bin_sl);
+                if (!block_is_free(block) || bin_fl != fl || bin_sl != sl) {
+                    fail("block %p on list %d/%d is %s with size %zu", (void*)block, fl, sl,
+                         block_is_free(block) ? "free" : "allocated", block_size(block));
+                }
+                if (block->prev_free != prev) {
+                    fail("list %d/%d: prev_free link of %p is wrong", fl, sl, (void*)block);
+                }
+                if (++listed > free_blocks) {
+                    fail("free lists hold more entries than there are free blocks");
+                }
+            }
+        }
+    }
+    if (listed != free_blocks) {
+        fail("%zu free blocks in the pools, %zu on the free lists", free_blocks, listed);
+    }
+
+    // Heap blocks owned by the test or cached by the magazines
+    qsort(check_blocks, block_count, sizeof(uintptr_t), compare_addresses);
+    memset(check_claimed, 0, block_count);
+    for (size_t i = 0; i < MAX_SLOTS; i++) {
+        slot_t* slot = &slots[i];
+        if (!slot->ptr) {
+            continue;
+        }
+        if (slot->alignment && (uintptr_t)slot->ptr % slot->alignment) {
+            fail("slot %zu at %p is not aligned to %zu", i, (void*)slot->ptr, slot->alignment);
+        }
+        page_t* page = pmm_page((uintptr_t)slot->ptr);
+        if (page && (page->flags & PAGE_LARGE) && (uintptr_t)slot->ptr % PAGE_SIZE == 0) {
+            if (page->count * PAGE_SIZE < slot->size) {
+                fail("slot %zu: %u pages for %zu bytes", i, (unsigned int)page->count, slot->size);
+            }
+            continue;
+        }
+        char owner[32];
+        snprintf(owner, sizeof(owner), "slot %zu", i);
+        claim(block_count, ptr_to_block(slot->ptr), owner, slot->size);
+    }
+    for (uint32_t cpu = 0; cpu < cpu_count; cpu++) {
+        for (int c = 0; c < MAG_CLASSES; c++) {
+            magazine_t* mag = &mag_cpus[cpu].classes[c];
+            for (uint32_t i = 0; i < mag->count; i++) {
+                claim(block_count, ptr_to_block(mag->rounds[i]), "magazine entry", mag_sizes[c]);
+            }
+        }
+    }
+    for (int c = 0; c < MAG_CLASSES; c++) {
+        uint32_t batches = 0;
+        for (mag_link_t* batch = mag_depots[c].batches; batch; batch = batch->next_batch) {
+            batches++;
+            for (mag_link_t* link = batch; link; link = link->next) {
+                claim(block_count, ptr_to_block(link), "depot entry", mag_sizes[c]);
+            }
+        }
+        if (batches != mag_depots[c].count) {
+            fail("depot %d holds %u batches, count says %u", c, batches, mag_depots[c].count);
+        }
+    }
+}
+
+/* Operations */
+
+enum { OP_ALLOC, OP_ALIGNED, OP_FREE, OP_KINDS };
+static const char* op_names[OP_KINDS] = { "kmalloc", "kmalloc_aligned", "kfree" };
+
+typedef struct op_stats {
+    unsigned long count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} op_stats_t;
+
+static op_stats_t stats[OP_KINDS];
+static unsigned long check_every = 1;
+static FILE* record;
+
+static void account(int kind, uint64_t ns) {
+    stats[kind].count++;
+    stats[kind].total_ns += ns;
+    if (ns > stats[kind].max_ns) stats[kind].max_ns = ns;
+}
+
+// The counters memory_stats reads must agree with the walk and with what
+// the test did
+static void check_counters(void) {
+    if (memory_check()) {
+        fail("memory_check found the counters out of step with the heap");
+    }
+    memory_stats_t heap;
+    memory_stats(&heap);
+    unsigned long allocations = stats[OP_ALLOC].count + stats[OP_ALIGNED].count;
+    if (heap.allocations != allocations || heap.frees != stats[OP_FREE].count || heap.failures) {
+        fail("memory_stats counts %u allocations, %u frees, %u failures; the test made %lu and %lu",
+             heap.allocations, heap.frees, heap.failures, allocations, stats[OP_FREE].count);
+    }
+    unsigned long requests = 0;
+    for (int b = 0; b < MEMORY_HISTOGRAM_BUCKETS; b++) {
+        requests += heap.size_histogram[b];
+    }
+    if (requests != allocations) {
+        fail("size histogram holds %lu requests, %lu were made", requests, allocations);
+    }
+    if (heap.used_bytes + heap.free_bytes != heap.heap_bytes || heap.large_bytes != large_bytes ||
+        heap.peak_bytes < heap.used_bytes + heap.large_bytes || heap.cached_bytes > heap.used_bytes) {
+        fail("memory_stats: %zu used, %zu free of %zu, %zu large, %zu peak, %zu cached", heap.used_bytes,
+             heap.free_bytes, heap.heap_bytes, heap.large_bytes, heap.peak_bytes, heap.cached_bytes);
+    }
+    if (heap.fragmentation > 1000 || heap.largest_free > heap.free_bytes) {
+        fail("memory_stats: fragmentation %u, largest free block %zu", heap.fragmentation, heap.largest_free);
+    }
+}
+
+static void after_operation(void) {
+    if (error_messages) {
+        fail("the allocator reported an error");
+    }
+    if (live_bytes > peak_live) peak_live = live_bytes;
+    if (HEAP_SIZE + large_bytes > peak_heap) peak_heap = HEAP_SIZE + large_bytes;
+    if (check_every && operation % check_every == 0) {
+        check_heap();
+        check_counters();
+    }
+    operation++;
+}
+
+static void do_alloc(size_t index, size_t size, size_t alignment) {
+    if (index >= MAX_SLOTS || slots[index].ptr) {
+        fail("allocation into slot %zu, which is in use or out of range", index);
+    }
+    if (record) {
+        if (alignment) fprintf(record, "a %zu %zu %zu\n", index, size, alignment);
+        else fprintf(record, "a %zu %zu\n", index, size);
+    }
+
+    uint64_t start = rdtsc();
+    void* ptr = alignment ? kmalloc_aligned(size, alignment) : kmalloc(size);
+    account(alignment ? OP_ALIGNED : OP_ALLOC, rdtsc() - start);
+    if (!ptr) {
+        fail("%s(%zu) failed with %zu bytes live", alignment ? "kmalloc_aligned" : "kmalloc", size,
+             live_bytes);
+    }
+
+    slots[index] = (slot_t){ ptr, size, alignment };
+    live_bytes += size;
+    live_count++;
+    fill(index);
+    after_operation();
+}
+
+static void do_free(size_t index) {
+    if (index >= MAX_SLOTS || !slots[index].ptr) {
+        fail("free of slot %zu, which is empty or out of range", index);
+    }
+    if (record) fprintf(record, "f %zu\n", index);
+
+    verify(index);
+    uint64_t start = rdtsc();
+    kfree(slots[index].ptr);
+    account(OP_FREE, rdtsc() - start);
+
+    live_bytes -= slots[index].size;
+    live_count--;
+    slots[index].ptr = NULL;
+    after_operation();
+}
+
+static void set_cpu(uint32_t cpu) {
+    if (cpu >= cpu_count) {
+        fail("CPU %u out of range, running with %u", cpu, cpu_count);
+    }
+    if (record && cpu != host_cpu) fprintf(record, "c %u\n", cpu);
+    host_cpu = cpu;
+}
+
+/* Workloads */
+
+static uint64_t rng_state;
+
+static uint32_t rng(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+// Mostly small objects, some medium ones, a few page-sized and aligned ones
+static void random_alloc(size_t index) {
+    uint32_t kind = rng() % 100;
+    if (kind < 60) {
+        do_alloc(index, 1 + rng() % MAG_MAX_SIZE, 0);
+    } else if (kind < 85) {
+        do_alloc(index, MAG_MAX_SIZE + 1 + rng() % (LARGE_ALLOC - MAG_MAX_SIZE - 1), 0);
+    } else if (kind < 93) {
+        do_alloc(index, LARGE_ALLOC + rng() % (8 * PAGE_SIZE), 0);
+    } else {
+        do_alloc(index, 1 + rng() % 2048, (size_t)16 << (rng() % 10));
+    }
+}
+
+static void run_random(unsigned long ops, size_t max_live) {
+    if (max_live > MAX_SLOTS) max_live = MAX_SLOTS;
+    for (unsigned long i = 0; i < ops; i++) {
+        if (cpu_count > 1 && rng() % 8 == 0) {
+            set_cpu(rng() % cpu_count);
+        }
+        size_t index = rng() % max_live;
+        if (slots[index].ptr) {
+            do_free(index);
+        } else {
+            random_alloc(index);
+        }
+    }
+}
+
+static void run_trace(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        exit(1);
+    }
+    char line[256];
+    unsigned long number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        number++;
+        size_t index, size, alignment;
+        unsigned int cpu;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        } else if (sscanf(line, "a %zu %zu %zu", &index, &size, &alignment) == 3) {
+            do_alloc(index, size, alignment);
+        } else if (sscanf(line, "a %zu %zu", &index, &size) == 2) {
+            do_alloc(index, size, 0);
+        } else if (sscanf(line, "f %zu", &index) == 1) {
+            do_free(index);
+        } else if (sscanf(line, "c %u", &cpu) == 1) {
+            set_cpu(cpu);
+        } else {
+            fprintf(stderr, "%s:%lu: cannot parse: %s", path, number, line);
+            exit(1);
+        }
+    }
+    fclose(file);
+}
+
+static void free_all(void) {
+    for (size_t i = 0; i < MAX_SLOTS; i++) {
+        if (slots[i].ptr) {
+            do_free(i);
+        }
+    }
+}
+
+// Fragmentation is the share of the heap at its largest that never held
+// live data at the same time: (peak heap - peak live) / peak heap. Free
+// space, block headers, alignment gaps and magazine caches all count.
+static void report(const char* name) {
+    unsigned long ops = 0;
+    uint64_t total_ns = 0;
+    for (int kind = 0; kind < OP_KINDS; kind++) {
+        ops += stats[kind].count;
+        total_ns += stats[kind].total_ns;
+    }
+    double fragmentation = peak_heap ? 100.0 * (peak_heap - peak_live) / peak_heap : 0.0;
+    printf("%s: %lu operations, %.2f M ops/s, peak heap %zu KB for %zu KB live, "
+           "fragmentation %.1f%%\n",
+           name, ops, total_ns ? ops * 1000.0 / total_ns : 0.0, peak_heap / 1024, peak_live / 1024,
+           fragmentation);
+    for (int kind = 0; kind < OP_KINDS; kind++) {
+        if (stats[kind].count) {
+            printf("  %-16s %8lu calls, mean %5lu ns, max %7lu ns\n", op_names[kind],
+                   stats[kind].count, (unsigned long)(stats[kind].total_ns / stats[kind].count),
+                   (unsigned long)stats[kind].max_ns);
+        }
+    }
+}
+
+static unsigned long parse_number(const char* option, const char* value) {
+    char* end;
+    if (!value) {
+        fprintf(stderr, "alloc_test: %s needs a value\n", option);
+        exit(2);
+    }
+    unsigned long number = strtoul(value, &end, 0);
+    if (*end) {
+        fprintf(stderr, "alloc_test: bad value for %s: %s\n", option, value);
+        exit(2);
+    }
+    return number;
+}
+
+int main(int argc, char** argv) {
+    unsigned long seed = 1, ops = 100000, max_live = 1000;
+    const char* replay = NULL;
+    const char* record_path = NULL;
+    cpu_count = 4;
+
+    for (int i = 1; i < argc; i++) {
+        const char* option = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!strcmp(option, "--seed")) seed = parse_number(option, value), i++;
+        else if (!strcmp(option, "--ops")) ops = parse_number(option, value), i++;
+        else if (!strcmp(option, "--live")) max_live = parse_number(option, value), i++;
+        else if (!strcmp(option, "--cpus")) cpu_count = parse_number(option, value), i++;
+        else if (!strcmp(option, "--check-every")) check_every = parse_number(option, value), i++;
+        else if (!strcmp(option, "--replay") && value) replay = value, i++;
+        else if (!strcmp(option, "--record") && value) record_path = value, i++;
+        else if (!strcmp(option, "--verbose")) verbose = 1;
+        else {
+            fprintf(stderr, "usage: %s [--seed N] [--ops N] [--live N] [--cpus N] [--check-every N]\n"
+                            "       [--record FILE] [--replay FILE] [--verbose]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (cpu_count < 1 || cpu_count > MAX_CPUS) {
+        fprintf(stderr, "alloc_test: --cpus must be 1 to %d\n", MAX_CPUS);
+        return 2;
+    }
+
+    void* memory;
+    if (posix_memalign(&memory, HOST_ARENA_ALIGN, (size_t)HOST_ARENA_PAGES * PAGE_SIZE) == 0) {
+        arena = memory;
+    }
+    check_blocks = malloc(MAX_CHECK_BLOCKS * sizeof(uintptr_t));
+    check_claimed = malloc(MAX_CHECK_BLOCKS);
+    if (!arena || !check_blocks || !check_claimed) {
+        fprintf(stderr, "alloc_test: out of host memory\n");
+        return 1;
+    }
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        cpus[i].self = &cpus[i];
+        cpus[i].id = i;
+    }
+
+    memory_init(10240);     // As kernel_main does
+    check_heap();
+
+    if (record_path) {
+        record = fopen(record_path, "w");
+        if (!record) {
+            perror(record_path);
+            return 1;
+        }
+        fprintf(record, "# alloc_test --seed %lu --ops %lu --live %lu --cpus %u\n", seed, ops,
+                max_live, cpu_count);
+    }
+
+    char name[64];
+    if (replay) {
+        run_trace(replay);
+        snprintf(name, sizeof(name), "%s", replay);
+    } else {
+        rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+        run_random(ops, max_live);
+        snprintf(name, sizeof(name), "random seed %lu", seed);
+    }
+    free_all();
+    check_heap();
+    check_counters();
+    if (record) fclose(record);
+
+    // Everything is free again: the heap must be back to its initial pools
+    // apart from what the magazines still cache
+    if (heap_pool_count < heap_min_pools || large_bytes) {
+        fail("%zu pools and %zu large bytes left after freeing everything", heap_pool_count, large_bytes);
+    }
+
+    report(name);
+    return 0;
+}
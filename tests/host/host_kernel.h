@@ -0,0 +1,106 @@
+#ifndef HOST_KERNEL_H
+#define HOST_KERNEL_H
+
+/*
+ * Forced in front of kernel sources built for the host (gcc -include). It
+ * defines the include guards of the kernel headers that need ring 0 - inline
+ * asm for interrupts, %gs for this_cpu, the higher-half direct map - and
+ * provides host versions of what they declare, so the kernel headers skip
+ * their own bodies. Everything else comes from the real headers.
+ */
+#define CPU_H
+#define SPINLOCK_H
+#define SMP_H
+#define PAGING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* cpu.h: interrupts do not exist, the "TSC" counts nanoseconds */
+#define EFLAGS_IF 0x00000200
+
+static inline void irq_enable(void) {}
+static inline void irq_disable(void) {}
+static inline uint32_t irq_save(void) { return EFLAGS_IF; }
+static inline void irq_restore(uint32_t flags) { (void)flags; }
+
+static inline uint64_t rdtsc(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/* spinlock.h: single threaded, so a lock that is already held is a bug */
+typedef struct spinlock {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+void host_lock_error(const char* what);
+
+static inline void spin_lock(spinlock_t* lock) {
+    if (lock->locked) host_lock_error("spin_lock on a held lock");
+    lock->locked = 1;
+}
+
+static inline int spin_trylock(spinlock_t* lock) {
+    if (lock->locked) return 0;
+    lock->locked = 1;
+    return 1;
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+    if (!lock->locked) host_lock_error("spin_unlock on a free lock");
+    lock->locked = 0;
+}
+
+static inline uint32_t spin_lock_irqsave(spinlock_t* lock) {
+    spin_lock(lock);
+    return EFLAGS_IF;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags) {
+    (void)flags;
+    spin_unlock(lock);
+}
+
+/* smp.h: the harness picks which "CPU" each operation runs on */
+#define MAX_CPUS 8
+
+struct task;
+
+typedef struct cpu {
+    struct cpu* self;
+    uint32_t id;
+    uint32_t apic_id;
+    volatile int online;
+    struct task* current;
+    struct task* idle_task;
+    struct task* prev_task;
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+extern uint32_t cpu_count;
+extern uint32_t host_cpu;
+
+static inline cpu_t* this_cpu(void) {
+    return &cpus[host_cpu];
+}
+
+/* paging.h: "physical" address 0 is host address host_phys_base; the heap
+   test leaves that at 0, the page allocator test points it at its memory */
+#define DIRECT_MAP_SIZE 0x30000000
+
+extern uintptr_t host_phys_base;
+
+static inline void* phys_to_virt(uintptr_t phys) {
+    return (void*)(phys + host_phys_base);
+}
+
+static inline uintptr_t virt_to_phys(const void* virt) {
+    return (uintptr_t)virt - host_phys_base;
+}
+
+#endif // HOST_KERNEL_H
@@ -0,0 +1,570 @@
+/*
+ * Host build of the physical memory manager (src/kernel/pmm.c), checked
+ * against a reference model. Each run makes up a multiboot memory map with
+ * holes, a command line and modules, boots pmm.c on it, then runs a random
+ * mix of pmm_alloc, pmm_alloc_range and frees. The model keeps the state of
+ * every frame and decides independently whether each request can be met:
+ * with full buddy merging, a block of 2^order frames is available exactly
+ * when some naturally aligned window of that size is free.
+ *
+ * Usage:
+ *   pmm_test [--seed N] [--ops N] [--live N] [--check-every N] [--verbose]
+ *
+ * After every operation (or every N) the free lists are walked and checked;
+ * see check_pmm. The first word of every allocated frame holds a pattern
+ * that is verified when the frame is freed, and the bootloader's data must
+ * survive the whole run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "pmm.c"
+
+#define HOST_MEMORY_SIZE    (48 * 1024 * 1024)
+#define HOST_FRAMES         (HOST_MEMORY_SIZE / PAGE_SIZE)
+#define MAX_LIVE            1024
+#define MAX_REGIONS         16
+#define MAX_MODULES         3
+
+/* Kernel symbols pmm.c links against */
+
+uint8_t host_memory[HOST_MEMORY_SIZE] __attribute__((aligned(PAGE_SIZE)));
+uintptr_t host_phys_base;
+
+// The kernel image sits at 1 MB of the fake physical memory, as the linker
+// script puts it; its end is deliberately not page aligned
+#define KERNEL_IMAGE_START  0x100000
+#define KERNEL_IMAGE_END    0x27F800
+#define STRINGIFY(x)        #x
+#define SYMBOL_AT(name, offset) ".globl " #name "\n.set " #name ", host_memory + " STRINGIFY(offset) "\n"
+__asm__(SYMBOL_AT(_kernel_start, KERNEL_IMAGE_START) SYMBOL_AT(_kernel_end, KERNEL_IMAGE_END));
+
+static int verbose;
+static unsigned long error_messages;
+static unsigned long operation;     // Index of the operation running, for reports
+
+static void fail(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "pmm_test: operation %lu: ", operation);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+    exit(1);
+}
+
+void host_lock_error(const char* what) {
+    fail("%s", what);
+}
+
+void terminal_writestring(const char* data) {
+    if (strncmp(data, "Error", 5) == 0) {
+        error_messages++;
+        fprintf(stderr, "pmm_test: operation %lu: kernel said: %s", operation, data);
+    } else if (verbose) {
+        fputs(data, stdout);
+    }
+}
+
+int kprintf(const char* fmt, ...) {
+    if (!verbose) return 0;
+    va_list args;
+    va_start(args, fmt);
+    int length = vprintf(fmt, args);
+    va_end(args);
+    return length;
+}
+
+int ksnprintf(char* buffer, size_t size, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int length = vsnprintf(buffer, size, fmt, args);
+    va_end(args);
+    return length;
+}
+
+// Tracing stays off
+volatile int trace_active;
+void trace_record(trace_type_t type, uint32_t arg0, uint32_t arg1) { (void)type; (void)arg0; (void)arg1; }
+
+/* Random numbers */
+
+static uint64_t rng_state;
+
+static uint32_t rng(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/* The made-up machine */
+
+typedef struct range {
+    uint64_t start;
+    uint64_t end;
+} range_t;
+
+static range_t available[MAX_REGIONS];     // Usable RAM as the memory map reports it
+static size_t available_count;
+static range_t boot_data[4 + 2 * MAX_MODULES];
+static size_t boot_data_count;
+static uint8_t* boot_copy;                  // What the bootloader left, to compare at the end
+
+static void* phys(uintptr_t addr) {
+    return host_memory + addr;
+}
+
+static void add_boot_data(uint64_t start, uint64_t size) {
+    boot_data[boot_data_count++] = (range_t){ start, start + size };
+}
+
+// Anywhere from the kernel image to 8 MB, so the descriptors often have to
+// be placed around it, and clear of what the bootloader already put down
+static uintptr_t boot_spot(uint64_t size) {
+    while (1) {
+        uintptr_t start = (KERNEL_IMAGE_END + rng() % (8 * 1024 * 1024 - KERNEL_IMAGE_END - size)) & ~(uintptr_t)7;
+        size_t i = 0;
+        while (i < boot_data_count && (start + size <= boot_data[i].start || boot_data[i].end <= start)) i++;
+        if (i == boot_data_count) {
+            return start;
+        }
+    }
+}
+
+static uintptr_t add_string(const char* text) {
+    uintptr_t addr = boot_spot(strlen(text) + 1);
+    strcpy(phys(addr), text);
+    add_boot_data(addr, strlen(text) + 1);
+    return addr;
+}
+
+// Low memory and RAM above 1 MB with up to three holes in it, some not page
+// aligned; one run in eight has only mem_upper to go on
+static multiboot_info_t* make_machine(void) {
+    uintptr_t info_addr = rng() % 2 ? 0x9000 : boot_spot(sizeof(multiboot_info_t));
+    multiboot_info_t* mbi = phys(info_addr);
+    memset(mbi, 0, sizeof(*mbi));
+    add_boot_data(info_addr, sizeof(*mbi));
+
+    uint64_t top = HOST_MEMORY_SIZE - (rng() % 64) * PAGE_SIZE - rng() % PAGE_SIZE;
+    if (rng() % 8 == 0) {
+        mbi->flags |= MULTIBOOT_INFO_MEMORY;
+        mbi->mem_upper = (uint32_t)((top - 0x100000) / 1024);
+        available[available_count++] = (range_t){ 0x100000, 0x100000 + (uint64_t)mbi->mem_upper * 1024 };
+    } else {
+        range_t holes[3];
+        size_t hole_count = rng() % 4;
+        for (size_t i = 0; i < hole_count; i++) {
+            uint64_t start = 0x100000 + rng() % (top - 0x100000);
+            uint64_t size = rng() % 2 ? rng() % (64 * PAGE_SIZE) : rng() % (2 * 1024 * 1024);
+            holes[i] = (range_t){ start, start + size + 1 };
+        }
+        // Sort the holes, then report what lies between them
+        for (size_t i = 1; i < hole_count; i++) {
+            for (size_t j = i; j > 0 && holes[j].start < holes[j - 1].start; j--) {
+                range_t swap = holes[j];
+                holes[j] = holes[j - 1];
+                holes[j - 1] = swap;
+            }
+        }
+        available[available_count++] = (range_t){ 0, 0x9F000 };
+        uint64_t cursor = 0x100000;
+        for (size_t i = 0; i < hole_count; i++) {
+            if (holes[i].start > cursor) {
+                available[available_count++] = (range_t){ cursor, holes[i].start };
+            }
+            if (holes[i].end > cursor) cursor = holes[i].end;
+        }
+        if (cursor < top) {
+            available[available_count++] = (range_t){ cursor, top };
+        }
+
+        // Reserved entries between the available ones, as a BIOS reports them
+        uintptr_t map_addr = rng() % 2 ? 0xA000 : boot_spot(2 * MAX_REGIONS * sizeof(multiboot_mmap_entry_t));
+        multiboot_mmap_entry_t* entry = phys(map_addr);
+        uint64_t previous_end = 0;
+        for (size_t i = 0; i < available_count; i++) {
+            if (available[i].start > previous_end) {
+                *entry++ = (multiboot_mmap_entry_t){ sizeof(*entry) - 4, previous_end,
+                                                     available[i].start - previous_end, 2 };
+            }
+            *entry++ = (multiboot_mmap_entry_t){ sizeof(*entry) - 4, available[i].start,
+                                                 available[i].end - available[i].start,
+                                                 MULTIBOOT_MEMORY_AVAILABLE };
+            previous_end = available[i].end;
+        }
+        mbi->flags |= MULTIBOOT_INFO_MEM_MAP;
+        mbi->mmap_addr = map_addr;
+        mbi->mmap_length = (uint32_t)((uintptr_t)entry - (uintptr_t)phys(map_addr));
+        add_boot_data(map_addr, mbi->mmap_length);
+    }
+
+    mbi->flags |= MULTIBOOT_INFO_CMDLINE;
+    mbi->cmdline = add_string("bench hz=1000 timeslice=4 tickless=1");
+
+    uint32_t module_count = rng() % (MAX_MODULES + 1);
+    if (module_count) {
+        uintptr_t list_addr = boot_spot(module_count * sizeof(multiboot_module_t));
+        add_boot_data(list_addr, module_count * sizeof(multiboot_module_t));
+        multiboot_module_t* modules = phys(list_addr);
+        for (uint32_t i = 0; i < module_count; i++) {
+            uintptr_t size = 1 + rng() % (96 * 1024);
+            uintptr_t start = boot_spot(size);
+            modules[i] = (multiboot_module_t){ start, start + size, 0, 0 };
+            memset(phys(start), 0xA5, size);
+            add_boot_data(start, size);
+            if (rng() % 2) {
+                modules[i].string = add_string("initrd");
+            }
+        }
+        mbi->flags |= MULTIBOOT_INFO_MODS;
+        mbi->mods_count = module_count;
+        mbi->mods_addr = list_addr;
+    }
+    return mbi;
+}
+
+/* Reference model: one state per frame */
+
+enum { FRAME_RESERVED, FRAME_FREE, FRAME_ALLOCATED };
+
+static uint8_t model[HOST_FRAMES];
+static uint8_t covered[HOST_FRAMES];
+static size_t model_free;
+
+typedef struct allocation {
+    uintptr_t addr;
+    size_t count;
+    int order;                  // -1 for pmm_alloc_range
+} allocation_t;
+
+static allocation_t live[MAX_LIVE];
+
+static int overlaps(uint64_t start, uint64_t end, uint64_t frame) {
+    return start < (frame + 1) * PAGE_SIZE && frame * PAGE_SIZE < end;
+}
+
+static int inside_available(uint64_t start, uint64_t end) {
+    for (size_t i = 0; i < available_count; i++) {
+        if (available[i].start <= start && end <= available[i].end) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Which frames pmm_init should have handed out, worked out from the machine
+// description rather than from pmm.c's own bookkeeping
+static void build_model(void) {
+    uint64_t highest = 0;
+    for (size_t i = 0; i < available_count; i++) {
+        if (available[i].end > highest) highest = available[i].end;
+    }
+    if (page_count != highest / PAGE_SIZE) {
+        fail("%zu page descriptors for %llu bytes of RAM", page_count, (unsigned long long)highest);
+    }
+
+    uint64_t meta_start = metadata_start, meta_end = metadata_start + metadata_size;
+    if (meta_start % PAGE_SIZE || meta_start < KERNEL_IMAGE_END || !inside_available(meta_start, meta_end)) {
+        fail("page descriptors at %#llx-%#llx are not in free RAM above the kernel",
+             (unsigned long long)meta_start, (unsigned long long)meta_end);
+    }
+    for (size_t i = 0; i < boot_data_count; i++) {
+        if (boot_data[i].start < meta_end && meta_start < boot_data[i].end) {
+            fail("page descriptors at %#llx-%#llx overlap bootloader data at %#llx-%#llx",
+                 (unsigned long long)meta_start, (unsigned long long)meta_end,
+                 (unsigned long long)boot_data[i].start, (unsigned long long)boot_data[i].end);
+        }
+    }
+
+    for (size_t frame = 0; frame < page_count; frame++) {
+        uint64_t start = frame * PAGE_SIZE;
+        int usable = start >= 0x100000 && inside_available(start, start + PAGE_SIZE) &&
+                     !overlaps(KERNEL_IMAGE_START, KERNEL_IMAGE_END, frame) &&
+                     !overlaps(meta_start, meta_end, frame);
+        for (size_t i = 0; usable && i < boot_data_count; i++) {
+            usable = !overlaps(boot_data[i].start, boot_data[i].end, frame);
+        }
+        model[frame] = usable ? FRAME_FREE : FRAME_RESERVED;
+        model_free += usable;
+    }
+    if (usable_count != model_free) {
+        fail("pmm_init found %zu usable frames, the model %zu", usable_count, model_free);
+    }
+}
+
+// First naturally aligned window of 2^order free frames, or page_count
+static size_t model_window(unsigned int order) {
+    size_t size = (size_t)1 << order;
+    for (size_t start = 0; start + size <= page_count; start += size) {
+        size_t i = 0;
+        while (i < size && model[start + i] == FRAME_FREE) i++;
+        if (i == size) {
+            return start;
+        }
+    }
+    return page_count;
+}
+
+/*
+ * Page allocator invariants:
+ *  - every block on free_area[o] heads 2^o naturally aligned frames the
+ *    model says are free, carries PAGE_FREE and order o, and the lists are
+ *    properly linked with counts and free_area_mask to match;
+ *  - no free block has a free buddy of the same order (merging is complete);
+ *  - the free blocks cover every free frame exactly once, and free_count
+ *    agrees with the model;
+ *  - PAGE_RESERVED is set on exactly the frames the model reserves.
+ */
+static void check_pmm(void) {
+    memset(covered, 0, page_count);
+    size_t free_pages = 0, blocks = 0;
+    for (unsigned int order = 0; order <= PMM_MAX_ORDER; order++) {
+        size_t size = (size_t)1 << order, count = 0;
+        page_t* prev = NULL;
+        for (page_t* page = free_area[order]; page; prev = page, page = page->next) {
+            size_t frame = page_frame(page);
+            if (++count > page_count) {
+                fail("free list of order %u loops", order);
+            }
+            if (page->prev != prev) {
+                fail("frame %zu on free list %u has a wrong prev link", frame, order);
+            }
+            if (!(page->flags & PAGE_FREE) || page->order != order || frame % size ||
+                frame + size > page_count) {
+                fail("frame %zu on free list %u: flags %#x, order %u", frame, order, page->flags,
+                     page->order);
+            }
+            for (size_t i = frame; i < frame + size; i++) {
+                if (model[i] != FRAME_FREE || covered[i]) {
+                    fail("free block %zu/%u covers frame %zu, which is %s", frame, order, i,
+                         covered[i] ? "in another free block" :
+                         model[i] == FRAME_RESERVED ? "reserved" : "allocated");
+                }
+                covered[i] = 1;
+            }
+            size_t buddy = frame ^ size;
+            if (order < PMM_MAX_ORDER && buddy < page_count && (pages[buddy].flags & PAGE_FREE) &&
+                pages[buddy].order == order) {
+                fail("free blocks %zu and %zu of order %u were not merged", frame, buddy, order);
+            }
+            free_pages += size;
+        }
+        if (count != free_area_count[order] || !!(free_area_mask & (1U << order)) != !!count) {
+            fail("free list %u holds %zu blocks, counted %zu, mask %#x", order, count,
+                 free_area_count[order], free_area_mask);
+        }
+        blocks += count;
+    }
+
+    for (size_t frame = 0; frame < page_count; frame++) {
+        if (model[frame] == FRAME_FREE && !covered[frame]) {
+            fail("free frame %zu is on no free list", frame);
+        }
+        if (!!(pages[frame].flags & PAGE_RESERVED) != (model[frame] == FRAME_RESERVED)) {
+            fail("frame %zu: PAGE_RESERVED is %s", frame, model[frame] == FRAME_RESERVED ? "clear" : "set");
+        }
+        if ((pages[frame].flags & PAGE_FREE) && !blocks--) {
+            fail("more frames marked PAGE_FREE than there are free blocks");
+        }
+    }
+    if (blocks) {
+        fail("%zu free blocks have no PAGE_FREE head", blocks);
+    }
+    if (free_pages != free_count || free_count != model_free) {
+        fail("free lists hold %zu frames, free_count is %zu, the model %zu", free_pages, free_count,
+             model_free);
+    }
+}
+
+/* Operations */
+
+static unsigned long check_every = 1;
+static unsigned long allocations, failures, frees;
+
+static uint32_t pattern(size_t frame) {
+    return (uint32_t)(frame * 2654435761u) ^ 0x5A5A5A5A;
+}
+
+static void after_operation(void) {
+    if (error_messages) {
+        fail("the allocator reported an error");
+    }
+    if (check_every && operation % check_every == 0) {
+        check_pmm();
+    }
+    operation++;
+}
+
+// Whether the model can meet a request, and the returned block if it did
+static void check_alloc(const char* what, uintptr_t addr, size_t count, size_t align, unsigned int order) {
+    size_t window = order <= PMM_MAX_ORDER ? model_window(order) : page_count;
+    if (!addr) {
+        if (window != page_count) {
+            fail("%s(%zu pages) failed with frames %zu-%zu free", what, count, window,
+                 window + ((size_t)1 << order) - 1);
+        }
+        failures++;
+        return;
+    }
+    if (window == page_count) {
+        fail("%s(%zu pages) returned %#lx, the model has no room", what, count, (unsigned long)addr);
+    }
+    size_t frame = addr / PAGE_SIZE;
+    if (addr % PAGE_SIZE || frame % align || frame + count > page_count) {
+        fail("%s(%zu pages, align %zu) returned %#lx", what, count, align, (unsigned long)addr);
+    }
+    for (size_t i = frame; i < frame + count; i++) {
+        if (model[i] != FRAME_FREE) {
+            fail("%s returned frame %zu, which is %s", what, i,
+                 model[i] == FRAME_RESERVED ? "reserved" : "allocated");
+        }
+        model[i] = FRAME_ALLOCATED;
+        *(uint32_t*)phys(i * PAGE_SIZE) = pattern(i);
+    }
+    model_free -= count;
+    allocations++;
+}
+
+static void do_alloc(size_t index) {
+    allocation_t* slot = &live[index];
+    if (rng() % 2) {
+        // Mostly single pages and small blocks, now and then a big one
+        uint32_t kind = rng() % 100;
+        unsigned int order = kind < 60 ? rng() % 3 : kind < 90 ? 3 + rng() % 4 : 7 + rng() % (PMM_MAX_ORDER - 6);
+        uintptr_t addr = pmm_alloc(order);
+        check_alloc("pmm_alloc", addr, (size_t)1 << order, (size_t)1 << order, order);
+        *slot = (allocation_t){ addr, (size_t)1 << order, (int)order };
+    } else {
+        size_t count = rng() % 4 ? 1 + rng() % 40 : 1 + rng() % 1500;
+        size_t align = (size_t)1 << (rng() % 6);
+        size_t span = count > align ? count : align;
+        unsigned int order = 0;
+        while (((size_t)1 << order) < span) order++;
+        uintptr_t addr = pmm_alloc_range(count, align);
+        check_alloc("pmm_alloc_range", addr, count, align, order);
+        *slot = (allocation_t){ addr, count, -1 };
+    }
+    after_operation();
+}
+
+static void do_free(size_t index) {
+    allocation_t* slot = &live[index];
+    size_t frame = slot->addr / PAGE_SIZE;
+    for (size_t i = frame; i < frame + slot->count; i++) {
+        if (*(uint32_t*)phys(i * PAGE_SIZE) != pattern(i)) {
+            fail("allocated frame %zu was overwritten", i);
+        }
+        model[i] = FRAME_FREE;
+    }
+    if (slot->order >= 0) {
+        pmm_free(slot->addr, (unsigned int)slot->order);
+    } else {
+        pmm_free_range(slot->addr, slot->count);
+    }
+    model_free += slot->count;
+    slot->addr = 0;
+    frees++;
+    after_operation();
+}
+
+static unsigned long parse_number(const char* option, const char* value) {
+    char* end;
+    if (!value) {
+        fprintf(stderr, "pmm_test: %s needs a value\n", option);
+        exit(2);
+    }
+    unsigned long number = strtoul(value, &end, 0);
+    if (*end) {
+        fprintf(stderr, "pmm_test: bad value for %s: %s\n", option, value);
+        exit(2);
+    }
+    return number;
+}
+
+int main(int argc, char** argv) {
+    unsigned long seed = 1, ops = 100000, max_live = 256;
+    for (int i = 1; i < argc; i++) {
+        const char* option = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!strcmp(option, "--seed")) seed = parse_number(option, value), i++;
+        else if (!strcmp(option, "--ops")) ops = parse_number(option, value), i++;
+        else if (!strcmp(option, "--live")) max_live = parse_number(option, value), i++;
+        else if (!strcmp(option, "--check-every")) check_every = parse_number(option, value), i++;
+        else if (!strcmp(option, "--verbose")) verbose = 1;
+        else {
+            fprintf(stderr, "usage: %s [--seed N] [--ops N] [--live N] [--check-every N] [--verbose]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (max_live < 1 || max_live > MAX_LIVE) {
+        fprintf(stderr, "pmm_test: --live must be 1 to %d\n", MAX_LIVE);
+        return 2;
+    }
+
+    host_phys_base = (uintptr_t)host_memory;
+    rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    multiboot_info_t* mbi = make_machine();
+    boot_copy = malloc(HOST_MEMORY_SIZE);
+    if (!boot_copy) {
+        fprintf(stderr, "pmm_test: out of host memory\n");
+        return 1;
+    }
+    memcpy(boot_copy, host_memory, HOST_MEMORY_SIZE);
+
+    pmm_init(mbi);
+    if (error_messages) {
+        fail("pmm_init reported an error");
+    }
+    build_model();
+    check_pmm();
+
+    for (unsigned long i = 0; i < ops; i++) {
+        size_t index = rng() % max_live;
+        if (live[index].addr) {
+            do_free(index);
+        } else {
+            do_alloc(index);
+        }
+    }
+    for (size_t i = 0; i < max_live; i++) {
+        if (live[i].addr) {
+            do_free(i);
+        }
+    }
+    check_pmm();
+
+    // Everything is free again, so every block must have merged back into
+    // the largest naturally aligned pieces of each run of usable frames
+    for (size_t frame = 0; frame < page_count; frame++) {
+        if (!(pages[frame].flags & PAGE_FREE)) {
+            continue;
+        }
+        unsigned int order = pages[frame].order;
+        size_t parent = frame & ~(((size_t)2 << order) - 1);
+        if (order < PMM_MAX_ORDER && parent + ((size_t)2 << order) <= page_count) {
+            size_t i = parent;
+            while (i < parent + ((size_t)2 << order) && model[i] == FRAME_FREE) i++;
+            if (i == parent + ((size_t)2 << order)) {
+                fail("free block %zu/%u could have merged into order %u", frame, order, order + 1);
+            }
+        }
+    }
+    for (size_t i = 0; i < boot_data_count; i++) {
+        if (memcmp(host_memory + boot_data[i].start, boot_copy + boot_data[i].start,
+                   boot_data[i].end - boot_data[i].start)) {
+            fail("bootloader data at %#llx-%#llx was overwritten", (unsigned long long)boot_data[i].start,
+                 (unsigned long long)boot_data[i].end);
+        }
+    }
+    if (verbose) pmm_stats();
+
+    printf("pmm seed %lu: %zu of %zu frames usable, %lu allocations, %lu refused as the model "
+           "predicted, %lu frees\n", seed, usable_count, page_count, allocations, failures, frees);
+    return 0;
+}